@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/capture.c
\ No newline at end of file
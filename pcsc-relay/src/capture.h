@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/capture.h
\ No newline at end of file
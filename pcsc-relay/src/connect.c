@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/connect.c
\ No newline at end of file
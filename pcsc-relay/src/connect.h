@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/connect.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/fault.c
\ No newline at end of file
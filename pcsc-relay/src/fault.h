@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/fault.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/frame.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/frame.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/inproc.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/inproc.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/mux.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/mux.h
\ No newline at end of file
@@ -176,9 +176,14 @@ int main (int argc, char **argv)
     vpcdport = args_info.vpcd_port_arg;
     if (args_info.vpcd_hostname_given)
         vpcdhostname = args_info.vpcd_hostname_arg;
+    vpcdtimeout = args_info.vpcd_timeout_arg;
+    if (args_info.vpcd_sockopts_given)
+        vpcdsockopts = args_info.vpcd_sockopts_arg;
     viccport = args_info.vicc_port_arg;
     if (args_info.vicc_hostname_given)
         vicchostname = args_info.vicc_hostname_arg;
+    if (args_info.vicc_sockopts_given)
+        viccsockopts = args_info.vicc_sockopts_arg;
     if (args_info.vicc_atr_given)
         viccatr = args_info.vicc_atr_arg;
 
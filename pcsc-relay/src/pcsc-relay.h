@@ -59,8 +59,11 @@ extern unsigned int readernum;
 extern struct sc_driver driver_vpcd;
 extern unsigned int vpcdport;
 extern char *vpcdhostname;
+extern char *vpcdsockopts;
+extern int vpcdtimeout;
 extern unsigned int viccport;
 extern char *vicchostname;
+extern char *viccsockopts;
 extern char *viccatr;
 
 void hexdump(const char *label, unsigned char *buf, size_t len);
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/reactor.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/reactor.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/shard.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/shard.h
\ No newline at end of file
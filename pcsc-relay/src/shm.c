@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/shm.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/shm.h
\ No newline at end of file
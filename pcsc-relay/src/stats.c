@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/stats.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/stats.h
\ No newline at end of file
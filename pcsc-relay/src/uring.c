@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/uring.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/uring.h
\ No newline at end of file
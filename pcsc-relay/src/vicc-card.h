@@ -0,0 +1 @@
+../../virtualsmartcard/src/vpcd/vicc-card.h
\ No newline at end of file
@@ -30,6 +30,7 @@
 
 unsigned int viccport = VPCDPORT;
 char *vicchostname = NULL;
+char *viccsockopts = NULL;
 char *viccatr = "3B80800101";
 unsigned char atr[256];
 size_t atr_len = 0;
@@ -39,6 +40,7 @@ size_t atr_len = 0;
 static int _vicc_connect(driver_data_t **driver_data)
 {
     struct vicc_ctx *ctx;
+    struct vicc_sockopts sockopts;
     const long secs = 300;
 
     if (!driver_data)
@@ -70,6 +72,12 @@ static int _vicc_connect(driver_data_t **driver_data)
         atr_len = 0;
     }
 
+    vicc_sockopts_default(&sockopts);
+    if (vicc_parse_sockopts(&sockopts, viccsockopts) != 0) {
+        RELAY_ERROR("Could not parse socket options %s\n", viccsockopts);
+        return 0;
+    }
+
 
     ctx = vicc_init(vicchostname, viccport);
     if (!ctx) {
@@ -77,6 +85,11 @@ static int _vicc_connect(driver_data_t **driver_data)
         return 0;
     }
     *driver_data = ctx;
+    /* we take the role of the card, so vpcd is the one to negotiate */
+    vicc_set_features(ctx, 0);
+    if (vicc_set_sockopts(ctx, &sockopts) != 0) {
+        RELAY_ERROR("Could not set socket options\n");
+    }
 
     INFO("Waiting for VPCD on port %hu for %ld seconds\n",
             (unsigned short) viccport, secs);
@@ -125,6 +138,9 @@ static int vicc_receive_capdu(driver_data_t *driver_data,
                 case VPCD_CTRL_RESET:
                     // ignore reset, power on, power off
                     break;
+                case VPCD_CTRL_HELLO:
+                    // stick to the plain protocol, vpcd will fall back to it
+                    break;
                 case VPCD_CTRL_ATR:
                     if (vicc_transmit(ctx, atr_len, atr, NULL) < 0) {
                         RELAY_ERROR("could not send ATR\n");
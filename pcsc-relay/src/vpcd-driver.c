@@ -22,6 +22,7 @@
 
 #include "pcsc-relay.h"
 #include "vpcd.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -30,17 +31,25 @@
 
 unsigned int vpcdport = VPCDPORT;
 char *vpcdhostname = NULL;
+char *vpcdsockopts = NULL;
+int vpcdtimeout = 0;
 
 
 static int vpcd_connect(driver_data_t **driver_data)
 {
     struct vicc_ctx *ctx;
+    struct vicc_sockopts sockopts;
 
     int vicc_found = 0;
 
     if (!driver_data)
         return 0;
 
+    vicc_sockopts_default(&sockopts);
+    if (vicc_parse_sockopts(&sockopts, vpcdsockopts) != 0) {
+        RELAY_ERROR("Could not parse socket options %s\n", vpcdsockopts);
+        return 0;
+    }
 
     ctx = vicc_init(vpcdhostname, vpcdport);
     if (!ctx) {
@@ -48,6 +57,10 @@ static int vpcd_connect(driver_data_t **driver_data)
         return 0;
     }
     *driver_data = ctx;
+    if (vicc_set_sockopts(ctx, &sockopts) != 0) {
+        RELAY_ERROR("Could not set socket options\n");
+    }
+    vicc_set_timeout(ctx, vpcdtimeout / 1000, (vpcdtimeout % 1000) * 1000);
 
 
     INFO("Waiting for virtual ICC on port %hu\n",
@@ -82,6 +95,16 @@ static int vpcd_connect(driver_data_t **driver_data)
 static int vpcd_disconnect(driver_data_t *driver_data)
 {
     struct vicc_ctx *ctx = driver_data;
+    struct vicc_stats stats;
+
+    if (vicc_get_stats(ctx, &stats, 0) == 0 && stats.commands)
+        INFO("%llu commands, %llu failures (%llu timeouts), %llu ejects, "
+                "total p50/p99 %llu/%llu us, think p50/p99 %llu/%llu us\n",
+                stats.commands, stats.failures, stats.timeouts, stats.ejects,
+                vicc_histogram_percentile(&stats.total, 50),
+                vicc_histogram_percentile(&stats.total, 99),
+                vicc_histogram_percentile(&stats.think, 50),
+                vicc_histogram_percentile(&stats.think, 99));
 
     if (vicc_eject(ctx) != 0)
         DEBUG("Could not eject virtual ICC\n");
@@ -100,21 +123,20 @@ static int vpcd_transmit(driver_data_t *driver_data,
 {
     struct vicc_ctx *ctx = driver_data;
 
-    unsigned char *rapdu = NULL;
     int r = 0;
-    ssize_t size = vicc_transmit(ctx, send_len, send, &rapdu);
+    ssize_t size = vicc_transmit_into(ctx, send_len, send, recv, *recv_len);
 
     if (size < 0) {
-        RELAY_ERROR("could not send apdu or receive rapdu\n");
-        goto err;
-    }
-
-    if (*recv_len < size) {
-        RELAY_ERROR("Not enough memory for rapdu\n");
+        if (errno == ENOBUFS) {
+            RELAY_ERROR("Not enough memory for rapdu\n");
+        } else if (errno == ETIMEDOUT) {
+            RELAY_ERROR("virtual ICC did not respond in time\n");
+        } else {
+            RELAY_ERROR("could not send apdu or receive rapdu\n");
+        }
         goto err;
     }
 
-    memcpy(recv, rapdu, size);
     *recv_len = size;
 
     r = 1;
@@ -123,8 +145,6 @@ err:
     if (!r)
         *recv_len = 0;
 
-    free(rapdu);
-
     return r;
 }
 
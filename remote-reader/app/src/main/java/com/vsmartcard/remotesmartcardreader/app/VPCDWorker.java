@@ -121,7 +121,10 @@ class VPCDWorker extends AsyncTask<VPCDWorker.VPCDWorkerParams, Void, Void> {
                             out = reader.getATR();
                             break;
                         default:
-                            throw new IOException("Unhandled command from VPCD.");
+                            // e.g. the hello of the protocol extensions,
+                            // which VPCD expects to be ignored by us
+                            Log.i(this.getClass().getName(), "Ignored command " + Hex.getHexString(in) + " from VPCD");
+                            break;
                     }
                 } else {
                     Log.i(this.getClass().getName(), "C-APDU: " + Hex.getHexString(in));
@@ -114,26 +114,388 @@ void log_msg(const int priority, const char *fmt, ...)
 static struct vicc_ctx *ctx[VICC_MAX_SLOTS];
 const char *hostname = NULL;
 static const char openport[] = "/dev/null";
+/* Unix domain socket, shared memory or card library requested via
+ * DEVICENAME, including its prefix */
+static const char *localname = NULL;
+static int use_inproc = 0;
+/* shared by all slots which requested it via DEVICENAME */
+static struct vicc_reactor *reactor = NULL;
+static int use_reactor = 0;
+/* listening socket shared by all slots which requested it via DEVICENAME */
+static struct vicc_mux *mux = NULL;
+static int use_mux = 0;
+/* hosts shared by all slots which requested them via DEVICENAME, the file the
+ * slots' hosts are written to and the hosts written last */
+static struct vicc_shard *shard = NULL;
+static char shard_map_path[MAX_READERNAME];
+static struct vicc_shard_entry shard_map[VICC_MAX_SLOTS];
+static size_t shard_map_len = 0;
+/* hosts, name of the reader group and file for the map of the slots'
+ * hosts requested via DEVICENAME */
+static char shard_hosts[MAX_READERNAME];
+static char group[VICC_SHARD_IDENTITY_MAX - 6];
+static char shardmap_path[MAX_READERNAME];
+/* protocol features requested via DEVICENAME */
+static unsigned int features = VPCD_FEATURES_DEFAULT;
+/* milliseconds a call to vicc may take, requested via DEVICENAME */
+static long timeout = 0;
+/* standby connections and failover policy requested via DEVICENAME */
+static long standby = 0;
+static int failover_policy = VICC_FAILOVER_REINSERT;
+/* smallest command to compress, requested via DEVICENAME */
+static long deflate_threshold = 0;
+/* interval and tolerated misses of heartbeats, requested via DEVICENAME */
+static long heartbeat_interval = 0;
+static long heartbeat_misses = 0;
+/* milliseconds for resuming a lost session, requested via DEVICENAME */
+static long resume_window = 0;
+/* shared by all slots which requested it via DEVICENAME */
+static struct vicc_capture *capture = NULL;
+static char capture_path[MAX_READERNAME];
+/* scenario of faults shared by all slots which requested it via DEVICENAME */
+static struct vicc_fault *fault = NULL;
+static char fault_path[MAX_READERNAME];
+/* socket options requested via DEVICENAME */
+static struct vicc_sockopts sockopts;
+static int sockopts_given = 0;
+/* slots which wait for events of vicc in pcscd's polling thread */
+static int use_events[VICC_MAX_SLOTS];
+
+static int parse_options(const char *options)
+{
+    const char *end;
+    char *timeout_end, *standby_end, *deflate_end, *heartbeat_end, *resume_end;
+    size_t len;
+
+    while (options && *options) {
+        end = strchr(options, ',');
+        len = end ? (size_t) (end - options) : strlen(options);
+        if (len == strlen("reactor") && strncmp(options, "reactor", len) == 0) {
+            use_reactor = 1;
+        } else if (len == strlen("mux") && strncmp(options, "mux", len) == 0) {
+            use_mux = 1;
+        } else if (len == strlen("tagged")
+                && strncmp(options, "tagged", len) == 0) {
+            features |= VPCD_FEATURE_TAGGED;
+        } else if (len == strlen("plain")
+                && strncmp(options, "plain", len) == 0) {
+            features = 0;
+        } else if (len == strlen("events")
+                && strncmp(options, "events", len) == 0) {
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_EVENTS;
+        } else if (len == strlen("deflate")
+                && strncmp(options, "deflate", len) == 0) {
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_DEFLATE;
+        } else if (len > strlen("deflate=")
+                && strncmp(options, "deflate=", strlen("deflate=")) == 0) {
+            errno = 0;
+            deflate_threshold = strtol(options + strlen("deflate="),
+                    &deflate_end, 10);
+            if (errno || deflate_threshold <= 0
+                    || deflate_end != options + len) {
+                Log3(PCSC_LOG_ERROR, "Invalid deflate: %.*s", (int) len, options);
+                return 0;
+            }
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_DEFLATE;
+        } else if (len == strlen("heartbeat")
+                && strncmp(options, "heartbeat", len) == 0) {
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_HEARTBEAT;
+        } else if (len > strlen("heartbeat=")
+                && strncmp(options, "heartbeat=", strlen("heartbeat=")) == 0) {
+            errno = 0;
+            heartbeat_interval = strtol(options + strlen("heartbeat="),
+                    &heartbeat_end, 10);
+            heartbeat_misses = 0;
+            if (!errno && heartbeat_end < options + len
+                    && *heartbeat_end == ':')
+                heartbeat_misses = strtol(heartbeat_end + 1, &heartbeat_end,
+                        10);
+            if (errno || heartbeat_interval <= 0 || heartbeat_misses < 0
+                    || heartbeat_end != options + len) {
+                Log3(PCSC_LOG_ERROR, "Invalid heartbeat: %.*s", (int) len, options);
+                return 0;
+            }
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_HEARTBEAT;
+        } else if (len == strlen("resume")
+                && strncmp(options, "resume", len) == 0) {
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_RESUME;
+        } else if (len > strlen("resume=")
+                && strncmp(options, "resume=", strlen("resume=")) == 0) {
+            errno = 0;
+            resume_window = strtol(options + strlen("resume="), &resume_end,
+                    10);
+            if (errno || resume_window <= 0 || resume_end != options + len) {
+                Log3(PCSC_LOG_ERROR, "Invalid resume: %.*s", (int) len, options);
+                return 0;
+            }
+            features |= VPCD_FEATURE_TAGGED|VPCD_FEATURE_RESUME;
+        } else if (len > strlen("timeout=")
+                && strncmp(options, "timeout=", strlen("timeout=")) == 0) {
+            errno = 0;
+            timeout = strtol(options + strlen("timeout="), &timeout_end, 10);
+            if (errno || timeout < 0 || timeout_end != options + len) {
+                Log3(PCSC_LOG_ERROR, "Invalid timeout: %.*s", (int) len, options);
+                return 0;
+            }
+        } else if (len > strlen("standby=")
+                && strncmp(options, "standby=", strlen("standby=")) == 0) {
+            errno = 0;
+            standby = strtol(options + strlen("standby="), &standby_end, 10);
+            if (errno || standby < 0 || standby > VICC_MAX_STANDBY
+                    || standby_end != options + len) {
+                Log3(PCSC_LOG_ERROR, "Invalid standby: %.*s", (int) len, options);
+                return 0;
+            }
+        } else if (len > strlen("capture=")
+                && strncmp(options, "capture=", strlen("capture=")) == 0) {
+            if (len - strlen("capture=") >= sizeof capture_path) {
+                Log3(PCSC_LOG_ERROR, "Path too long: %.*s", (int) len, options);
+                return 0;
+            }
+            memcpy(capture_path, options + strlen("capture="),
+                    len - strlen("capture="));
+            capture_path[len - strlen("capture=")] = '\0';
+        } else if (len > strlen("fault=")
+                && strncmp(options, "fault=", strlen("fault=")) == 0) {
+            if (len - strlen("fault=") >= sizeof fault_path) {
+                Log3(PCSC_LOG_ERROR, "Path too long: %.*s", (int) len, options);
+                return 0;
+            }
+            memcpy(fault_path, options + strlen("fault="),
+                    len - strlen("fault="));
+            fault_path[len - strlen("fault=")] = '\0';
+        } else if (len > strlen("group=")
+                && strncmp(options, "group=", strlen("group=")) == 0) {
+            if (len - strlen("group=") >= sizeof group) {
+                Log3(PCSC_LOG_ERROR, "Group too long: %.*s", (int) len, options);
+                return 0;
+            }
+            memcpy(group, options + strlen("group="), len - strlen("group="));
+            group[len - strlen("group=")] = '\0';
+        } else if (len > strlen("shardmap=")
+                && strncmp(options, "shardmap=", strlen("shardmap=")) == 0) {
+            if (len - strlen("shardmap=") >= sizeof shardmap_path) {
+                Log3(PCSC_LOG_ERROR, "Path too long: %.*s", (int) len, options);
+                return 0;
+            }
+            memcpy(shardmap_path, options + strlen("shardmap="),
+                    len - strlen("shardmap="));
+            shardmap_path[len - strlen("shardmap=")] = '\0';
+        } else if (len == strlen("failover=transparent")
+                && strncmp(options, "failover=transparent", len) == 0) {
+            failover_policy = VICC_FAILOVER_TRANSPARENT;
+        } else if (len == strlen("failover=reinsert")
+                && strncmp(options, "failover=reinsert", len) == 0) {
+            failover_policy = VICC_FAILOVER_REINSERT;
+        } else if (len) {
+            if (!sockopts_given) {
+                vicc_sockopts_default(&sockopts);
+                sockopts_given = 1;
+            }
+            if (!vicc_parse_sockopt(&sockopts, options, len)) {
+                Log3(PCSC_LOG_ERROR, "Unknown option: %.*s", (int) len, options);
+                return 0;
+            }
+        }
+        options = end ? end + 1 : NULL;
+    }
+
+    return 1;
+}
+
+/* Adds the hosts of a list like "host:port+host:port" to the shard */
+static int add_hosts(char *hosts)
+{
+    char *host, *next, *dots;
+    unsigned long int port;
+
+    for (host = hosts; host; host = next) {
+        next = strchr(host, '+');
+        if (next)
+            *next++ = '\0';
+        dots = strchr(host, ':');
+        if (!dots || dots == host) {
+            Log2(PCSC_LOG_ERROR, "Missing port of host: %s", host);
+            return 0;
+        }
+        *dots++ = '\0';
+        errno = 0;
+        port = strtoul(dots, &dots, 0);
+        if (errno || *dots || port > 0xffff) {
+            Log2(PCSC_LOG_ERROR, "Could not parse port of host: %s", host);
+            return 0;
+        }
+        if (vicc_shard_add_host(shard, host, (unsigned short) port) != 0) {
+            Log3(PCSC_LOG_ERROR, "Could not add host %s: %s", host,
+                    strerror(errno));
+            return 0;
+        }
+        Log3(PCSC_LOG_INFO, "Sharing slots with virtual ICCs on %s port %lu",
+                host, port);
+    }
+
+    return 1;
+}
+
+/* Logs the slots which have moved to another host and writes the slots' hosts
+ * to the file requested via DEVICENAME */
+static void monitor_shard(void)
+{
+    struct vicc_shard_entry map[VICC_MAX_SLOTS];
+    char tmp[MAX_READERNAME + 4];
+    size_t len, i;
+    FILE *f;
+
+    len = vicc_shard_get_map(shard, map, VICC_MAX_SLOTS);
+    if (len > VICC_MAX_SLOTS)
+        len = VICC_MAX_SLOTS;
+    if (len == shard_map_len
+            && memcmp(map, shard_map, len * sizeof *map) == 0)
+        return;
+
+    for (i = 0; i < len; i++) {
+        if (i < shard_map_len && map[i].port == shard_map[i].port
+                && strcmp(map[i].hostname, shard_map[i].hostname) == 0
+                && map[i].healthy == shard_map[i].healthy)
+            continue;
+        if (map[i].healthy)
+            Log4(PCSC_LOG_INFO, "%s assigned to virtual ICC on %s port %hu",
+                    map[i].identity, map[i].hostname, map[i].port);
+        else
+            Log4(PCSC_LOG_ERROR, "%s waiting for virtual ICC on %s port %hu, which is down",
+                    map[i].identity, map[i].hostname, map[i].port);
+    }
+    memcpy(shard_map, map, len * sizeof *map);
+    shard_map_len = len;
+
+    if (!*shard_map_path)
+        return;
+    /* readers of the file never see it half written */
+    snprintf(tmp, sizeof tmp, "%s.tmp", shard_map_path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        Log2(PCSC_LOG_ERROR, "Could not write map of hosts: %s", strerror(errno));
+        return;
+    }
+    for (i = 0; i < len; i++)
+        fprintf(f, "%s %s %hu %s %s %u %llu\n", map[i].identity,
+                map[i].hostname, map[i].port,
+                map[i].healthy ? "up" : "down",
+                map[i].connected ? "connected" : "waiting",
+                map[i].failures, map[i].moves);
+    if (fclose(f) != 0 || rename(tmp, shard_map_path) != 0)
+        Log2(PCSC_LOG_ERROR, "Could not write map of hosts: %s", strerror(errno));
+}
 
 RESPONSECODE
 IFDHCreateChannel (DWORD Lun, DWORD Channel)
 {
     size_t slot = Lun & 0xffff;
+    char name[MAX_READERNAME];
+    char identity[VICC_SHARD_IDENTITY_MAX];
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
-    if (!hostname)
-        Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu",
-                (unsigned short) (Channel+slot));
-    ctx[slot] = vicc_init(hostname, Channel+slot);
+    if (use_mux) {
+        /* all slots share the socket of the first one */
+        if (!mux) {
+            if (hostname || use_inproc || *shard_hosts) {
+                Log1(PCSC_LOG_ERROR, "Can only multiplex slots on a port vpcd listens on");
+            } else if (localname) {
+                Log2(PCSC_LOG_INFO, "Waiting for virtual ICCs on %s", localname);
+                mux = vicc_mux_new(localname, 0);
+            } else {
+                Log2(PCSC_LOG_INFO, "Waiting for virtual ICCs on port %hu",
+                        (unsigned short) Channel);
+                mux = vicc_mux_new(NULL, Channel);
+            }
+        }
+        ctx[slot] = mux ? vicc_mux_add(mux, slot) : NULL;
+    } else if (*shard_hosts) {
+        /* every slot connects to the host its card's identity hashes to */
+        if (!shard) {
+            shard = vicc_shard_new();
+            if (shard && !add_hosts(shard_hosts)) {
+                vicc_shard_free(shard);
+                shard = NULL;
+            }
+            if (shard)
+                snprintf(shard_map_path, sizeof shard_map_path, "%s",
+                        shardmap_path);
+        }
+        snprintf(identity, sizeof identity, "%s/%zu",
+                *group ? group : "vpcd", slot);
+        ctx[slot] = shard ? vicc_shard_add(shard, identity,
+                (unsigned short) slot) : NULL;
+    } else if (use_inproc) {
+        /* every slot opens a card of its own from the same library */
+        Log2(PCSC_LOG_INFO, "Loading card from %s", localname);
+        ctx[slot] = vicc_init(localname, 0);
+    } else if (localname) {
+        /* every further slot gets a socket or shared memory of its own */
+        if (slot)
+            snprintf(name, sizeof name, "%s.%zu", localname, slot);
+        else
+            snprintf(name, sizeof name, "%s", localname);
+        Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on %s", name);
+        ctx[slot] = vicc_init(name, 0);
+    } else {
+        if (!hostname)
+            Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu",
+                    (unsigned short) (Channel+slot));
+        ctx[slot] = vicc_init(hostname, Channel+slot);
+    }
     if (!ctx[slot]) {
         Log1(PCSC_LOG_ERROR, "Could not initialize connection to virtual ICC");
         return IFD_COMMUNICATION_ERROR;
     }
+    vicc_set_timeout(ctx[slot], timeout / 1000, (timeout % 1000) * 1000);
+    if (sockopts_given && vicc_set_sockopts(ctx[slot], &sockopts) != 0)
+        Log1(PCSC_LOG_ERROR, "Could not set all socket options");
+    if (standby && vicc_set_failover(ctx[slot], failover_policy,
+                (unsigned int) standby) != 0)
+        Log1(PCSC_LOG_ERROR, "Could not keep standby connections");
+    if (deflate_threshold)
+        vicc_set_deflate_threshold(ctx[slot], (size_t) deflate_threshold);
+    if (resume_window)
+        vicc_set_resume(ctx[slot], resume_window);
+    if (heartbeat_interval)
+        vicc_set_heartbeat(ctx[slot], heartbeat_interval,
+                (unsigned int) heartbeat_misses);
+    if (*capture_path) {
+        if (!capture) {
+            Log2(PCSC_LOG_INFO, "Capturing frames to %s", capture_path);
+            capture = vicc_capture_open(capture_path);
+        }
+        if (capture)
+            vicc_set_capture(ctx[slot], capture, (unsigned short) slot);
+        else
+            Log2(PCSC_LOG_ERROR, "Could not capture frames: %s", strerror(errno));
+    }
+    if (*fault_path) {
+        if (!fault) {
+            Log2(PCSC_LOG_INFO, "Injecting faults from %s", fault_path);
+            fault = vicc_fault_load(fault_path);
+        }
+        if (!fault || use_reactor
+                || vicc_set_fault(ctx[slot], fault, (unsigned short) slot) != 0)
+            Log2(PCSC_LOG_ERROR, "Could not inject faults: %s",
+                    use_reactor ? strerror(EOPNOTSUPP) : strerror(errno));
+    }
     if (hostname)
         Log3(PCSC_LOG_INFO, "Connected to virtual ICC on %s port %hu",
                 hostname, (unsigned short) (Channel+slot));
 
+    if (use_reactor) {
+        if (!reactor)
+            reactor = vicc_reactor_new();
+        if (!reactor || vicc_reactor_attach(reactor, ctx[slot]) != 0)
+            Log1(PCSC_LOG_ERROR, "Could not attach to reactor, using blocking I/O");
+    }
+    if (features != VPCD_FEATURES_DEFAULT)
+        vicc_set_features(ctx[slot], features);
+    use_events[slot] = (features & VPCD_FEATURE_EVENTS) != 0;
+
     return IFD_SUCCESS;
 }
 
@@ -143,11 +505,44 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
     RESPONSECODE r = IFD_NOT_SUPPORTED;
     char *dots;
     char _hostname[MAX_READERNAME];
-    size_t hostname_len;
+    char _localname[MAX_READERNAME];
+    size_t hostname_len, localname_len;
     unsigned long int port = VPCDPORT;
 
-    dots = strchr(DeviceName, ':');
-    if (dots) {
+    if (strncmp(DeviceName, VPCD_UNIX_PREFIX, strlen(VPCD_UNIX_PREFIX)) == 0
+            || strncmp(DeviceName, VPCD_SHM_PREFIX, strlen(VPCD_SHM_PREFIX)) == 0
+            || strncmp(DeviceName, VPCD_INPROC_PREFIX, strlen(VPCD_INPROC_PREFIX)) == 0) {
+        /* a Unix domain socket, shared memory or a card's library has been
+         * specified, which may be followed by options */
+        use_inproc = strncmp(DeviceName, VPCD_INPROC_PREFIX,
+                strlen(VPCD_INPROC_PREFIX)) == 0;
+        localname_len = strcspn(DeviceName, ",");
+        if (localname_len >= sizeof _localname) {
+            Log3(PCSC_LOG_ERROR, "Not enough memory to hold path (have %zu, need %zu)", sizeof _localname, localname_len);
+            goto err;
+        }
+        memcpy(_localname, DeviceName, localname_len);
+        _localname[localname_len] = '\0';
+        localname = _localname;
+
+        dots = DeviceName + localname_len;
+        if (*dots == ',' && !parse_options(dots + 1))
+            goto err;
+    } else if (memchr(DeviceName, '+', strcspn(DeviceName, ",")) != NULL) {
+        /* several hosts have been specified, which the slots are spread
+         * across, options may follow */
+        hostname_len = strcspn(DeviceName, ",");
+        if (hostname_len >= sizeof shard_hosts) {
+            Log3(PCSC_LOG_ERROR, "Not enough memory to hold hosts (have %zu, need %zu)", sizeof shard_hosts, hostname_len);
+            goto err;
+        }
+        memcpy(shard_hosts, DeviceName, hostname_len);
+        shard_hosts[hostname_len] = '\0';
+
+        dots = DeviceName + hostname_len;
+        if (*dots == ',' && !parse_options(dots + 1))
+            goto err;
+    } else if ((dots = strchr(DeviceName, ':')) != NULL) {
         /* a port has been specified behind the device name */
 
         hostname_len = dots - DeviceName;
@@ -169,11 +564,15 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
         dots++;
 
         errno = 0;
-        port = strtoul(dots, NULL, 0);
+        port = strtoul(dots, &dots, 0);
         if (errno) {
             Log2(PCSC_LOG_ERROR, "Could not parse port: %s", dots);
             goto err;
         }
+
+        /* options are appended to the port, separated by commas */
+        if (*dots == ',' && !parse_options(dots + 1))
+            goto err;
     } else {
         Log1(PCSC_LOG_INFO, "Using default port.");
     }
@@ -181,8 +580,27 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
     r = IFDHCreateChannel (Lun, port);
 
 err:
-    /* set hostname back to default in case it has been changed */
+    /* set hostname and options back to default in case they have been
+     * changed */
     hostname = NULL;
+    localname = NULL;
+    use_inproc = 0;
+    use_reactor = 0;
+    use_mux = 0;
+    features = VPCD_FEATURES_DEFAULT;
+    sockopts_given = 0;
+    timeout = 0;
+    standby = 0;
+    failover_policy = VICC_FAILOVER_REINSERT;
+    deflate_threshold = 0;
+    heartbeat_interval = 0;
+    heartbeat_misses = 0;
+    resume_window = 0;
+    capture_path[0] = '\0';
+    fault_path[0] = '\0';
+    shard_hosts[0] = '\0';
+    group[0] = '\0';
+    shardmap_path[0] = '\0';
 
     return r;
 }
@@ -234,6 +652,46 @@ IFDHControl (DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
     return IFD_ERROR_NOT_SUPPORTED;
 }
 
+static void
+log_stats(struct vicc_ctx *ctx)
+{
+    struct vicc_stats stats;
+
+    if (vicc_get_stats(ctx, &stats, 0) < 0 || !stats.commands)
+        return;
+
+    Log5(PCSC_LOG_INFO, "%llu commands, %llu failures (%llu timeouts), %llu ejects",
+            stats.commands, stats.failures, stats.timeouts, stats.ejects);
+    Log5(PCSC_LOG_INFO, "total p50/p99 %lluus/%lluus, think p50/p99 %lluus/%lluus",
+            vicc_histogram_percentile(&stats.total, 50),
+            vicc_histogram_percentile(&stats.total, 99),
+            vicc_histogram_percentile(&stats.think, 50),
+            vicc_histogram_percentile(&stats.think, 99));
+    if (stats.failovers)
+        Log2(PCSC_LOG_INFO, "%llu failovers to a standby connection",
+                stats.failovers);
+    if (stats.resumes)
+        Log2(PCSC_LOG_INFO, "%llu sessions resumed after losing the connection",
+                stats.resumes);
+    if (stats.connect_failures)
+        Log3(PCSC_LOG_INFO, "%llu failed connects, next one in %ldms",
+                stats.connect_failures, stats.backoff_ms);
+    if (stats.deflated)
+        Log5(PCSC_LOG_INFO, "%llu commands compressed to %llu%% in %lluus, %llu not worth it",
+                stats.deflated,
+                stats.deflate_bytes_out * 100 / stats.deflate_bytes_in,
+                stats.deflate_us, stats.deflate_skipped);
+    if (stats.heartbeats)
+        Log5(PCSC_LOG_INFO, "%llu heartbeats, %llu intervals missed, rtt %lldus +/- %lldus",
+                stats.heartbeats, stats.heartbeats_missed, stats.srtt_us,
+                stats.rttvar_us);
+    if (stats.inflated)
+        Log4(PCSC_LOG_INFO, "%llu responses compressed to %llu%%, decompressed in %lluus",
+                stats.inflated,
+                stats.inflate_bytes_in * 100 / stats.inflate_bytes_out,
+                stats.inflate_us);
+}
+
 RESPONSECODE
 IFDHCloseChannel (DWORD Lun)
 {
@@ -241,15 +699,67 @@ IFDHCloseChannel (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+    log_stats(ctx[slot]);
     if (vicc_exit(ctx[slot]) < 0) {
         Log1(PCSC_LOG_ERROR, "Could not close connection to virtual ICC");
         return IFD_COMMUNICATION_ERROR;
     }
     ctx[slot] = NULL;
 
+    if (reactor || mux || shard || capture || fault) {
+        for (slot = 0; slot < vicc_max_slots && !ctx[slot]; slot++);
+        if (slot == vicc_max_slots) {
+            vicc_reactor_free(reactor);
+            reactor = NULL;
+            vicc_mux_free(mux);
+            mux = NULL;
+            vicc_shard_free(shard);
+            shard = NULL;
+            shard_map_path[0] = '\0';
+            shard_map_len = 0;
+            if (vicc_capture_dropped(capture))
+                Log2(PCSC_LOG_INFO, "%llu frames dropped from the capture",
+                        vicc_capture_dropped(capture));
+            if (vicc_capture_close(capture) != 0)
+                Log1(PCSC_LOG_ERROR, "Could not write all captured frames");
+            capture = NULL;
+            vicc_fault_free(fault);
+            fault = NULL;
+        }
+    }
+
+    return IFD_SUCCESS;
+}
+
+#ifdef TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
+static RESPONSECODE
+IFDHPolling (DWORD Lun, int timeout)
+{
+    size_t slot = Lun & 0xffff;
+    if (slot >= vicc_max_slots) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    /* pcscd checks the presence of the card when we return */
+    if (vicc_wait_event(ctx[slot], timeout / 1000,
+                (timeout % 1000) * 1000) < 0) {
+        Log1(PCSC_LOG_ERROR, "Could not wait for events of virtual ICC");
+        return IFD_COMMUNICATION_ERROR;
+    }
     return IFD_SUCCESS;
 }
 
+static RESPONSECODE
+IFDHStopPolling (DWORD Lun)
+{
+    size_t slot = Lun & 0xffff;
+    if (slot >= vicc_max_slots) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    vicc_interrupt_wait(ctx[slot]);
+    return IFD_SUCCESS;
+}
+#endif
+
 RESPONSECODE
 IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 {
@@ -336,6 +846,26 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
             *Length = 1;
             break;
 
+#ifdef TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
+        case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+            if (!use_events[slot]) {
+                r = IFD_ERROR_TAG;
+                goto err;
+            }
+            *Length = sizeof(void *);
+            *(void **) Value = (void *) IFDHPolling;
+            break;
+
+        case TAG_IFD_STOP_POLLING_THREAD:
+            if (!use_events[slot]) {
+                r = IFD_ERROR_TAG;
+                goto err;
+            }
+            *Length = sizeof(void *);
+            *(void **) Value = (void *) IFDHStopPolling;
+            break;
+#endif
+
         default:
             Log2(PCSC_LOG_DEBUG, "unknown tag %d", (int)Tag);
             r = IFD_ERROR_TAG;
@@ -427,7 +957,6 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
         PSCARD_IO_HEADER RecvPci)
 {
-    unsigned char *rapdu = NULL;
     ssize_t size;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
     size_t slot = Lun & 0xffff;
@@ -441,20 +970,20 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         goto err;
     }
 
-    size = vicc_transmit(ctx[slot], TxLength, TxBuffer, &rapdu);
+    size = vicc_transmit_into(ctx[slot], TxLength, TxBuffer,
+            RxBuffer, *RxLength);
 
     if (size < 0) {
-        Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
-        goto err;
-    }
-
-    if (*RxLength < size) {
-        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+        if (errno == ENOBUFS)
+            Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+        else if (errno == ETIMEDOUT)
+            Log1(PCSC_LOG_ERROR, "virtual ICC did not respond in time, ejected it");
+        else
+            Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
         goto err;
     }
 
     *RxLength = size;
-    memcpy(RxBuffer, rapdu, size);
     RecvPci->Protocol = 1;
 
     r = IFD_SUCCESS;
@@ -463,8 +992,6 @@ err:
     if (r != IFD_SUCCESS && RxLength)
         *RxLength = 0;
 
-    free(rapdu);
-
     return r;
 }
 
@@ -475,6 +1002,8 @@ IFDHICCPresence (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+    if (shard && slot == 0)
+        monitor_shard();
     switch (vicc_present(ctx[slot])) {
         case 0:
             return IFD_ICC_NOT_PRESENT;
@@ -0,0 +1,721 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the throughput and round trip time of APDUs between libvpcd and a
+ * vicc over loopback for different socket options. The vicc is either built
+ * in (echoing each APDU or answering like the handler test card) or an
+ * external one such as `vicc -t handler_test`. Build it with
+ * `make bench-vpcd`. */
+
+#include "vpcd.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *default_profiles[] = {
+    "nodelay=0",
+    "nodelay",
+    "nodelay,quickack",
+    "nodelay,busypoll=50",
+    "nodelay,sndbuf=4096,rcvbuf=4096",
+    "nodelay,keepalive=10",
+    "nodelay,uring",
+};
+
+/* built-in vicc */
+enum card {
+    /* answers every APDU with itself and 9000 */
+    CARD_ECHO,
+    /* answers like the handler test card of vicc */
+    CARD_HANDLER,
+    /* card loaded from a library into this process */
+    CARD_INPROC,
+};
+
+enum format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+
+/* an APDU length with its weight in the distribution */
+struct size_class {
+    size_t len;
+    unsigned int weight;
+};
+
+#define MAX_SIZE_CLASSES 16
+/* the plain protocol limits frames to 16 bits */
+#define MAX_APDU_LEN (0xffff - 2)
+#define MAX_SLOTS 256
+#define MAX_BATCH 1024
+
+struct slot_run {
+    struct vicc_ctx *ctx;
+    pid_t pid;
+    pthread_t thread;
+    unsigned int seed;
+    /* buffers for a batch of APDUs */
+    unsigned char *apdu;
+    unsigned char *rapdu;
+    struct vicc_apdu *apdus;
+    /* round trip times in microseconds */
+    double *rtt;
+    size_t rtt_len;
+    size_t rtt_size;
+    unsigned long long bytes;
+    int error;
+};
+
+static unsigned long iterations = 10000;
+static double duration = 0;
+static unsigned int slots = 1;
+/* APDUs sent with one call of vicc_transmit_batch() */
+static unsigned int batch = 1;
+static enum card card = CARD_ECHO;
+static enum format format = FORMAT_TEXT;
+static unsigned short external_port = 0;
+static const char *inproc_card = NULL;
+static const char *size_spec = "261";
+static struct size_class sizes[MAX_SIZE_CLASSES];
+static size_t size_classes = 0;
+static unsigned int size_weights = 0;
+/* uniform distribution between size_min and size_max if size_classes is 0 */
+static size_t size_min, size_max;
+
+static pthread_barrier_t barrier;
+/* end of a run with a duration */
+static double stop_at;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n ITERATIONS | -d SECONDS] [-s SIZES] [-c SLOTS] [-b BATCH]\n"
+            "       [-v echo|handler|inproc:LIB | -p PORT] [-o text|csv|json]\n"
+            "       [PROFILE ...]\n"
+            "\n"
+            "  -n  round trips per slot (default 10000)\n"
+            "  -d  run each profile for SECONDS instead of a number of round trips\n"
+            "  -s  APDU lengths: a length (\"261\"), a uniform range (\"5-4096\")\n"
+            "      or weighted lengths (\"5:60,261:30,4096:10\")\n"
+            "  -c  number of slots, each with its own vicc and thread\n"
+            "  -b  APDUs sent at once with vicc_transmit_batch(), the round\n"
+            "      trip time is the batch's time divided by BATCH\n"
+            "  -v  built-in vicc, which echoes each APDU (default) or answers\n"
+            "      like the handler test card, or a card loaded from LIB\n"
+            "      (e.g. handler-test.so) without any sockets\n"
+            "  -p  wait for external vicc on PORT (PORT+i for slot i) instead of\n"
+            "      starting the built-in one, e.g. `vicc -t handler_test -P PORT`\n"
+            "  -o  output format, csv and json print one record per profile\n"
+            "\n"
+            "Each PROFILE is a comma separated list of socket options as\n"
+            "accepted in DEVICENAME, e.g. \"nodelay,quickack\". Without\n"
+            "profiles, a default set is measured.\n", name);
+}
+
+static int parse_sizes(const char *spec)
+{
+    char *end;
+    unsigned long len, weight;
+
+    size_classes = 0;
+    size_weights = 0;
+
+    if (strchr(spec, '-') && !strchr(spec, ',')) {
+        size_min = strtoul(spec, &end, 0);
+        if (*end != '-')
+            return 0;
+        size_max = strtoul(end + 1, &end, 0);
+        return *end == '\0' && size_min >= 4 && size_min <= size_max
+            && size_max <= MAX_APDU_LEN;
+    }
+
+    while (*spec) {
+        if (size_classes >= MAX_SIZE_CLASSES)
+            return 0;
+        len = strtoul(spec, &end, 0);
+        weight = 1;
+        if (*end == ':')
+            weight = strtoul(end + 1, &end, 0);
+        if (end == spec || (*end != ',' && *end != '\0')
+                || len < 4 || len > MAX_APDU_LEN || weight < 1
+                || weight > 1000000)
+            return 0;
+        sizes[size_classes].len = len;
+        sizes[size_classes].weight = (unsigned int) weight;
+        size_classes++;
+        size_weights += (unsigned int) weight;
+        spec = *end ? end + 1 : end;
+    }
+
+    if (!size_classes)
+        return 0;
+
+    size_max = 0;
+    for (len = 0; len < size_classes; len++)
+        if (sizes[len].len > size_max)
+            size_max = sizes[len].len;
+
+    return 1;
+}
+
+static size_t next_size(unsigned int *seed)
+{
+    unsigned int pick;
+    size_t i;
+
+    if (!size_classes)
+        return size_min + (size_t) rand_r(seed) % (size_max - size_min + 1);
+
+    pick = (unsigned int) rand_r(seed) % size_weights;
+    for (i = 0; i + 1 < size_classes && pick >= sizes[i].weight; i++)
+        pick -= sizes[i].weight;
+
+    return sizes[i].len;
+}
+
+/* Case 3 command of the handler test card with len bytes in total (case 1
+ * for the shortest ones) */
+static void build_apdu(unsigned char *apdu, size_t len)
+{
+    size_t lc;
+
+    apdu[0] = 0x80;
+    apdu[1] = 0x32;
+    apdu[2] = 0x00;
+    apdu[3] = 0x00;
+    if (len <= 4)
+        return;
+    if (len <= 5 + 0xff && len > 5) {
+        lc = len - 5;
+        apdu[4] = (unsigned char) lc;
+        memset(apdu + 5, 0xA5, lc);
+    } else if (len >= 8) {
+        lc = len - 7;
+        apdu[4] = 0x00;
+        apdu[5] = (unsigned char) (lc >> 8);
+        apdu[6] = (unsigned char) lc;
+        memset(apdu + 7, 0xA5, lc);
+    } else {
+        /* too short for any Lc */
+        memset(apdu + 4, 0x00, len - 4);
+    }
+}
+
+/* Answer of the handler test card, see HandlerTest.py */
+static size_t handler_answer(const unsigned char *apdu, size_t len,
+        unsigned char *out)
+{
+    size_t le, i;
+
+    if (len >= 4 && apdu[0] == 0x80
+            && (apdu[1] == 0x30 || apdu[1] == 0x32 || apdu[1] == 0x38)) {
+        out[0] = 0x90;
+        out[1] = 0x00;
+        return 2;
+    }
+    if (len >= 4 && apdu[0] == 0x80 && apdu[1] == 0x34) {
+        le = (size_t) apdu[2] << 8 | apdu[3];
+        for (i = 0; i < le; i++)
+            out[i] = i & 0xff;
+        out[le] = 0x90;
+        out[le + 1] = 0x00;
+        return le + 2;
+    }
+    out[0] = 0x6d;
+    out[1] = 0x00;
+    return 2;
+}
+
+/* vicc in client mode */
+static int builtin_vicc(unsigned short port, const struct vicc_sockopts *opts)
+{
+    struct vicc_ctx *ctx;
+    unsigned char *buf = NULL, *out = NULL,
+                  atr[] = {0x3B, 0x80, 0x80, 0x01, 0x01};
+    ssize_t size;
+    size_t out_len;
+    int r = 1;
+
+    ctx = vicc_init("127.0.0.1", port);
+    out = malloc(0x10000 + 2);
+    if (!ctx || !out)
+        goto err;
+    /* we take the role of the card, so vpcd is the one to negotiate */
+    vicc_set_features(ctx, 0);
+    vicc_set_sockopts(ctx, opts);
+
+    while (1) {
+        size = vicc_transmit(ctx, 0, NULL, &buf);
+        if (size <= 0)
+            break;
+        if (size == VPCD_CTRL_LEN) {
+            if (buf[0] == VPCD_CTRL_ATR
+                    && vicc_transmit(ctx, sizeof atr, atr, NULL) < 0)
+                goto err;
+            continue;
+        }
+        if (card == CARD_HANDLER) {
+            out_len = handler_answer(buf, (size_t) size, out);
+            if (vicc_transmit(ctx, out_len, out, NULL) < 0)
+                goto err;
+            continue;
+        }
+        buf = realloc(buf, size + 2);
+        if (!buf)
+            goto err;
+        buf[size] = 0x90;
+        buf[size + 1] = 0x00;
+        if (vicc_transmit(ctx, size + 2, buf, NULL) < 0)
+            goto err;
+    }
+    r = 0;
+
+err:
+    free(out);
+    free(buf);
+    vicc_exit(ctx);
+
+    return r;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int check(struct slot_run *run, const unsigned char *apdu, size_t len,
+        const unsigned char *rapdu, ssize_t r)
+{
+    if (r < 2 || (card == CARD_ECHO && !external_port
+                && (r != (ssize_t) len + 2
+                    || memcmp(rapdu, apdu, len) != 0))
+            || rapdu[r - 2] != 0x90 || rapdu[r - 1] != 0x00) {
+        if (r < 0)
+            perror("Could not transmit APDU");
+        else
+            fprintf(stderr, "Unexpected response of %zd bytes\n", r);
+        return 0;
+    }
+    run->bytes += len + (size_t) r;
+
+    return 1;
+}
+
+/* Sends a batch of APDUs, rtt is set to the time per APDU */
+static int round_trip(struct slot_run *run, double *rtt)
+{
+    struct vicc_apdu *apdus = run->apdus;
+    size_t len, i;
+    double start;
+    ssize_t r;
+
+    for (i = 0; i < batch; i++) {
+        len = next_size(&run->seed);
+        apdus[i].apdu_len = len;
+        build_apdu(run->apdu + i * size_max, len);
+    }
+
+    start = now_us();
+    if (batch == 1)
+        apdus[0].rapdu_len = vicc_transmit_into(run->ctx, apdus[0].apdu_len,
+                apdus[0].apdu, apdus[0].rapdu, apdus[0].rapdu_size);
+    else if ((r = vicc_transmit_batch(run->ctx, apdus, batch, 0))
+            != (ssize_t) batch) {
+        if (r >= 0)
+            errno = apdus[r].error;
+        perror("Could not transmit batch");
+        return 0;
+    }
+    *rtt = (now_us() - start) / batch;
+
+    for (i = 0; i < batch; i++)
+        if (!check(run, apdus[i].apdu, apdus[i].apdu_len, apdus[i].rapdu,
+                    apdus[i].rapdu_len))
+            return 0;
+
+    return 1;
+}
+
+static int record(struct slot_run *run, double rtt)
+{
+    double *p;
+
+    if (run->rtt_len == run->rtt_size) {
+        p = realloc(run->rtt, 2 * run->rtt_size * sizeof *p);
+        if (!p)
+            return 0;
+        run->rtt = p;
+        run->rtt_size *= 2;
+    }
+    run->rtt[run->rtt_len++] = rtt;
+
+    return 1;
+}
+
+static void *slot_main(void *arg)
+{
+    struct slot_run *run = arg;
+    unsigned long i, warmup = duration > 0 ? 100 : iterations / 10;
+    unsigned int j;
+    double rtt;
+
+    for (i = 0; i < warmup && !run->error; i += batch)
+        if (!round_trip(run, &rtt))
+            run->error = 1;
+    run->bytes = 0;
+
+    /* all slots start at the same time */
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; !run->error; i += batch) {
+        if (duration > 0 ? now_us() >= stop_at : i >= iterations)
+            break;
+        if (!round_trip(run, &rtt))
+            run->error = 1;
+        for (j = 0; j < batch && !run->error; j++)
+            if (!record(run, rtt))
+                run->error = 1;
+    }
+
+    return NULL;
+}
+
+static double percentile(const double *rtt, size_t len, double p)
+{
+    size_t i = (size_t) (p * len);
+
+    if (i > 0 && (double) i == p * len)
+        i--;
+    if (i >= len)
+        i = len - 1;
+
+    return rtt[i];
+}
+
+static void report(const char *profile, const double *rtt, size_t len,
+        unsigned long long bytes, double elapsed)
+{
+    double sum = 0, rate = len / (elapsed / 1e6);
+    double p50 = percentile(rtt, len, .5), p90 = percentile(rtt, len, .9),
+           p99 = percentile(rtt, len, .99), p999 = percentile(rtt, len, .999);
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sum += rtt[i];
+
+    switch (format) {
+        case FORMAT_CSV:
+            printf("\"%s\",%u,%u,\"%s\",%zu,%.3f,%.1f,%.0f,"
+                    "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                    profile, slots, batch, size_spec, len, elapsed / 1e6, rate,
+                    bytes / (elapsed / 1e6), p50, p90, p99, p999,
+                    rtt[len - 1], sum / len);
+            break;
+        case FORMAT_JSON:
+            printf("{\"profile\":\"%s\",\"slots\":%u,\"batch\":%u,"
+                    "\"sizes\":\"%s\",\"vicc\":\"%s\",\"apdus\":%zu,"
+                    "\"seconds\":%.3f,\"apdus_per_sec\":%.1f,"
+                    "\"bytes_per_sec\":%.0f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+                    "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+                    "\"mean_us\":%.1f}\n",
+                    profile, slots, batch, size_spec,
+                    external_port ? "external"
+                    : card == CARD_HANDLER ? "handler"
+                    : card == CARD_INPROC ? "inproc" : "echo",
+                    len, elapsed / 1e6, rate, bytes / (elapsed / 1e6),
+                    p50, p90, p99, p999, rtt[len - 1], sum / len);
+            break;
+        default:
+            printf("%-36s %9.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                    profile, rate, p50, p90, p99, p999, rtt[len - 1],
+                    sum / len);
+            break;
+    }
+    fflush(stdout);
+}
+
+static int bench(const char *profile)
+{
+    struct vicc_sockopts opts;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    struct slot_run *runs;
+    double *rtt = NULL, start, elapsed;
+    unsigned long long bytes = 0;
+    size_t len = 0;
+    unsigned int i, j, started = 0;
+    int ok = 0, barrier_ready = 0;
+
+    vicc_sockopts_default(&opts);
+    if (vicc_parse_sockopts(&opts, profile) != 0) {
+        fprintf(stderr, "Invalid profile: %s\n", profile);
+        return 0;
+    }
+
+    runs = calloc(slots, sizeof *runs);
+    if (!runs)
+        return 0;
+
+    for (i = 0; i < slots; i++) {
+        runs[i].pid = -1;
+        runs[i].seed = i + 1;
+        runs[i].apdu = malloc(batch * size_max);
+        runs[i].rapdu = malloc(batch * (size_max + 2));
+        runs[i].apdus = calloc(batch, sizeof *runs[i].apdus);
+        runs[i].rtt_size = 1024;
+        runs[i].rtt = malloc(runs[i].rtt_size * sizeof *runs[i].rtt);
+        if (!runs[i].apdu || !runs[i].rapdu || !runs[i].apdus || !runs[i].rtt)
+            goto err;
+        for (j = 0; j < batch; j++) {
+            runs[i].apdus[j].apdu = runs[i].apdu + j * size_max;
+            runs[i].apdus[j].rapdu = runs[i].rapdu + j * (size_max + 2);
+            runs[i].apdus[j].rapdu_size = size_max + 2;
+        }
+
+        if (external_port) {
+            runs[i].ctx = vicc_init(NULL, external_port + i);
+            if (!runs[i].ctx) {
+                perror("Could not open socket");
+                goto err;
+            }
+        } else if (card == CARD_INPROC) {
+            runs[i].ctx = vicc_init(inproc_card, 0);
+            if (!runs[i].ctx) {
+                perror("Could not load card");
+                goto err;
+            }
+        } else {
+            /* listen on an ephemeral port and let the vicc connect to it */
+            runs[i].ctx = vicc_init(NULL, 0);
+            if (!runs[i].ctx || getsockname(runs[i].ctx->server_sock,
+                        (struct sockaddr *) &addr, &addr_len) != 0) {
+                perror("Could not open socket");
+                goto err;
+            }
+        }
+        if (vicc_set_sockopts(runs[i].ctx, &opts) != 0 && i == 0)
+            fprintf(stderr, "Warning: %s not fully supported: %s\n",
+                    profile, strerror(errno));
+
+        if (!external_port && card != CARD_INPROC) {
+            runs[i].pid = fork();
+            if (runs[i].pid < 0)
+                goto err;
+            if (runs[i].pid == 0) {
+                vicc_exit(runs[i].ctx);
+                _exit(builtin_vicc(ntohs(addr.sin_port), &opts));
+            }
+        }
+    }
+
+    for (i = 0; i < slots; i++) {
+        if (!vicc_connect(runs[i].ctx, external_port ? 60 : 5, 0)) {
+            fprintf(stderr, "vicc of slot %u did not connect\n", i);
+            goto err;
+        }
+    }
+
+    if (pthread_barrier_init(&barrier, NULL, slots + 1) != 0)
+        goto err;
+    barrier_ready = 1;
+    for (started = 0; started < slots; started++)
+        if (pthread_create(&runs[started].thread, NULL, slot_main,
+                    &runs[started]) != 0)
+            goto err;
+
+    start = now_us();
+    stop_at = start + duration * 1e6;
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < slots; i++)
+        pthread_join(runs[i].thread, NULL);
+    elapsed = now_us() - start;
+    started = 0;
+
+    for (i = 0; i < slots; i++) {
+        if (runs[i].error)
+            goto err;
+        len += runs[i].rtt_len;
+        bytes += runs[i].bytes;
+    }
+    if (!len)
+        goto err;
+    rtt = malloc(len * sizeof *rtt);
+    if (!rtt)
+        goto err;
+    for (len = 0, i = 0; i < slots; i++) {
+        memcpy(rtt + len, runs[i].rtt, runs[i].rtt_len * sizeof *rtt);
+        len += runs[i].rtt_len;
+    }
+    qsort(rtt, len, sizeof *rtt, compare);
+    report(profile, rtt, len, bytes, elapsed);
+    ok = 1;
+
+err:
+    if (started) {
+        /* some threads are waiting at the barrier, which never opens */
+        for (i = 0; i < started; i++)
+            pthread_cancel(runs[i].thread);
+        for (i = 0; i < started; i++)
+            pthread_join(runs[i].thread, NULL);
+    }
+    if (barrier_ready)
+        pthread_barrier_destroy(&barrier);
+    for (i = 0; i < slots; i++) {
+        vicc_exit(runs[i].ctx);
+        if (runs[i].pid > 0) {
+            kill(runs[i].pid, SIGTERM);
+            waitpid(runs[i].pid, NULL, 0);
+        }
+        free(runs[i].rtt);
+        free(runs[i].apdus);
+        free(runs[i].rapdu);
+        free(runs[i].apdu);
+    }
+    free(runs);
+    free(rtt);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, r = 0;
+    unsigned long port;
+
+    while ((opt = getopt(argc, argv, "n:d:s:c:b:v:p:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                if (duration <= 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 's':
+                size_spec = optarg;
+                break;
+            case 'c':
+                slots = (unsigned int) strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = (unsigned int) strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                if (strcmp(optarg, "echo") == 0) {
+                    card = CARD_ECHO;
+                } else if (strcmp(optarg, "handler") == 0) {
+                    card = CARD_HANDLER;
+                } else if (strncmp(optarg, VPCD_INPROC_PREFIX,
+                            strlen(VPCD_INPROC_PREFIX)) == 0) {
+                    card = CARD_INPROC;
+                    inproc_card = optarg;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'p':
+                port = strtoul(optarg, NULL, 0);
+                if (port < 1 || port > 0xffff) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                external_port = (unsigned short) port;
+                break;
+            case 'o':
+                if (strcmp(optarg, "text") == 0) {
+                    format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = FORMAT_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = FORMAT_JSON;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (iterations < 1 || slots < 1 || slots > MAX_SLOTS
+            || batch < 1 || batch > MAX_BATCH
+            || (external_port && external_port + slots - 1 > 0xffff)
+            || !parse_sizes(size_spec)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    switch (format) {
+        case FORMAT_CSV:
+            printf("profile,slots,batch,sizes,apdus,seconds,apdus_per_sec,"
+                    "bytes_per_sec,p50_us,p90_us,p99_us,p999_us,max_us,"
+                    "mean_us\n");
+            break;
+        case FORMAT_JSON:
+            break;
+        default:
+            if (duration > 0)
+                printf("%.1f s", duration);
+            else
+                printf("%lu round trips", iterations);
+            printf(" on %u slot%s with APDUs of %s bytes %s (usec)\n",
+                    slots, slots == 1 ? "" : "s", size_spec,
+                    card == CARD_INPROC && !external_port ? "in process"
+                    : "over TCP loopback");
+            printf("%-36s %9s %9s %9s %9s %9s %9s %9s\n", "profile",
+                    "apdu/s", "p50", "p90", "p99", "p999", "max", "mean");
+            break;
+    }
+
+    if (optind < argc) {
+        for (i = optind; i < argc; i++)
+            if (!bench(argv[i]))
+                r = 1;
+    } else {
+        for (i = 0; i < (int) (sizeof default_profiles/sizeof *default_profiles); i++)
+            if (!bench(default_profiles[i]))
+                r = 1;
+    }
+
+    return r;
+}
@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "capture.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32) \
+    && (defined(__GNUC__) || defined(__clang__))
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* buffer of each thread, must be a power of two */
+#define CAPTURE_RING_SIZE (1 << 20)
+/* longest data captured of a frame, the rest is cut off */
+#define CAPTURE_SNAPLEN 0x10000
+/* the flush thread writes what has been captured at least this often */
+#define CAPTURE_FLUSH_MS 100
+
+/* blocks and options of pcapng, written in our byte order */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_ISB 0x00000005
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_ISB_IFRECV 4
+#define PCAPNG_ISB_IFDROP 5
+/* enhanced packet block up to the packet data */
+#define PCAPNG_EPB_LEN 28
+
+/* Frames of one thread as enhanced packet blocks. Only the thread itself
+ * writes to its ring and only the flush thread reads from it, so neither of
+ * them takes a lock. */
+struct capture_ring {
+    struct capture_ring *next;
+    unsigned char *buf;
+    /* bytes written and read so far, wrapping around the buffer */
+    size_t head;
+    size_t tail;
+    unsigned long long frames;
+    unsigned long long dropped;
+    /* set when the thread has exited, the ring is freed once drained */
+    int retired;
+};
+
+struct vicc_capture {
+    FILE *file;
+    int error;
+    /* ring of the calling thread */
+    pthread_key_t key;
+    pthread_t thread;
+    /* guards the list of rings, the file and stop */
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    /* rings of the threads, which are kept until they are retired and
+     * drained, and the counters of the rings freed so far */
+    struct capture_ring *rings;
+    unsigned long long frames;
+    unsigned long long dropped;
+    int stop;
+};
+
+struct block {
+    unsigned char buf[128];
+    size_t len;
+};
+
+static void put(struct block *b, const void *data, size_t len)
+{
+    if (len)
+        memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+static void put16(struct block *b, uint16_t value)
+{
+    put(b, &value, sizeof value);
+}
+
+static void put32(struct block *b, uint32_t value)
+{
+    put(b, &value, sizeof value);
+}
+
+static void put_option(struct block *b, uint16_t code, const void *data,
+        uint16_t len)
+{
+    static const unsigned char padding[3];
+
+    put16(b, code);
+    put16(b, len);
+    put(b, data, len);
+    put(b, padding, (4 - len % 4) % 4);
+}
+
+static void block_begin(struct block *b, uint32_t type)
+{
+    b->len = 0;
+    put32(b, type);
+    /* the length is filled in by block_write() */
+    put32(b, 0);
+}
+
+static void block_write(struct vicc_capture *capture, struct block *b)
+{
+    uint32_t len = (uint32_t) b->len + 4;
+
+    memcpy(b->buf + 4, &len, sizeof len);
+    put32(b, len);
+    if (fwrite(b->buf, 1, b->len, capture->file) != b->len)
+        capture->error = 1;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Section header and the description of our only interface */
+static void write_header(struct vicc_capture *capture)
+{
+    struct block b;
+    static const char userappl[] = "libvpcd";
+    static const char if_name[] = "vpcd";
+    unsigned char tsresol = 9;
+    int64_t section_len = -1;
+
+    block_begin(&b, PCAPNG_SHB);
+    put32(&b, PCAPNG_BYTE_ORDER_MAGIC);
+    put16(&b, 1);
+    put16(&b, 0);
+    put(&b, &section_len, sizeof section_len);
+    put_option(&b, PCAPNG_SHB_USERAPPL, userappl, sizeof userappl - 1);
+    put_option(&b, PCAPNG_OPT_END, NULL, 0);
+    block_write(capture, &b);
+
+    block_begin(&b, PCAPNG_IDB);
+    put16(&b, CAPTURE_LINKTYPE);
+    put16(&b, 0);
+    put32(&b, CAPTURE_HEADER_LEN + CAPTURE_SNAPLEN);
+    put_option(&b, PCAPNG_IF_NAME, if_name, sizeof if_name - 1);
+    /* nanoseconds */
+    put_option(&b, PCAPNG_IF_TSRESOL, &tsresol, sizeof tsresol);
+    put_option(&b, PCAPNG_OPT_END, NULL, 0);
+    block_write(capture, &b);
+}
+
+/* Statistics of the interface, written when the capture is closed */
+static void write_statistics(struct vicc_capture *capture)
+{
+    struct block b;
+    struct capture_ring *ring;
+    unsigned long long now = now_ns(), frames = capture->frames,
+                       dropped = capture->dropped;
+
+    for (ring = capture->rings; ring; ring = ring->next) {
+        frames += __atomic_load_n(&ring->frames, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    block_begin(&b, PCAPNG_ISB);
+    put32(&b, 0);
+    put32(&b, (uint32_t) (now >> 32));
+    put32(&b, (uint32_t) now);
+    frames += dropped;
+    put_option(&b, PCAPNG_ISB_IFRECV, &frames, sizeof frames);
+    put_option(&b, PCAPNG_ISB_IFDROP, &dropped, sizeof dropped);
+    put_option(&b, PCAPNG_OPT_END, NULL, 0);
+    block_write(capture, &b);
+}
+
+/* Writes what the ring holds to the file, the mutex is held */
+static int ring_flush(struct vicc_capture *capture, struct capture_ring *ring)
+{
+    size_t head = LOAD(&ring->head), tail = ring->tail, offset, len;
+
+    if (tail == head)
+        return 0;
+
+    while (tail != head) {
+        offset = tail & (CAPTURE_RING_SIZE - 1);
+        len = head - tail;
+        if (len > CAPTURE_RING_SIZE - offset)
+            len = CAPTURE_RING_SIZE - offset;
+        if (fwrite(ring->buf + offset, 1, len, capture->file) != len)
+            capture->error = 1;
+        tail += len;
+    }
+    STORE(&ring->tail, tail);
+
+    return 1;
+}
+
+static void flush(struct vicc_capture *capture)
+{
+    struct capture_ring *ring, **prev = &capture->rings;
+    int written = 0, retired;
+
+    while ((ring = *prev)) {
+        /* a retired ring is not written anymore, so it is drained now */
+        retired = LOAD(&ring->retired);
+        written |= ring_flush(capture, ring);
+        if (retired) {
+            *prev = ring->next;
+            capture->frames += ring->frames;
+            capture->dropped += ring->dropped;
+            free(ring->buf);
+            free(ring);
+        } else {
+            prev = &ring->next;
+        }
+    }
+
+    if (written && fflush(capture->file) != 0)
+        capture->error = 1;
+}
+
+static void *capture_run(void *arg)
+{
+    struct vicc_capture *capture = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&capture->mutex);
+    while (!capture->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&capture->wake, &capture->mutex, &deadline);
+        flush(capture);
+    }
+    pthread_mutex_unlock(&capture->mutex);
+
+    return NULL;
+}
+
+/* Destructor of the key, which hands the ring of an exiting thread over to
+ * the flush thread */
+static void ring_retire(void *arg)
+{
+    struct capture_ring *ring = arg;
+
+    STORE(&ring->retired, 1);
+}
+
+/* Returns the ring of the calling thread, which is set up on first use */
+static struct capture_ring *ring_of(struct vicc_capture *capture)
+{
+    struct capture_ring *ring = pthread_getspecific(capture->key);
+
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof *ring);
+    if (!ring)
+        return NULL;
+    ring->buf = malloc(CAPTURE_RING_SIZE);
+    if (!ring->buf || pthread_setspecific(capture->key, ring) != 0) {
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&capture->mutex);
+    ring->next = capture->rings;
+    capture->rings = ring;
+    pthread_mutex_unlock(&capture->mutex);
+
+    return ring;
+}
+
+static void ring_put(struct capture_ring *ring, size_t *head,
+        const void *data, size_t len)
+{
+    size_t offset = *head & (CAPTURE_RING_SIZE - 1);
+    size_t first = CAPTURE_RING_SIZE - offset;
+
+    if (!len)
+        return;
+    if (first > len)
+        first = len;
+    memcpy(ring->buf + offset, data, first);
+    if (len > first)
+        memcpy(ring->buf, (const unsigned char *) data + first, len - first);
+    *head += len;
+}
+
+void capture_frame(struct vicc_ctx *ctx, int direction, unsigned char flags,
+        unsigned short tag, const unsigned char *data, size_t len)
+{
+    static const unsigned char padding[3];
+    struct vicc_capture *capture;
+    struct capture_ring *ring;
+    unsigned char header[CAPTURE_HEADER_LEN];
+    uint32_t epb[PCAPNG_EPB_LEN / 4], block_len;
+    unsigned long long now;
+    size_t captured, head;
+
+    if (!ctx || !(capture = ctx->capture))
+        return;
+
+    ring = ring_of(capture);
+    if (!ring)
+        return;
+
+    captured = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+    block_len = (uint32_t) (PCAPNG_EPB_LEN
+            + ((CAPTURE_HEADER_LEN + captured + 3) & ~(size_t) 3) + 4);
+    head = ring->head;
+    if (block_len > CAPTURE_RING_SIZE - (head - LOAD(&ring->tail))) {
+        /* the flush thread is behind, rather lose the frame than wait */
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    now = now_ns();
+    epb[0] = PCAPNG_EPB;
+    epb[1] = block_len;
+    epb[2] = 0;
+    epb[3] = (uint32_t) (now >> 32);
+    epb[4] = (uint32_t) now;
+    epb[5] = (uint32_t) (CAPTURE_HEADER_LEN + captured);
+    epb[6] = (uint32_t) (CAPTURE_HEADER_LEN + len);
+
+    header[0] = CAPTURE_VERSION;
+    header[1] = (unsigned char) direction;
+    header[2] = (ctx->capture_slot >> 8) & 0xFF;
+    header[3] = ctx->capture_slot & 0xFF;
+    header[4] = flags;
+    header[5] = 0;
+    header[6] = (tag >> 8) & 0xFF;
+    header[7] = tag & 0xFF;
+
+    ring_put(ring, &head, epb, sizeof epb);
+    ring_put(ring, &head, header, sizeof header);
+    ring_put(ring, &head, data, captured);
+    ring_put(ring, &head, padding,
+            (4 - (CAPTURE_HEADER_LEN + captured) % 4) % 4);
+    ring_put(ring, &head, &block_len, sizeof block_len);
+    STORE(&ring->head, head);
+    __atomic_store_n(&ring->frames, ring->frames + 1, __ATOMIC_RELAXED);
+
+    if (head - LOAD(&ring->tail) > CAPTURE_RING_SIZE / 2)
+        pthread_cond_signal(&capture->wake);
+}
+
+struct vicc_capture *vicc_capture_open(const char *path)
+{
+    struct vicc_capture *capture = NULL;
+    int key_created = 0, mutex_created = 0, cond_created = 0;
+
+    if (!path) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    capture = calloc(1, sizeof *capture);
+    if (!capture)
+        goto err;
+
+    capture->file = fopen(path, "wb");
+    if (!capture->file)
+        goto err;
+    write_header(capture);
+    if (capture->error || fflush(capture->file) != 0)
+        goto err;
+
+    if (pthread_key_create(&capture->key, ring_retire) != 0)
+        goto err;
+    key_created = 1;
+    if (pthread_mutex_init(&capture->mutex, NULL) != 0)
+        goto err;
+    mutex_created = 1;
+    if (pthread_cond_init(&capture->wake, NULL) != 0)
+        goto err;
+    cond_created = 1;
+    if (pthread_create(&capture->thread, NULL, capture_run, capture) != 0)
+        goto err;
+
+    return capture;
+
+err:
+    if (capture) {
+        if (cond_created)
+            pthread_cond_destroy(&capture->wake);
+        if (mutex_created)
+            pthread_mutex_destroy(&capture->mutex);
+        if (key_created)
+            pthread_key_delete(capture->key);
+        if (capture->file)
+            fclose(capture->file);
+        free(capture);
+    }
+
+    return NULL;
+}
+
+int vicc_capture_close(struct vicc_capture *capture)
+{
+    struct capture_ring *ring;
+    int r = 0;
+
+    if (!capture)
+        return 0;
+
+    pthread_mutex_lock(&capture->mutex);
+    capture->stop = 1;
+    pthread_cond_signal(&capture->wake);
+    pthread_mutex_unlock(&capture->mutex);
+    pthread_join(capture->thread, NULL);
+
+    flush(capture);
+    write_statistics(capture);
+    if (capture->error)
+        r = -1;
+    if (fclose(capture->file) != 0)
+        r = -1;
+
+    while (capture->rings) {
+        ring = capture->rings;
+        capture->rings = ring->next;
+        free(ring->buf);
+        free(ring);
+    }
+    pthread_key_delete(capture->key);
+    pthread_cond_destroy(&capture->wake);
+    pthread_mutex_destroy(&capture->mutex);
+    free(capture);
+
+    if (r < 0)
+        errno = EIO;
+
+    return r;
+}
+
+unsigned long long vicc_capture_dropped(struct vicc_capture *capture)
+{
+    struct capture_ring *ring;
+    unsigned long long dropped;
+
+    if (!capture)
+        return 0;
+
+    pthread_mutex_lock(&capture->mutex);
+    dropped = capture->dropped;
+    for (ring = capture->rings; ring; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&capture->mutex);
+
+    return dropped;
+}
+
+#else
+
+void capture_frame(struct vicc_ctx *ctx, int direction, unsigned char flags,
+        unsigned short tag, const unsigned char *data, size_t len)
+{
+}
+
+struct vicc_capture *vicc_capture_open(const char *path)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int vicc_capture_close(struct vicc_capture *capture)
+{
+    return 0;
+}
+
+unsigned long long vicc_capture_dropped(struct vicc_capture *capture)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Frames are captured to a pcapng file with the link type LINKTYPE_USER0.
+ * Each packet starts with a pseudo header of CAPTURE_HEADER_LEN bytes in
+ * network byte order:
+ *
+ *   version (1 byte), direction (1 byte), slot (2 bytes), flags of the frame
+ *   (1 byte), reserved (1 byte), tag of the frame (2 bytes)
+ *
+ * followed by the frame's data. Compressed data is captured after
+ * decompression, its flag is kept. See vpcd-capture.lua for Wireshark. */
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN 8
+/* LINKTYPE_USER0 */
+#define CAPTURE_LINKTYPE 147
+
+/* directions of a captured frame */
+#define CAPTURE_TO_VICC   0
+#define CAPTURE_FROM_VICC 1
+
+struct vicc_capture;
+struct vicc_ctx;
+
+/* Records a frame of the context if it is captured. Never blocks, the frame
+ * is dropped if the calling thread's buffer is full. */
+void capture_frame(struct vicc_ctx *ctx, int direction, unsigned char flags,
+        unsigned short tag, const unsigned char *data, size_t len);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "connect.h"
+#include "lock.h"
+#include "shard.h"
+#include "stats.h"
+#include "vpcd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifndef AI_NUMERICSERV
+#define AI_NUMERICSERV 0
+#endif
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#endif
+
+const struct addrinfo *connect_resolve(struct vicc_ctx *ctx)
+{
+    struct addrinfo hints;
+    char port[10];
+
+    if (ctx->addrs && now_us() / 1000 < ctx->addrs_expire)
+        return ctx->addrs;
+
+    if (ctx->addrs) {
+        freeaddrinfo(ctx->addrs);
+        ctx->addrs = NULL;
+    }
+
+    if (snprintf(port, sizeof port, "%hu", ctx->port) < 0)
+        return NULL;
+    port[(sizeof port) -1] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if (getaddrinfo(ctx->hostname, port, &hints, &ctx->addrs) != 0) {
+        ctx->addrs = NULL;
+        return NULL;
+    }
+    ctx->addrs_expire = now_us() / 1000 + CONNECT_RESOLVE_TTL_MS;
+
+    return ctx->addrs;
+}
+
+int connect_due(struct vicc_ctx *ctx)
+{
+    int moved, r;
+
+    /* a slot of a shard moves to another host before it connects */
+    moved = ctx->shard && shard_route(ctx) > 0;
+    if (moved && ctx->addrs) {
+        freeaddrinfo(ctx->addrs);
+        ctx->addrs = NULL;
+    }
+
+    if (!lock(ctx->stats_lock))
+        return 1;
+    if (moved) {
+        /* the backoff is due to the previous host */
+        ctx->connect_failures = 0;
+        ctx->connect_backoff = 0;
+        ctx->connect_next = 0;
+    }
+    /* the same clock as the one of the statistics */
+    r = now_us() / 1000 >= ctx->connect_next;
+    unlock(ctx->stats_lock);
+
+    return r;
+}
+
+void connect_done(struct vicc_ctx *ctx, int connected)
+{
+    if (ctx->shard)
+        shard_report(ctx, connected);
+
+    if (!lock(ctx->stats_lock))
+        return;
+
+    if (connected) {
+        ctx->connect_failures = 0;
+        ctx->connect_backoff = 0;
+        ctx->connect_next = 0;
+    } else {
+        ctx->stats.connect_failures++;
+        ctx->connect_failures++;
+        if (!ctx->connect_backoff)
+            ctx->connect_backoff = CONNECT_BACKOFF_MIN_MS;
+        else if (ctx->connect_backoff < CONNECT_BACKOFF_MAX_MS / 2)
+            ctx->connect_backoff *= 2;
+        else
+            ctx->connect_backoff = CONNECT_BACKOFF_MAX_MS;
+        ctx->connect_next = now_us() / 1000 + ctx->connect_backoff;
+    }
+
+    unlock(ctx->stats_lock);
+}
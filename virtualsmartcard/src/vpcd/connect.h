@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CONNECT_H_
+#define _CONNECT_H_
+
+#include "vpcd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the backoff between failed attempts to connect doubles from the minimum up
+ * to the maximum */
+#define CONNECT_BACKOFF_MIN_MS 100
+#define CONNECT_BACKOFF_MAX_MS 10000
+/* milliseconds the addresses of a remote vicc are cached */
+#define CONNECT_RESOLVE_TTL_MS 60000
+
+/* Returns the cached addresses of the remote vicc, which are looked up again
+ * once they have expired */
+struct addrinfo;
+const struct addrinfo *connect_resolve(struct vicc_ctx *ctx);
+/* Tells whether the backoff allows another attempt to connect */
+int connect_due(struct vicc_ctx *ctx);
+/* Records the outcome of an attempt to connect */
+void connect_done(struct vicc_ctx *ctx, int connected);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fault.h"
+#include "stats.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Longest scenario read from a file */
+#define FAULT_MAX_FILE 0x10000
+
+enum fault_dist {
+    DIST_NONE,
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_NORMAL,
+    DIST_EXP,
+    DIST_PARETO,
+};
+
+/* Faults from a point in time of the scenario on, delays in milliseconds */
+struct fault_phase {
+    double at;
+    enum fault_dist dist;
+    double a, b;
+    double jitter;
+    /* bytes per second, 0 for no limit */
+    double rate;
+    /* probabilities per frame */
+    double drop;
+    double truncate;
+    /* FAULT_TO_VICC and/or FAULT_FROM_VICC */
+    int directions;
+};
+
+struct vicc_fault {
+    unsigned long long seed;
+    /* seconds after which the scenario starts over, 0 if it does not */
+    double loop;
+    /* sorted by the time they start */
+    struct fault_phase *phases;
+    size_t phases_len;
+};
+
+/* SplitMix64, which gives every stream of a seed its own sequence */
+static unsigned long long next(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+/* Returns a number in (0, 1) */
+static double uniform(unsigned long long *state)
+{
+    return ((next(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* Parses a number, which must be followed by one of the characters in end */
+static int number(const char **s, const char *end, double *value)
+{
+    char *p;
+
+    errno = 0;
+    *value = strtod(*s, &p);
+    if (errno || p == *s || !strchr(end, *p) || *value < 0)
+        return 0;
+    *s = p;
+
+    return 1;
+}
+
+static int parse_delay(struct fault_phase *phase, const char *s)
+{
+    static const struct {
+        const char *name;
+        enum fault_dist dist;
+        int params;
+    } dists[] = {
+        {"fixed:", DIST_FIXED, 1},
+        {"uniform:", DIST_UNIFORM, 2},
+        {"normal:", DIST_NORMAL, 2},
+        {"exp:", DIST_EXP, 1},
+        {"pareto:", DIST_PARETO, 2},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof dists / sizeof *dists; i++) {
+        if (strncmp(s, dists[i].name, strlen(dists[i].name)) != 0)
+            continue;
+        s += strlen(dists[i].name);
+        phase->dist = dists[i].dist;
+        if (dists[i].params == 1)
+            return number(&s, "", &phase->a);
+        return number(&s, ":", &phase->a) && *s++ == ':'
+            && number(&s, "", &phase->b)
+            && (phase->dist != DIST_UNIFORM || phase->a <= phase->b)
+            && (phase->dist != DIST_PARETO || phase->b > 0);
+    }
+
+    return 0;
+}
+
+/* Parses a setting of a phase like "drop=0.01" */
+static int parse_setting(struct fault_phase *phase, const char *s)
+{
+    if (strncmp(s, "delay=", strlen("delay=")) == 0)
+        return parse_delay(phase, s + strlen("delay="));
+
+    if (strncmp(s, "jitter=", strlen("jitter=")) == 0) {
+        s += strlen("jitter=");
+        return number(&s, "", &phase->jitter);
+    }
+
+    if (strncmp(s, "rate=", strlen("rate=")) == 0) {
+        s += strlen("rate=");
+        if (!number(&s, "kM", &phase->rate))
+            return 0;
+        if (*s == 'k')
+            phase->rate *= 1000;
+        else if (*s == 'M')
+            phase->rate *= 1000000;
+        return *s == '\0' || s[1] == '\0';
+    }
+
+    if (strncmp(s, "drop=", strlen("drop=")) == 0) {
+        s += strlen("drop=");
+        return number(&s, "", &phase->drop) && phase->drop <= 1;
+    }
+
+    if (strncmp(s, "truncate=", strlen("truncate=")) == 0) {
+        s += strlen("truncate=");
+        return number(&s, "", &phase->truncate) && phase->truncate <= 1;
+    }
+
+    if (strcmp(s, "dir=to") == 0) {
+        phase->directions = FAULT_TO_VICC;
+        return 1;
+    }
+    if (strcmp(s, "dir=from") == 0) {
+        phase->directions = FAULT_FROM_VICC;
+        return 1;
+    }
+    if (strcmp(s, "dir=both") == 0) {
+        phase->directions = FAULT_TO_VICC|FAULT_FROM_VICC;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Splits the line into words, which are terminated in place. Returns the
+ * number of words. */
+static size_t words(char *line, char **word, size_t size)
+{
+    size_t n = 0;
+
+    while (n < size) {
+        line += strspn(line, " \t\r");
+        if (!*line)
+            break;
+        word[n++] = line;
+        line += strcspn(line, " \t\r");
+        if (*line)
+            *line++ = '\0';
+    }
+
+    return n;
+}
+
+static int parse_line(struct vicc_fault *fault, char *line)
+{
+    struct fault_phase *phases, phase;
+    char *word[16];
+    const char *s;
+    size_t n, i;
+
+    n = words(line, word, sizeof word / sizeof *word);
+    if (!n)
+        return 1;
+    if (n == sizeof word / sizeof *word)
+        return 0;
+
+    if (strcmp(word[0], "seed") == 0) {
+        errno = 0;
+        fault->seed = strtoull(n == 2 ? word[1] : "", &line, 0);
+        return n == 2 && !errno && line != word[1] && !*line;
+    }
+
+    if (strcmp(word[0], "loop") == 0) {
+        s = n == 2 ? word[1] : "";
+        return n == 2 && number(&s, "", &fault->loop);
+    }
+
+    memset(&phase, 0, sizeof phase);
+    phase.directions = FAULT_TO_VICC|FAULT_FROM_VICC;
+    s = word[0];
+    if (!number(&s, "", &phase.at))
+        return 0;
+    for (i = 1; i < n; i++)
+        if (!parse_setting(&phase, word[i]))
+            return 0;
+
+    /* phases must be given in the order they start */
+    if (fault->phases_len
+            && fault->phases[fault->phases_len - 1].at >= phase.at)
+        return 0;
+
+    phases = realloc(fault->phases,
+            (fault->phases_len + 1) * sizeof *phases);
+    if (!phases)
+        return 0;
+    fault->phases = phases;
+    phases[fault->phases_len++] = phase;
+
+    return 1;
+}
+
+struct vicc_fault *vicc_fault_new(const char *scenario)
+{
+    struct vicc_fault *fault = NULL;
+    char *copy = NULL, *line, *end;
+    int error = EINVAL;
+
+    if (!scenario)
+        goto err;
+
+    fault = calloc(1, sizeof *fault);
+    copy = strdup(scenario);
+    if (!fault || !copy) {
+        error = ENOMEM;
+        goto err;
+    }
+
+    /* lines end with a newline or a semicolon, comments with the line */
+    for (line = copy; line; line = end) {
+        end = line + strcspn(line, "\n;");
+        if (*end)
+            *end++ = '\0';
+        else
+            end = NULL;
+        line[strcspn(line, "#")] = '\0';
+        if (!parse_line(fault, line))
+            goto err;
+    }
+    free(copy);
+
+    return fault;
+
+err:
+    free(copy);
+    vicc_fault_free(fault);
+    errno = error;
+
+    return NULL;
+}
+
+struct vicc_fault *vicc_fault_load(const char *path)
+{
+    struct vicc_fault *fault = NULL;
+    char *scenario = NULL;
+    size_t len;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return NULL;
+
+    scenario = malloc(FAULT_MAX_FILE + 1);
+    if (!scenario)
+        goto err;
+    len = fread(scenario, 1, FAULT_MAX_FILE + 1, f);
+    if (ferror(f) || len > FAULT_MAX_FILE) {
+        errno = EFBIG;
+        goto err;
+    }
+    scenario[len] = '\0';
+
+    fault = vicc_fault_new(scenario);
+
+err:
+    free(scenario);
+    fclose(f);
+
+    return fault;
+}
+
+void vicc_fault_free(struct vicc_fault *fault)
+{
+    if (fault) {
+        free(fault->phases);
+        free(fault);
+    }
+}
+
+void fault_stream_init(struct fault_stream *stream,
+        const struct vicc_fault *fault, unsigned short id)
+{
+    stream->fault = fault;
+    stream->rng = fault->seed;
+    /* streams of the same seed are far apart in the sequence */
+    stream->rng = next(&stream->rng) ^ ((unsigned long long) id << 32);
+    stream->start = now_us();
+    stream->busy_until[0] = 0;
+    stream->busy_until[1] = 0;
+}
+
+static const struct fault_phase *current(const struct vicc_fault *fault,
+        long long elapsed)
+{
+    double t = elapsed / 1e6;
+    size_t i;
+
+    if (fault->loop > 0)
+        t = fmod(t, fault->loop);
+
+    for (i = fault->phases_len; i > 0; i--)
+        if (fault->phases[i - 1].at <= t)
+            return &fault->phases[i - 1];
+
+    return NULL;
+}
+
+int fault_frame(struct fault_stream *stream, int direction, size_t len,
+        long long *delay, size_t *keep)
+{
+    const struct fault_phase *phase;
+    long long now = now_us(), *busy_until;
+    double u[5], ms = 0;
+    size_t i;
+
+    /* the same number of draws for every frame keeps the sequences of all
+     * runs aligned, whatever the phase */
+    for (i = 0; i < sizeof u / sizeof *u; i++)
+        u[i] = uniform(&stream->rng);
+
+    *delay = 0;
+    *keep = len;
+
+    phase = current(stream->fault, now - stream->start);
+    if (!phase || !(phase->directions & direction))
+        return FAULT_PASS;
+
+    switch (phase->dist) {
+        case DIST_FIXED:
+            ms = phase->a;
+            break;
+        case DIST_UNIFORM:
+            ms = phase->a + (phase->b - phase->a) * u[0];
+            break;
+        case DIST_NORMAL:
+            /* Box-Muller */
+            ms = phase->a + phase->b * sqrt(-2 * log(u[0]))
+                * cos(2 * 3.14159265358979323846 * u[1]);
+            break;
+        case DIST_EXP:
+            ms = -phase->a * log(u[0]);
+            break;
+        case DIST_PARETO:
+            ms = phase->a / pow(u[0], 1 / phase->b);
+            break;
+        default:
+            break;
+    }
+    ms += phase->jitter * u[2];
+    if (ms < 0)
+        ms = 0;
+    *delay = (long long) (ms * 1000);
+
+    if (phase->rate > 0) {
+        /* the frame waits for the frames before it to go through */
+        busy_until = &stream->busy_until[direction == FAULT_TO_VICC ? 0 : 1];
+        if (*busy_until < now + *delay)
+            *busy_until = now + *delay;
+        *busy_until += (long long) (len * 1e6 / phase->rate);
+        *delay = *busy_until - now;
+    }
+
+    if (u[3] < phase->drop)
+        return FAULT_DROP;
+    if (u[3] < phase->drop + phase->truncate) {
+        *keep = (size_t) (len * u[4]);
+        return FAULT_TRUNCATE;
+    }
+
+    return FAULT_PASS;
+}
+
+int fault_sleep(long long delay, long long limit)
+{
+    int cut = 0;
+#ifndef _WIN32
+    struct timespec ts;
+#endif
+
+    if (limit >= 0 && limit < delay) {
+        delay = limit;
+        cut = 1;
+    }
+
+    if (delay > 0) {
+#ifdef _WIN32
+        Sleep((DWORD) ((delay + 999) / 1000));
+#else
+        ts.tv_sec = (time_t) (delay / 1000000);
+        ts.tv_nsec = (long) (delay % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+#endif
+    }
+
+    if (cut) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return 0;
+}
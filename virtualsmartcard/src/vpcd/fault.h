@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FAULT_H_
+#define _FAULT_H_
+
+#include "vpcd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Direction of a frame */
+#define FAULT_TO_VICC 1
+#define FAULT_FROM_VICC 2
+
+/* Fate of a frame: it is passed, the connection is closed instead or only the
+ * beginning of the frame is passed before closing the connection */
+#define FAULT_PASS 0
+#define FAULT_DROP 1
+#define FAULT_TRUNCATE 2
+
+/* Frames of one connection in both directions, which draw their random
+ * numbers from a sequence of their own */
+struct fault_stream {
+    const struct vicc_fault *fault;
+    unsigned long long rng;
+    /* monotonic time in microseconds when the scenario has started */
+    long long start;
+    /* monotonic time in microseconds until which each direction is busy
+     * with the frames passed before at the scenario's rate */
+    long long busy_until[2];
+};
+
+/* Starts the scenario for the stream with the given number */
+void fault_stream_init(struct fault_stream *stream,
+        const struct vicc_fault *fault, unsigned short id);
+
+/* Decides the fate of a frame of len bytes including its header. delay
+ * receives the microseconds to hold the frame back and keep the number of
+ * bytes to pass with FAULT_TRUNCATE. */
+int fault_frame(struct fault_stream *stream, int direction, size_t len,
+        long long *delay, size_t *keep);
+
+/* Sleeps for delay microseconds, but at most for limit microseconds unless
+ * limit is negative. Returns -1 with errno set to ETIMEDOUT if the limit has
+ * cut the sleep short. */
+int fault_sleep(long long delay, long long limit);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "frame.h"
+#include "vpcd.h"
+
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* All numbers are encoded in network byte order. Without any features, a
+ * frame is preceded by its length on 2 bytes. VPCD_FEATURE_LEN32 extends the
+ * length to 4 bytes. With VPCD_FEATURE_TAGGED the length is followed by one
+ * byte of flags and the tag on 2 bytes. With VPCD_FEATURE_DEFLATE, a flag
+ * marks a frame whose body is compressed. */
+
+size_t frame_header_len(unsigned int features)
+{
+    size_t len = 2;
+
+    if (features & VPCD_FEATURE_LEN32)
+        len += 2;
+    if (features & VPCD_FEATURE_TAGGED)
+        len += 3;
+
+    return len;
+}
+
+size_t frame_max_len(unsigned int features)
+{
+    if (features & VPCD_FEATURE_LEN32)
+        return FRAME_MAX_LEN32;
+
+    return 0xFFFF;
+}
+
+size_t frame_encode_header(unsigned int features, unsigned char *header,
+        size_t length, unsigned char flags, unsigned short tag)
+{
+    size_t i = 0;
+
+    if (features & VPCD_FEATURE_LEN32) {
+        header[i++] = (length >> 24) & 0xFF;
+        header[i++] = (length >> 16) & 0xFF;
+    }
+    header[i++] = (length >> 8) & 0xFF;
+    header[i++] = length & 0xFF;
+
+    if (features & VPCD_FEATURE_TAGGED) {
+        header[i++] = flags;
+        header[i++] = (tag >> 8) & 0xFF;
+        header[i++] = tag & 0xFF;
+    }
+
+    return i;
+}
+
+void frame_decode_header(unsigned int features, const unsigned char *header,
+        size_t *length, unsigned char *flags, unsigned short *tag)
+{
+    size_t i = 0;
+
+    *length = 0;
+    if (features & VPCD_FEATURE_LEN32) {
+        *length = ((size_t) header[i] << 24) | ((size_t) header[i+1] << 16);
+        i += 2;
+    }
+    *length |= ((size_t) header[i] << 8) | header[i+1];
+    i += 2;
+
+    if (features & VPCD_FEATURE_TAGGED) {
+        *flags = header[i++];
+        *tag = (unsigned short) ((header[i] << 8) | header[i+1]);
+    } else {
+        *flags = 0;
+        *tag = 0;
+    }
+}
+
+void frame_encode_hello(unsigned char *buf,
+        unsigned char version, unsigned int features)
+{
+    memcpy(buf, FRAME_HELLO_MAGIC, 4);
+    buf[4] = version;
+    buf[5] = (features >> 24) & 0xFF;
+    buf[6] = (features >> 16) & 0xFF;
+    buf[7] = (features >> 8) & 0xFF;
+    buf[8] = features & 0xFF;
+}
+
+int frame_decode_hello(const unsigned char *buf, size_t len,
+        unsigned char *version, unsigned int *features)
+{
+    if (len != FRAME_HELLO_LEN || memcmp(buf, FRAME_HELLO_MAGIC, 4) != 0)
+        return 0;
+
+    *version = buf[4];
+    *features = ((unsigned int) buf[5] << 24) | ((unsigned int) buf[6] << 16)
+        | ((unsigned int) buf[7] << 8) | buf[8];
+
+    return 1;
+}
+
+void frame_encode_session(unsigned char *buf, const unsigned char *id)
+{
+    memcpy(buf, FRAME_SESSION_MAGIC, 4);
+    memcpy(buf + 4, id, FRAME_SESSION_ID_LEN);
+}
+
+int frame_decode_session(const unsigned char *buf, size_t len,
+        unsigned char *id)
+{
+    if (len != FRAME_SESSION_LEN
+            || memcmp(buf, FRAME_SESSION_MAGIC, 4) != 0)
+        return 0;
+
+    memcpy(id, buf + 4, FRAME_SESSION_ID_LEN);
+
+    return 1;
+}
+
+int frame_decode_announce(const unsigned char *buf, size_t len,
+        unsigned short *slot)
+{
+    if (len != FRAME_ANNOUNCE_LEN
+            || memcmp(buf, FRAME_ANNOUNCE_MAGIC, 4) != 0)
+        return 0;
+
+    *slot = (unsigned short) ((buf[4] << 8) | buf[5]);
+
+    return 1;
+}
+
+size_t frame_deflate(const unsigned char *in, size_t len,
+        unsigned char *out, size_t out_size)
+{
+#ifdef HAVE_ZLIB
+    uLongf deflated_len;
+
+    if (out_size <= FRAME_DEFLATE_PREFIX_LEN || len > 0xFFFFFFFF)
+        return 0;
+
+    out[0] = (len >> 24) & 0xFF;
+    out[1] = (len >> 16) & 0xFF;
+    out[2] = (len >> 8) & 0xFF;
+    out[3] = len & 0xFF;
+
+    /* favor latency over the last few bytes */
+    deflated_len = out_size - FRAME_DEFLATE_PREFIX_LEN;
+    if (compress2(out + FRAME_DEFLATE_PREFIX_LEN, &deflated_len, in, len,
+                Z_BEST_SPEED) != Z_OK)
+        return 0;
+
+    return FRAME_DEFLATE_PREFIX_LEN + deflated_len;
+#else
+    return 0;
+#endif
+}
+
+size_t frame_inflated_len(const unsigned char *body, size_t len)
+{
+    if (len <= FRAME_DEFLATE_PREFIX_LEN)
+        return 0;
+
+    return ((size_t) body[0] << 24) | ((size_t) body[1] << 16)
+        | ((size_t) body[2] << 8) | body[3];
+}
+
+int frame_inflate(const unsigned char *body, size_t len, unsigned char *out)
+{
+#ifdef HAVE_ZLIB
+    uLongf inflated_len = frame_inflated_len(body, len);
+
+    return inflated_len
+        && uncompress(out, &inflated_len, body + FRAME_DEFLATE_PREFIX_LEN,
+                len - FRAME_DEFLATE_PREFIX_LEN) == Z_OK
+        && inflated_len == frame_inflated_len(body, len);
+#else
+    return 0;
+#endif
+}
+
+unsigned int frame_select_features(unsigned char *version,
+        unsigned int offered, unsigned int requested)
+{
+    if (*version > VPCD_PROTOCOL_VERSION)
+        *version = VPCD_PROTOCOL_VERSION;
+    if (*version < 2)
+        offered &= ~VPCD_FEATURE_LEN32;
+    /* events, compressed frames and heartbeats are told apart by the flags of
+     * a tagged frame. A resumed session tells a command sent again by its
+     * tag. */
+    if (!(offered & requested & VPCD_FEATURE_TAGGED))
+        offered &= ~(VPCD_FEATURE_EVENTS|VPCD_FEATURE_DEFLATE
+                |VPCD_FEATURE_HEARTBEAT|VPCD_FEATURE_RESUME);
+#ifndef HAVE_ZLIB
+    offered &= ~VPCD_FEATURE_DEFLATE;
+#endif
+
+    return offered & requested;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum length of a frame's header with all features enabled */
+#define FRAME_MAX_HEADER_LEN 7
+
+/* Limit for frames with 32 bit lengths, which bounds the memory a peer can
+ * make us allocate */
+#define FRAME_MAX_LEN32 0x1000000
+
+/* Flag of a frame which vicc sent on its own. Its body holds the event
+ * (VPCD_EVENT_*), optionally followed by the card's new ATR. */
+#define FRAME_FLAG_EVENT 0x01
+/* Limit of an event's body */
+#define FRAME_MAX_EVENT_LEN 64
+/* Flag of a frame whose body is compressed (VPCD_FEATURE_DEFLATE). The body
+ * holds the length of the original payload on 4 bytes followed by the payload
+ * compressed in zlib format. */
+#define FRAME_FLAG_DEFLATE 0x02
+#define FRAME_DEFLATE_PREFIX_LEN 4
+/* Flag of an empty frame which vpcd sends on an idle connection
+ * (VPCD_FEATURE_HEARTBEAT). vicc answers it right away with an empty frame
+ * with the same flag and tag. */
+#define FRAME_FLAG_HEARTBEAT 0x04
+
+/* Body of the messages exchanged for negotiating the protocol features */
+#define FRAME_HELLO_MAGIC "vpcd"
+#define FRAME_HELLO_LEN 9
+
+/* Body of the messages which open or resume a session after the features
+ * have been selected (VPCD_FEATURE_RESUME). vpcd names the session it had
+ * with vicc, all zeros if none, and vicc answers with the session it has. */
+#define FRAME_SESSION_MAGIC "sess"
+#define FRAME_SESSION_ID_LEN 8
+#define FRAME_SESSION_LEN (4 + FRAME_SESSION_ID_LEN)
+
+/* Body of the message which vicc sends right after connecting to a port
+ * shared by several slots. It names the slot vicc wants to be routed to. */
+#define FRAME_ANNOUNCE_MAGIC "slot"
+#define FRAME_ANNOUNCE_LEN 6
+
+/* Length of the header preceding each frame */
+size_t frame_header_len(unsigned int features);
+
+/* Maximum length of a frame's payload */
+size_t frame_max_len(unsigned int features);
+
+/* Returns the length of the encoded header */
+size_t frame_encode_header(unsigned int features, unsigned char *header,
+        size_t length, unsigned char flags, unsigned short tag);
+
+/* header must hold frame_header_len(features) bytes */
+void frame_decode_header(unsigned int features, const unsigned char *header,
+        size_t *length, unsigned char *flags, unsigned short *tag);
+
+/* buf must hold FRAME_HELLO_LEN bytes */
+void frame_encode_hello(unsigned char *buf,
+        unsigned char version, unsigned int features);
+
+/* Returns 1 if buf contains a hello message, 0 otherwise */
+int frame_decode_hello(const unsigned char *buf, size_t len,
+        unsigned char *version, unsigned int *features);
+
+/* buf must hold FRAME_SESSION_LEN bytes */
+void frame_encode_session(unsigned char *buf, const unsigned char *id);
+
+/* Returns 1 if buf contains a session message, 0 otherwise. id receives
+ * FRAME_SESSION_ID_LEN bytes. */
+int frame_decode_session(const unsigned char *buf, size_t len,
+        unsigned char *id);
+
+/* Returns 1 if buf contains an announcement, 0 otherwise */
+int frame_decode_announce(const unsigned char *buf, size_t len,
+        unsigned short *slot);
+
+/* Compresses the payload into out, which holds out_size bytes. Returns the
+ * length of the compressed body or 0 if it does not fit into out_size bytes
+ * or if compression is not available. */
+size_t frame_deflate(const unsigned char *in, size_t len,
+        unsigned char *out, size_t out_size);
+
+/* Returns the length of the payload of a compressed body, 0 if there is none */
+size_t frame_inflated_len(const unsigned char *body, size_t len);
+
+/* Decompresses the body into out, which must hold
+ * frame_inflated_len(body, len) bytes. Returns 1 on success, 0 if the body
+ * is corrupt or if compression is not available. */
+int frame_inflate(const unsigned char *body, size_t len, unsigned char *out);
+
+/* Returns the features to be used with a peer which offered them in its
+ * hello. version is lowered to the one supported by both. */
+unsigned int frame_select_features(unsigned char *version,
+        unsigned int offered, unsigned int requested);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Card for the PC/SC-lite smart card reader driver tester (handler_test(1)),
+ * which answers like vicc's handler_test card, but runs in the process of
+ * vpcd. Build it with `make handler-test.la` and use it with
+ * DEVICENAME inproc:/path/to/.libs/handler-test.so */
+
+#include "vicc-card.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct handler_test {
+    int powered;
+    /* response of a case 4 TPDU, which is fetched with GET RESPONSE */
+    size_t offcut_len;
+    unsigned char offcut[0x10000];
+};
+
+static const unsigned char atr[] = {
+    0x3B, 0xD6, 0x18, 0x00, 0x80, 0xB1, 0x80, 0x6D, 0x1F, 0x03, 0x80, 0x51,
+    0x00, 0x61, 0x10, 0x30, 0x9E,
+};
+
+static void *handler_test_open(void)
+{
+    return calloc(1, sizeof(struct handler_test));
+}
+
+static void handler_test_close(void *card)
+{
+    free(card);
+}
+
+static ssize_t handler_test_atr(void *card, unsigned char *out, size_t size)
+{
+    (void) card;
+
+    if (size < sizeof atr) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    memcpy(out, atr, sizeof atr);
+
+    return sizeof atr;
+}
+
+static int handler_test_power(void *card, int on)
+{
+    struct handler_test *test = card;
+
+    test->powered = on;
+    test->offcut_len = 0;
+
+    return 0;
+}
+
+static int handler_test_reset(void *card)
+{
+    return handler_test_power(card, 1);
+}
+
+/* Writes as many bytes as requested with P1 P2 if they fit into size */
+static ssize_t output_from_le(const unsigned char *apdu, unsigned char *out,
+        size_t size)
+{
+    size_t le = (size_t) apdu[2] << 8 | apdu[3], i;
+
+    if (le > size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    for (i = 0; i < le; i++)
+        out[i] = i & 0xff;
+
+    return le;
+}
+
+static ssize_t handler_test_transmit(void *card, const unsigned char *apdu,
+        size_t apdu_len, unsigned char *rapdu, size_t rapdu_size)
+{
+    static const unsigned char select_50[] = {
+        0x00, 0xA4, 0x04, 0x00, 0x06, 0xA0, 0x00, 0x00, 0x00, 0x18, 0x50,
+    };
+    static const unsigned char select_ff[] = {
+        0x00, 0xA4, 0x04, 0x00, 0x06, 0xA0, 0x00, 0x00, 0x00, 0x18, 0xFF,
+    };
+    struct handler_test *test = card;
+    unsigned char sw1 = 0x90, sw2 = 0x00;
+    ssize_t len = 0;
+    size_t ne;
+
+    if (rapdu_size < 2) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if ((apdu_len == sizeof select_50
+                && memcmp(apdu, select_50, apdu_len) == 0)
+            || (apdu_len == sizeof select_ff
+                && memcmp(apdu, select_ff, apdu_len) == 0)) {
+        /* select applet */
+    } else if (apdu_len >= 3 && apdu[0] == 0x80 && apdu[1] == 0x38
+            && apdu[2] == 0x00) {
+        /* time request */
+    } else if ((apdu_len == 4 || (apdu_len == 5 && apdu[4] == 0x00))
+            && apdu[0] == 0x80 && apdu[1] == 0x30 && apdu[2] == 0x00
+            && apdu[3] == 0x00) {
+        /* case 1 */
+    } else if (apdu_len >= 4 && apdu[0] == 0x80 && apdu[1] == 0x32
+            && apdu[2] == 0x00 && apdu[3] == 0x00) {
+        /* case 3 */
+    } else if (apdu_len >= 4 && apdu[0] == 0x80 && apdu[1] == 0x34) {
+        /* case 2 */
+        len = output_from_le(apdu, rapdu, rapdu_size - 2);
+    } else if (apdu_len >= 5 && apdu[0] == 0x80 && apdu[1] == 0x36
+            && apdu_len == 5 + (size_t) apdu[4]) {
+        /* case 4 TPDU, the response is fetched with GET RESPONSE */
+        test->offcut_len = output_from_le(apdu, test->offcut,
+                sizeof test->offcut);
+        sw1 = 0x61;
+        sw2 = test->offcut_len > 0xff ? 0x00 : test->offcut_len & 0xff;
+    } else if (apdu_len >= 5 && apdu[0] == 0x80 && apdu[1] == 0x36
+            && apdu_len == 6 + (size_t) apdu[4]) {
+        /* case 4 APDU */
+        len = output_from_le(apdu, rapdu, rapdu_size - 2);
+    } else if (apdu_len >= 5 && apdu[0] == 0x80 && apdu[1] == 0xC0
+            && apdu[2] == 0x00 && apdu[3] == 0x00) {
+        /* get response */
+        ne = apdu[4] ? apdu[4] : 0x100;
+        if (ne > test->offcut_len)
+            ne = test->offcut_len;
+        if (ne > rapdu_size - 2) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        len = ne;
+        memcpy(rapdu, test->offcut, len);
+        memmove(test->offcut, test->offcut + len, test->offcut_len - len);
+        test->offcut_len -= len;
+    } else {
+        sw1 = 0x6D;
+    }
+    if (len < 0)
+        return -1;
+
+    rapdu[len] = sw1;
+    rapdu[len + 1] = sw2;
+
+    return len + 2;
+}
+
+const struct vicc_card vicc_card = {
+    VICC_CARD_VERSION,
+    handler_test_open,
+    handler_test_close,
+    handler_test_atr,
+    handler_test_power,
+    handler_test_reset,
+    handler_test_transmit,
+};
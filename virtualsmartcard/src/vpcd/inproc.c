@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "inproc.h"
+#include "vicc-card.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HAVE_DLFCN_H
+
+#include <dlfcn.h>
+
+struct vicc_inproc {
+    void *library;
+    const struct vicc_card *ops;
+    /* state of the inserted card, NULL if there is none */
+    void *card;
+};
+
+struct vicc_inproc *inproc_open(const char *path)
+{
+    struct vicc_inproc *inproc = NULL;
+    const struct vicc_card *ops;
+    void *library;
+
+    library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        errno = ENOENT;
+        goto err;
+    }
+
+    ops = dlsym(library, VICC_CARD_SYMBOL);
+    if (!ops || ops->version != VICC_CARD_VERSION || !ops->open
+            || !ops->close || !ops->atr || !ops->power || !ops->reset
+            || !ops->transmit) {
+        errno = ENOEXEC;
+        goto err;
+    }
+
+    inproc = malloc(sizeof *inproc);
+    if (!inproc)
+        goto err;
+    inproc->library = library;
+    inproc->ops = ops;
+    inproc->card = NULL;
+
+    return inproc;
+
+err:
+    if (library)
+        dlclose(library);
+
+    return NULL;
+}
+
+void inproc_free(struct vicc_inproc *inproc)
+{
+    if (inproc) {
+        inproc_eject(inproc);
+        dlclose(inproc->library);
+        free(inproc);
+    }
+}
+
+int inproc_accept(struct vicc_inproc *inproc, int *attached)
+{
+    *attached = 0;
+
+    if (!inproc->card) {
+        inproc->card = inproc->ops->open();
+        if (!inproc->card)
+            return 0;
+        *attached = 1;
+    }
+
+    return 1;
+}
+
+int inproc_eject(struct vicc_inproc *inproc)
+{
+    if (!inproc->card)
+        return 0;
+
+    inproc->ops->close(inproc->card);
+    inproc->card = NULL;
+
+    return 1;
+}
+
+static int control(struct vicc_inproc *inproc, unsigned char ctrl)
+{
+    switch (ctrl) {
+        case VPCD_CTRL_OFF:
+            return inproc->ops->power(inproc->card, 0);
+        case VPCD_CTRL_ON:
+            return inproc->ops->power(inproc->card, 1);
+        case VPCD_CTRL_RESET:
+            return inproc->ops->reset(inproc->card);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+ssize_t inproc_transmit(struct vicc_inproc *inproc,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu)
+{
+    unsigned char *p;
+    ssize_t r;
+
+    if (!inproc->card) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (!apdu_len || !apdu) {
+        /* there is nobody to receive a command from */
+        if (rapdu) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        return 1;
+    }
+
+    if (!rapdu) {
+        if (apdu_len != VPCD_CTRL_LEN || apdu[0] == VPCD_CTRL_ATR) {
+            errno = EINVAL;
+            return -1;
+        }
+        return control(inproc, apdu[0]) < 0 ? -1 : (ssize_t) apdu_len;
+    }
+
+    if (realloc_rapdu) {
+        /* the card writes right into the caller's buffer, which is trimmed
+         * afterwards */
+        p = realloc(*rapdu, INPROC_MAX_RAPDU);
+        if (!p)
+            return -1;
+        *rapdu = p;
+        rapdu_size = INPROC_MAX_RAPDU;
+    }
+
+    if (apdu_len == VPCD_CTRL_LEN && apdu[0] == VPCD_CTRL_ATR)
+        r = inproc->ops->atr(inproc->card, *rapdu, rapdu_size);
+    else
+        r = inproc->ops->transmit(inproc->card, apdu, apdu_len, *rapdu,
+                rapdu_size);
+
+    if (r > (ssize_t) rapdu_size) {
+        errno = ENOBUFS;
+        r = -1;
+    }
+    if (r > 0 && realloc_rapdu) {
+        p = realloc(*rapdu, r);
+        if (p)
+            *rapdu = p;
+    }
+
+    return r;
+}
+
+#else
+
+struct vicc_inproc *inproc_open(const char *path)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void inproc_free(struct vicc_inproc *inproc)
+{
+}
+
+int inproc_accept(struct vicc_inproc *inproc, int *attached)
+{
+    *attached = 0;
+    return 0;
+}
+
+int inproc_eject(struct vicc_inproc *inproc)
+{
+    return 0;
+}
+
+ssize_t inproc_transmit(struct vicc_inproc *inproc,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _INPROC_H_
+#define _INPROC_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef HAVE_CONFIG_H
+typedef int ssize_t;
+#endif
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A card loaded from a shared library (see vicc-card.h), which takes the place
+ * of vicc. Loading the library does not insert the card, which happens on
+ * inproc_accept() and which opens a fresh card after each inproc_eject(). */
+
+/* Largest response of a card, the data of an extended APDU and SW1 SW2 */
+#define INPROC_MAX_RAPDU (0x10000 + 2)
+
+struct vicc_inproc;
+
+/* Returns NULL and sets errno on errors, ENOSYS if libvpcd has been built
+ * without support for loading libraries */
+struct vicc_inproc *inproc_open(const char *path);
+void inproc_free(struct vicc_inproc *inproc);
+
+/* Returns 1 if a card is inserted, inserting it if necessary. attached is set
+ * to 1 if the card has been inserted during this call. */
+int inproc_accept(struct vicc_inproc *inproc, int *attached);
+/* Returns 1 if a card has been removed, 0 if none was inserted */
+int inproc_eject(struct vicc_inproc *inproc);
+
+/* Passes a command or a control byte (VPCD_CTRL_*) to the card with the same
+ * semantics as transmitting it to vicc: without rapdu the number of bytes
+ * "sent" is returned, otherwise the length of the response. */
+ssize_t inproc_transmit(struct vicc_inproc *inproc,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -16,6 +16,9 @@
  * You should have received a copy of the GNU General Public License along with
  * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
  */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include <stdlib.h>
 
@@ -28,6 +31,11 @@ int lock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return TryEnterCriticalSection(io_lock) ? 1 : 0;
+}
+
 int unlock(void *io_lock)
 {
 	LeaveCriticalSection(io_lock);
@@ -55,15 +63,23 @@ void free_lock(void *io_lock)
 
 int lock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_lock(io_lock))
         r = 1;
     return r;
 }
 
+int trylock(void *io_lock)
+{
+    int r = 0;
+    if (0 == pthread_mutex_trylock(io_lock))
+        r = 1;
+    return r;
+}
+
 int unlock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_unlock(io_lock))
         r = 1;
     return r;
@@ -72,8 +88,9 @@ int unlock(void *io_lock)
 void *create_lock(void)
 {
     pthread_mutex_t *io_lock = malloc(sizeof *io_lock);
-    if (io_lock) {
-        *io_lock = PTHREAD_MUTEX_INITIALIZER;
+    if (io_lock && 0 != pthread_mutex_init(io_lock, NULL)) {
+        free(io_lock);
+        io_lock = NULL;
     }
     return io_lock;
 }
@@ -91,6 +108,11 @@ int lock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return 1;
+}
+
 int unlock(void *io_lock)
 {
     return 1;
@@ -108,3 +130,54 @@ void free_lock(void *io_lock)
 #endif
 
 #endif
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+static void yield(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_WIN32)
+#define FENCE() MemoryBarrier()
+#else
+#define FENCE()
+#endif
+
+unsigned int seq_read_begin(const volatile unsigned int *seq)
+{
+    unsigned int start;
+
+    /* wait for a writer to finish */
+    while ((start = *seq) & 1)
+        yield();
+    FENCE();
+
+    return start;
+}
+
+int seq_read_retry(const volatile unsigned int *seq, unsigned int start)
+{
+    FENCE();
+    return *seq != start;
+}
+
+void seq_write_begin(volatile unsigned int *seq)
+{
+    *seq = *seq + 1;
+    FENCE();
+}
+
+void seq_write_end(volatile unsigned int *seq)
+{
+    FENCE();
+    *seq = *seq + 1;
+}
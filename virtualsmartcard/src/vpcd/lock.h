@@ -24,9 +24,20 @@ extern "C" {
 #endif
 
 int lock(void *io_lock);
+/* Returns 1 if the lock has been acquired without waiting */
+int trylock(void *io_lock);
 int unlock(void *io_lock);
 void *create_lock(void);
 void free_lock(void *io_lock);
+
+/* Sequence counter for data which is read without taking a lock. Writers,
+ * which need to be serialized by a lock of their own, enclose their changes in
+ * seq_write_begin() and seq_write_end(). Readers copy the data after
+ * seq_read_begin() and start over if seq_read_retry() returns 1. */
+unsigned int seq_read_begin(const volatile unsigned int *seq);
+int seq_read_retry(const volatile unsigned int *seq, unsigned int start);
+void seq_write_begin(volatile unsigned int *seq);
+void seq_write_end(volatile unsigned int *seq);
 #ifdef  __cplusplus
 }
 #endif
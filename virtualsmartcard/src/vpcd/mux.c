@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "frame.h"
+#include "lock.h"
+#include "mux.h"
+#include "reactor.h"
+#include "stats.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+struct vicc_mux *vicc_mux_new(const char *hostname, unsigned short port)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void vicc_mux_free(struct vicc_mux *mux)
+{
+}
+
+int mux_register(struct vicc_mux *mux, struct vicc_ctx *ctx,
+        unsigned short slot)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void mux_unregister(struct vicc_ctx *ctx)
+{
+}
+
+SOCKET mux_accept(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    return INVALID_SOCKET;
+}
+
+SOCKET mux_take(struct vicc_ctx *ctx)
+{
+    return INVALID_SOCKET;
+}
+
+void mux_release(struct vicc_ctx *ctx)
+{
+}
+
+#else
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define INVALID_SOCKET -1
+
+struct mux_slot {
+    struct vicc_ctx *ctx;
+    /* a connection has been routed to the slot and not yet closed */
+    int connected;
+    /* connection routed to the slot, which it has not taken yet */
+    SOCKET pending;
+};
+
+struct vicc_mux {
+    /* owns the listening socket */
+    struct vicc_ctx *listener;
+    void *lock;
+    struct mux_slot *slots;
+    size_t slots_len;
+    size_t slots_size;
+};
+
+struct vicc_mux *vicc_mux_new(const char *hostname, unsigned short port)
+{
+    struct vicc_mux *mux = NULL;
+    int flags;
+
+    if (hostname && strncmp(hostname, VPCD_UNIX_PREFIX,
+                strlen(VPCD_UNIX_PREFIX)) != 0) {
+        /* vicc can only be multiplexed on a socket we listen on */
+        errno = EINVAL;
+        goto err;
+    }
+
+    mux = calloc(1, sizeof *mux);
+    if (!mux)
+        goto err;
+
+    mux->lock = create_lock();
+    mux->listener = vicc_init(hostname, port);
+    if (!mux->lock || !mux->listener)
+        goto err;
+
+    /* all slots wait for the listening socket, only one of them gets a new
+     * connection */
+    flags = fcntl(mux->listener->server_sock, F_GETFL);
+    if (flags < 0
+            || fcntl(mux->listener->server_sock, F_SETFL,
+                flags | O_NONBLOCK) < 0
+            || listen(mux->listener->server_sock, SOMAXCONN) != 0)
+        goto err;
+
+    return mux;
+
+err:
+    vicc_mux_free(mux);
+
+    return NULL;
+}
+
+void vicc_mux_free(struct vicc_mux *mux)
+{
+    size_t i;
+
+    if (!mux)
+        return;
+
+    for (i = 0; i < mux->slots_len; i++) {
+        mux->slots[i].ctx->mux = NULL;
+        if (mux->slots[i].pending != INVALID_SOCKET)
+            close(mux->slots[i].pending);
+    }
+    free(mux->slots);
+    if (mux->listener)
+        vicc_exit(mux->listener);
+    if (mux->lock)
+        free_lock(mux->lock);
+    free(mux);
+}
+
+static struct mux_slot *find(struct vicc_mux *mux, struct vicc_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < mux->slots_len; i++)
+        if (mux->slots[i].ctx == ctx)
+            return &mux->slots[i];
+
+    return NULL;
+}
+
+int mux_register(struct vicc_mux *mux, struct vicc_ctx *ctx,
+        unsigned short slot)
+{
+    struct mux_slot *p;
+    size_t i;
+    int r = -1;
+
+    if (slot == VPCD_SLOT_ANY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!lock(mux->lock))
+        return -1;
+
+    for (i = 0; i < mux->slots_len; i++) {
+        if (mux->slots[i].ctx->slot == slot) {
+            errno = EADDRINUSE;
+            goto err;
+        }
+    }
+
+    if (mux->slots_len == mux->slots_size) {
+        p = realloc(mux->slots, (mux->slots_size + 8) * sizeof *p);
+        if (!p)
+            goto err;
+        mux->slots = p;
+        mux->slots_size += 8;
+    }
+
+    /* with a descriptor of its own, the context waits for the listening
+     * socket like for one it owns */
+    ctx->server_sock = fcntl(mux->listener->server_sock, F_DUPFD_CLOEXEC, 0);
+    if (ctx->server_sock == INVALID_SOCKET)
+        goto err;
+    /* the path belongs to the multiplexer, the context must not remove it */
+    ctx->mux = mux;
+    ctx->slot = slot;
+    if (mux->listener->path) {
+        ctx->path = strdup(mux->listener->path);
+        if (!ctx->path)
+            goto err;
+    }
+
+    p = &mux->slots[mux->slots_len++];
+    p->ctx = ctx;
+    p->connected = 0;
+    p->pending = INVALID_SOCKET;
+    r = 0;
+
+err:
+    unlock(mux->lock);
+
+    return r;
+}
+
+void mux_unregister(struct vicc_ctx *ctx)
+{
+    struct vicc_mux *mux = ctx->mux;
+    struct mux_slot *p;
+
+    if (!mux || !lock(mux->lock))
+        return;
+
+    p = find(mux, ctx);
+    if (p) {
+        if (p->pending != INVALID_SOCKET)
+            close(p->pending);
+        *p = mux->slots[--mux->slots_len];
+    }
+
+    unlock(mux->lock);
+}
+
+/* Waits for vicc to announce its slot. Returns 1 if the connection may be
+ * routed to the slot, which is VPCD_SLOT_ANY if vicc keeps silent. */
+static int read_announce(SOCKET sock, unsigned short *slot)
+{
+    unsigned char buf[2 + FRAME_ANNOUNCE_LEN];
+    size_t received = 0;
+    long long deadline = now_us() / 1000 + MUX_ANNOUNCE_MS, left;
+    struct pollfd pfd;
+    ssize_t r;
+
+    *slot = VPCD_SLOT_ANY;
+
+    while (received < sizeof buf) {
+        left = deadline - now_us() / 1000;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        r = poll(&pfd, 1, left > 0 ? (int) left : 0);
+        if (r < 0 && errno != EINTR)
+            return 0;
+        if (r == 0)
+            /* an old vicc waits for us to speak first */
+            return received == 0;
+        r = recv(sock, buf + received, sizeof buf - received, MSG_DONTWAIT);
+        if (r == 0)
+            return 0;
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            return 0;
+        }
+        received += r;
+    }
+
+    /* the announcement is framed without any features */
+    if (buf[0] != 0 || buf[1] != FRAME_ANNOUNCE_LEN)
+        return 0;
+
+    return frame_decode_announce(buf + 2, FRAME_ANNOUNCE_LEN, slot);
+}
+
+/* Returns the free slot the connection is routed to or NULL if there is
+ * none. Any slot means the one with the lowest number. */
+static struct mux_slot *route(struct vicc_mux *mux, unsigned short slot)
+{
+    struct mux_slot *target = NULL;
+    size_t i;
+
+    for (i = 0; i < mux->slots_len; i++) {
+        if (mux->slots[i].connected)
+            continue;
+        if (slot != VPCD_SLOT_ANY && mux->slots[i].ctx->slot != slot)
+            continue;
+        if (!target || mux->slots[i].ctx->slot < target->ctx->slot)
+            target = &mux->slots[i];
+    }
+
+    return target;
+}
+
+/* Accepts a connection without waiting longer than the deadline */
+static SOCKET accept_until(SOCKET server, long long deadline)
+{
+    struct pollfd pfd;
+    long long left;
+    SOCKET sock;
+    int flags;
+
+    left = deadline - now_us() / 1000;
+    pfd.fd = server;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, left > 0 ? (int) left : 0) <= 0
+            || !(pfd.revents & POLLIN)) {
+        errno = ETIMEDOUT;
+        return INVALID_SOCKET;
+    }
+
+    sock = accept(server, NULL, NULL);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    /* some systems pass on O_NONBLOCK of the listening socket */
+    flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        close(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+SOCKET mux_accept(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    struct vicc_mux *mux = ctx->mux;
+    struct mux_slot *target;
+    long long deadline = now_us() / 1000 + secs * 1000 + usecs / 1000;
+    unsigned short slot;
+    SOCKET sock;
+
+    while (1) {
+        sock = mux_take(ctx);
+        if (sock != INVALID_SOCKET)
+            return sock;
+
+        sock = accept_until(ctx->server_sock, deadline);
+        if (sock == INVALID_SOCKET) {
+            if (now_us() / 1000 >= deadline
+                    || (errno != EAGAIN && errno != EWOULDBLOCK
+                        && errno != EINTR && errno != ECONNABORTED))
+                return INVALID_SOCKET;
+            /* another slot was faster */
+            continue;
+        }
+
+        /* the announcement is awaited without blocking the other slots */
+        if (!read_announce(sock, &slot) || !lock(mux->lock)) {
+            close(sock);
+            continue;
+        }
+
+        target = route(mux, slot);
+        if (!target) {
+            /* the slot is taken or unknown */
+            close(sock);
+        } else {
+            target->connected = 1;
+            if (target->ctx == ctx) {
+                unlock(mux->lock);
+                return sock;
+            }
+            target->pending = sock;
+            /* the reactor takes it by itself */
+            if (!target->ctx->reactor)
+                event_post(target->ctx, MUX_EVENT_ROUTED);
+        }
+
+        unlock(mux->lock);
+    }
+}
+
+SOCKET mux_take(struct vicc_ctx *ctx)
+{
+    struct mux_slot *p;
+    SOCKET sock = INVALID_SOCKET;
+
+    if (!ctx->mux || !lock(ctx->mux->lock))
+        return INVALID_SOCKET;
+
+    p = find(ctx->mux, ctx);
+    if (p) {
+        sock = p->pending;
+        p->pending = INVALID_SOCKET;
+    }
+
+    unlock(ctx->mux->lock);
+
+    return sock;
+}
+
+void mux_release(struct vicc_ctx *ctx)
+{
+    struct mux_slot *p;
+
+    if (!ctx->mux || !lock(ctx->mux->lock))
+        return;
+
+    p = find(ctx->mux, ctx);
+    if (p && p->pending == INVALID_SOCKET)
+        p->connected = 0;
+
+    unlock(ctx->mux->lock);
+}
+
+#endif
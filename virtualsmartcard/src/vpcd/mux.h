@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include "vpcd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Milliseconds to wait for vicc to announce its slot. A vicc which does not
+ * know about announcements waits for us to speak first and gets any free
+ * slot after this time. */
+#define MUX_ANNOUNCE_MS 250
+
+/* Queued to a context's events when a connection has been routed to it,
+ * which it is to take with mux_take() */
+#define MUX_EVENT_ROUTED 0xff
+
+/* Adds the context as slot to the multiplexer, which gives it a listening
+ * socket of its own sharing the multiplexer's port */
+int mux_register(struct vicc_mux *mux, struct vicc_ctx *ctx,
+        unsigned short slot);
+void mux_unregister(struct vicc_ctx *ctx);
+
+/* Accepts connections until one is routed to the context or the time is up.
+ * Connections routed to other slots are kept for them. */
+SOCKET mux_accept(struct vicc_ctx *ctx, long secs, long usecs);
+/* Returns the connection routed to the context by another slot, if any */
+SOCKET mux_take(struct vicc_ctx *ctx);
+/* Frees the context's slot for the next connection */
+void mux_release(struct vicc_ctx *ctx);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
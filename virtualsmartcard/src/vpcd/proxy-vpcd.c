@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Forwards the frames between vpcd and vicc over TCP and injects the faults
+ * of a scenario into them, just like vicc_set_fault() does inside libvpcd.
+ * This puts any vpcd and any vicc, including the ones of other versions,
+ * under the same delays and failures. Build it with `make proxy-vpcd`. */
+
+#include "fault.h"
+#include "frame.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* connections to vpcd and to vicc forwarded to each other */
+struct conn {
+    unsigned int id;
+    int vpcd_sock;
+    int vicc_sock;
+    /* features of the frames, which change with vpcd's hello */
+    pthread_mutex_t lock;
+    unsigned int features;
+    int negotiated;
+};
+
+/* frames forwarded in one direction */
+struct pump {
+    struct conn *conn;
+    int from;
+    int to;
+    int direction;
+    struct fault_stream stream;
+};
+
+static struct vicc_fault *fault = NULL;
+/* 1 if vpcd connects to the proxy, 0 if vicc does */
+static int reverse = 0;
+static struct addrinfo *target = NULL;
+static int verbose = 0;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-f FILE | -e SCENARIO] [-r] [-v] LISTEN_PORT HOST:PORT\n"
+            "\n"
+            "  -f  read the scenario of faults from FILE\n"
+            "  -e  scenario given on the command line, lines separated by ';'\n"
+            "  -r  vpcd connects to LISTEN_PORT and the proxy to vicc on\n"
+            "      HOST:PORT, by default vicc connects to LISTEN_PORT and the\n"
+            "      proxy to vpcd on HOST:PORT\n"
+            "  -v  print every frame\n"
+            "\n"
+            "The scenario starts over with every connection. Connection N draws\n"
+            "its faults from the streams 2N (to vicc) and 2N+1 (from vicc), so\n"
+            "that a scenario with a seed repeats the same faults, e.g.\n"
+            "\"seed 7; 0 delay=normal:20:5; 30 drop=0.05; 60\".\n", name);
+}
+
+/* Returns 1 if all of len bytes are read, 0 on the end of the stream and -1
+ * on errors */
+static int readall(int fd, unsigned char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len) {
+        r = recv(fd, buf, len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return (int) r;
+        buf += r;
+        len -= (size_t) r;
+    }
+
+    return 1;
+}
+
+static int writeall(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len) {
+        r = send(fd, buf, len, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        buf += r;
+        len -= (size_t) r;
+    }
+
+    return 1;
+}
+
+static const char *name(int direction)
+{
+    return direction == FAULT_TO_VICC ? "to vicc" : "from vicc";
+}
+
+static void *pump(void *arg)
+{
+    struct pump *p = arg;
+    struct conn *conn = p->conn;
+    unsigned char *frame = NULL, *q;
+    size_t size = 0, header_len, len, keep;
+    unsigned int features;
+    unsigned char flags, version;
+    unsigned short tag;
+    long long delay;
+    int fate = FAULT_PASS;
+
+    while (1) {
+        if (size < FRAME_MAX_HEADER_LEN) {
+            q = realloc(frame, FRAME_MAX_HEADER_LEN);
+            if (!q)
+                break;
+            frame = q;
+            size = FRAME_MAX_HEADER_LEN;
+        }
+
+        /* the peer only sends the first byte of a frame after it has seen
+         * the frames before, including the hello which selects the
+         * features */
+        if (readall(p->from, frame, 1) <= 0)
+            break;
+        pthread_mutex_lock(&conn->lock);
+        features = conn->features;
+        pthread_mutex_unlock(&conn->lock);
+        header_len = frame_header_len(features);
+        if (readall(p->from, frame + 1, header_len - 1) <= 0)
+            break;
+        frame_decode_header(features, frame, &len, &flags, &tag);
+
+        if (header_len + len > size) {
+            q = realloc(frame, header_len + len);
+            if (!q)
+                break;
+            frame = q;
+            size = header_len + len;
+        }
+        if (len && readall(p->from, frame + header_len, len) <= 0)
+            break;
+
+        if (p->direction == FAULT_TO_VICC && !conn->negotiated
+                && frame_decode_hello(frame + header_len, len, &version,
+                    &features)) {
+            /* the features vpcd has selected apply from the next frame on
+             * in both directions */
+            pthread_mutex_lock(&conn->lock);
+            conn->features = features;
+            conn->negotiated = 1;
+            pthread_mutex_unlock(&conn->lock);
+        }
+
+        keep = header_len + len;
+        delay = 0;
+        if (fault)
+            fate = fault_frame(&p->stream, p->direction, header_len + len,
+                    &delay, &keep);
+        fault_sleep(delay, -1);
+
+        if (verbose || fate != FAULT_PASS)
+            fprintf(stderr, "connection %u: %s frame of %zu bytes %s after "
+                    "%lld ms%s\n", conn->id,
+                    fate == FAULT_DROP ? "dropped"
+                    : fate == FAULT_TRUNCATE ? "truncated" : "passed",
+                    header_len + len, name(p->direction), delay / 1000,
+                    fate == FAULT_TRUNCATE ? " (beginning only)" : "");
+
+        if (fate == FAULT_DROP)
+            break;
+        if (writeall(p->to, frame, keep) < 0 || fate == FAULT_TRUNCATE)
+            break;
+    }
+
+    free(frame);
+
+    /* a connection lost on one side is lost on the other one, too */
+    shutdown(conn->vpcd_sock, SHUT_RDWR);
+    shutdown(conn->vicc_sock, SHUT_RDWR);
+
+    return NULL;
+}
+
+static int connect_target(void)
+{
+    struct addrinfo *ai;
+    int fd, one = 1;
+
+    for (ai = target; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            return fd;
+        }
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void *forward(void *arg)
+{
+    struct conn *conn = arg;
+    struct pump to_vicc, from_vicc;
+    pthread_t thread;
+    int fd;
+
+    fd = connect_target();
+    if (fd < 0) {
+        fprintf(stderr, "connection %u: could not connect to %s\n", conn->id,
+                reverse ? "vicc" : "vpcd");
+        close(reverse ? conn->vpcd_sock : conn->vicc_sock);
+        goto err;
+    }
+    if (reverse)
+        conn->vicc_sock = fd;
+    else
+        conn->vpcd_sock = fd;
+    if (verbose)
+        fprintf(stderr, "connection %u: opened\n", conn->id);
+
+    to_vicc.conn = conn;
+    to_vicc.from = conn->vpcd_sock;
+    to_vicc.to = conn->vicc_sock;
+    to_vicc.direction = FAULT_TO_VICC;
+    from_vicc.conn = conn;
+    from_vicc.from = conn->vicc_sock;
+    from_vicc.to = conn->vpcd_sock;
+    from_vicc.direction = FAULT_FROM_VICC;
+    if (fault) {
+        fault_stream_init(&to_vicc.stream, fault,
+                (unsigned short) (2 * conn->id));
+        fault_stream_init(&from_vicc.stream, fault,
+                (unsigned short) (2 * conn->id + 1));
+    }
+
+    if (pthread_create(&thread, NULL, pump, &from_vicc) != 0) {
+        fprintf(stderr, "connection %u: %s\n", conn->id, strerror(errno));
+    } else {
+        pump(&to_vicc);
+        pthread_join(thread, NULL);
+    }
+    if (verbose)
+        fprintf(stderr, "connection %u: closed\n", conn->id);
+
+    close(conn->vpcd_sock);
+    close(conn->vicc_sock);
+
+err:
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+
+    return NULL;
+}
+
+static int listen_on(const char *port)
+{
+    struct addrinfo hints, *ai, *res;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+                && listen(fd, 16) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints;
+    struct conn *conn;
+    pthread_t thread;
+    char *host, *port;
+    unsigned int id = 0;
+    int opt, server, fd, one = 1;
+
+    while ((opt = getopt(argc, argv, "f:e:rvh")) != -1) {
+        switch (opt) {
+            case 'f':
+            case 'e':
+                if (fault) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                fault = opt == 'f' ? vicc_fault_load(optarg)
+                    : vicc_fault_new(optarg);
+                if (!fault) {
+                    fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                    return 2;
+                }
+                break;
+            case 'r':
+                reverse = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind != 2 || !(port = strrchr(argv[optind + 1], ':'))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    host = argv[optind + 1];
+    *port++ = '\0';
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &target) != 0) {
+        fprintf(stderr, "Could not resolve %s\n", host);
+        return 1;
+    }
+
+    server = listen_on(argv[optind]);
+    if (server < 0) {
+        fprintf(stderr, "Could not listen on port %s\n", argv[optind]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        fd = accept(server, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        conn = calloc(1, sizeof *conn);
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->id = id++;
+        conn->vpcd_sock = reverse ? fd : -1;
+        conn->vicc_sock = reverse ? -1 : fd;
+        conn->features = 0;
+        pthread_mutex_init(&conn->lock, NULL);
+        if (pthread_create(&thread, NULL, forward, conn) != 0) {
+            close(fd);
+            pthread_mutex_destroy(&conn->lock);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(server);
+    freeaddrinfo(target);
+    vicc_fault_free(fault);
+
+    return 1;
+}
@@ -0,0 +1,1233 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "capture.h"
+#include "connect.h"
+#include "mux.h"
+#include "reactor.h"
+#include "stats.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_PTHREAD)
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INVALID_SOCKET -1
+
+/* milliseconds between two checks for connection attempts which are due or
+ * have taken too long in client mode */
+#define REACTOR_RECONNECT_INTERVAL 1000
+/* milliseconds a connect may take if the context has no timeout */
+#define REACTOR_CONNECT_TIMEOUT 2000
+#define REACTOR_MAX_EVENTS 32
+
+enum handshake_state {
+    HANDSHAKE_NONE,
+    /* hello and request for the ATR have been queued */
+    HANDSHAKE_HELLO,
+    /* vicc has answered the hello, its ATR is expected next */
+    HANDSHAKE_ATR,
+    /* the selected features are being sent */
+    HANDSHAKE_SELECT,
+};
+
+struct reactor_slot;
+
+/* epoll user data, tells apart the slot's server and client socket */
+struct reactor_handle {
+    struct reactor_slot *slot;
+};
+
+struct reactor_slot {
+    struct reactor_slot *next;
+    struct vicc_ctx *ctx;
+    struct reactor_handle server_handle;
+    struct reactor_handle client_handle;
+    /* requests to be sent, the head is currently being written */
+    struct vicc_request *tx_head, *tx_tail;
+    /* requests which have been sent and wait for their response */
+    struct vicc_request *rx_head, *rx_tail;
+    unsigned char rx_header[FRAME_MAX_HEADER_LEN];
+    size_t rx_header_len;
+    unsigned char rx_flags;
+    unsigned short rx_tag;
+    /* target of the frame currently received, NULL for the handshake and
+     * events */
+    struct vicc_request *rx_req;
+    int rx_event;
+    unsigned char ev_buf[FRAME_MAX_EVENT_LEN];
+    /* the context's events are to be dispatched */
+    int events_pending;
+    unsigned char *rx_buf;
+    size_t rx_size;
+    size_t rx_len;
+    int rx_discard;
+    enum handshake_state hs_state;
+    unsigned char hs_out[2*(FRAME_MAX_HEADER_LEN+FRAME_HELLO_LEN)];
+    size_t hs_out_len;
+    size_t hs_out_sent;
+    unsigned char hs_in[64];
+    unsigned char hs_version;
+    unsigned int hs_features;
+    /* events currently registered for the client socket */
+    uint32_t client_events;
+    int server_registered;
+    int connecting;
+    /* when the pending connect is given up */
+    long long connect_deadline;
+    int detach;
+};
+
+struct vicc_reactor {
+    int epfd;
+    int wakefd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct reactor_slot *slots;
+    /* completed requests whose callback is still to be invoked */
+    struct vicc_request *completed_head, *completed_tail;
+    int stop;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void wake(struct vicc_reactor *reactor)
+{
+    uint64_t one = 1;
+    if (write(reactor->wakefd, &one, sizeof one) < 0) {
+        /* the counter is already set, the reactor will wake up anyway */
+    }
+}
+
+static void complete(struct vicc_reactor *reactor, struct vicc_request *req,
+        ssize_t result, int error)
+{
+    req->result = result;
+    req->error = error;
+    req->done = 1;
+    req->next = NULL;
+
+    /* callbacks are invoked without holding the mutex */
+    if (req->callback) {
+        if (reactor->completed_tail)
+            reactor->completed_tail->next = req;
+        else
+            reactor->completed_head = req;
+        reactor->completed_tail = req;
+    }
+}
+
+static void fail_requests(struct vicc_reactor *reactor,
+        struct reactor_slot *slot, ssize_t result, int error)
+{
+    struct vicc_request *req;
+
+    while (slot->rx_head) {
+        req = slot->rx_head;
+        slot->rx_head = req->next;
+        stats_failure(slot->ctx, error);
+        complete(reactor, req, result, error);
+    }
+    slot->rx_tail = NULL;
+    while (slot->tx_head) {
+        req = slot->tx_head;
+        slot->tx_head = req->next;
+        stats_failure(slot->ctx, error);
+        complete(reactor, req, -1, error);
+    }
+    slot->tx_tail = NULL;
+}
+
+static void enqueue(struct vicc_request **head, struct vicc_request **tail,
+        struct vicc_request *req)
+{
+    req->next = NULL;
+    if (*tail)
+        (*tail)->next = req;
+    else
+        *head = req;
+    *tail = req;
+}
+
+static void unlink_rx(struct reactor_slot *slot, struct vicc_request *req)
+{
+    struct vicc_request **p, *prev = NULL;
+
+    for (p = &slot->rx_head; *p; prev = *p, p = &(*p)->next) {
+        if (*p == req) {
+            *p = req->next;
+            if (slot->rx_tail == req)
+                slot->rx_tail = prev;
+            return;
+        }
+    }
+}
+
+static void update_server(struct vicc_reactor *reactor,
+        struct reactor_slot *slot)
+{
+    struct epoll_event ev;
+    int want = slot->ctx->server_sock != INVALID_SOCKET
+        && slot->ctx->client_sock == INVALID_SOCKET && !slot->detach;
+
+    if (want == slot->server_registered)
+        return;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &slot->server_handle;
+    if (epoll_ctl(reactor->epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                slot->ctx->server_sock, &ev) == 0)
+        slot->server_registered = want;
+}
+
+static void update_client(struct vicc_reactor *reactor,
+        struct reactor_slot *slot)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (slot->ctx->client_sock == INVALID_SOCKET)
+        return;
+
+    if (!slot->detach) {
+        events = EPOLLIN;
+        if (slot->tx_head || slot->connecting
+                || slot->hs_out_sent < slot->hs_out_len)
+            events |= EPOLLOUT;
+    }
+
+    if (events == slot->client_events)
+        return;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = &slot->client_handle;
+    if (!slot->client_events)
+        epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, slot->ctx->client_sock, &ev);
+    else if (!events)
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, slot->ctx->client_sock, &ev);
+    else
+        epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, slot->ctx->client_sock, &ev);
+    slot->client_events = events;
+}
+
+static void slot_event(struct reactor_slot *slot, const unsigned char *body,
+        size_t len)
+{
+    event_handle(slot->ctx, body, len);
+    slot->events_pending = 1;
+}
+
+static void slot_connection(struct reactor_slot *slot, int connected)
+{
+    event_connection(slot->ctx, connected);
+    slot->events_pending = 1;
+}
+
+static int slot_eject(struct vicc_reactor *reactor, struct reactor_slot *slot,
+        ssize_t result, int error)
+{
+    int r = 0;
+
+    if (slot->ctx->client_sock != INVALID_SOCKET) {
+        if (!slot->connecting) {
+            stats_eject(slot->ctx, error);
+            slot_connection(slot, 0);
+        }
+        if (slot->client_events)
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, slot->ctx->client_sock,
+                    NULL);
+        if (close(slot->ctx->client_sock) < 0)
+            r = -1;
+        slot->ctx->client_sock = INVALID_SOCKET;
+    }
+    slot->client_events = 0;
+    slot->connecting = 0;
+    slot->rx_header_len = 0;
+    slot->rx_req = NULL;
+    slot->rx_event = 0;
+    slot->rx_len = 0;
+    slot->rx_discard = 0;
+    if (slot->hs_state == HANDSHAKE_HELLO)
+        /* an old vicc which does not tolerate the hello */
+        slot->ctx->legacy_peer = 1;
+    slot->hs_state = HANDSHAKE_NONE;
+    slot->hs_out_len = 0;
+    slot->hs_out_sent = 0;
+    slot->ctx->features = 0;
+    vicc_invalidate_atr(slot->ctx);
+    fail_requests(reactor, slot, result, error);
+    update_server(reactor, slot);
+
+    return r;
+}
+
+static void slot_adopt(struct vicc_reactor *reactor, struct reactor_slot *slot,
+        int sock)
+{
+    if (set_nonblocking(sock) < 0) {
+        close(sock);
+        if (slot->ctx->mux)
+            mux_release(slot->ctx);
+        return;
+    }
+
+    slot->ctx->client_sock = sock;
+    slot->ctx->handshake_pending = 1;
+    sockopts_apply(slot->ctx, sock);
+    slot_connection(slot, 1);
+    update_server(reactor, slot);
+}
+
+static void slot_accept(struct vicc_reactor *reactor, struct reactor_slot *slot)
+{
+    struct reactor_slot *other;
+    int sock, other_sock;
+
+    if (slot->ctx->client_sock != INVALID_SOCKET)
+        return;
+
+    if (slot->ctx->mux) {
+        sock = mux_accept(slot->ctx, 0, 0);
+        /* take the connections which have been routed to the other slots */
+        for (other = reactor->slots; other; other = other->next) {
+            if (other == slot || !other->ctx->mux || other->detach
+                    || other->ctx->client_sock != INVALID_SOCKET)
+                continue;
+            other_sock = mux_take(other->ctx);
+            if (other_sock != INVALID_SOCKET)
+                slot_adopt(reactor, other, other_sock);
+        }
+    } else {
+        sock = accept(slot->ctx->server_sock, NULL, NULL);
+    }
+    if (sock < 0)
+        return;
+
+    slot_adopt(reactor, slot, sock);
+}
+
+static void slot_connect(struct reactor_slot *slot)
+{
+    const struct addrinfo *res;
+    int sock;
+
+    /* the addresses are cached, so that a vanished host does not cause a
+     * lookup on every attempt */
+    res = connect_resolve(slot->ctx);
+    if (!res)
+        goto err;
+
+    sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+            res->ai_protocol);
+    if (sock < 0)
+        goto err;
+    sockopts_apply(slot->ctx, sock);
+
+    if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+        slot->ctx->client_sock = sock;
+        slot->ctx->handshake_pending = 1;
+        connect_done(slot->ctx, 1);
+        slot_connection(slot, 1);
+        return;
+    } else if (errno == EINPROGRESS) {
+        slot->ctx->client_sock = sock;
+        slot->ctx->handshake_pending = 1;
+        slot->connecting = 1;
+        slot->connect_deadline = now_ms() + (slot->ctx->timeout
+                ? slot->ctx->timeout : REACTOR_CONNECT_TIMEOUT);
+        return;
+    }
+    close(sock);
+
+err:
+    connect_done(slot->ctx, 0);
+}
+
+/* Returns 1 if everything has been written, 0 if the socket would block and
+ * -1 on errors. */
+static int send_frame(int sock, const unsigned char *header, size_t header_len,
+        const unsigned char *body, size_t body_len, size_t *sent)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    int iovcnt;
+    ssize_t r;
+
+    while (*sent < header_len + body_len) {
+        iovcnt = 0;
+        if (*sent < header_len) {
+            iov[iovcnt].iov_base = (void *) (header + *sent);
+            iov[iovcnt].iov_len = header_len - *sent;
+            iovcnt++;
+            if (body_len) {
+                iov[iovcnt].iov_base = (void *) body;
+                iov[iovcnt].iov_len = body_len;
+                iovcnt++;
+            }
+        } else {
+            iov[iovcnt].iov_base = (void *) (body + *sent - header_len);
+            iov[iovcnt].iov_len = header_len + body_len - *sent;
+            iovcnt++;
+        }
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            return -1;
+        }
+        *sent += r;
+    }
+
+    return 1;
+}
+
+static void handshake_start(struct reactor_slot *slot)
+{
+    struct vicc_ctx *ctx = slot->ctx;
+    unsigned char *p = slot->hs_out;
+
+    ctx->handshake_pending = 0;
+    if (ctx->legacy_peer || (!ctx->requested_features && !ctx->features))
+        return;
+
+    /* An old vicc ignores the hello and only answers the request for the
+     * ATR. Both are sent with the features currently in use. */
+    p += frame_encode_header(ctx->features, p, VPCD_CTRL_LEN, 0, 0);
+    *p++ = VPCD_CTRL_HELLO;
+    capture_frame(ctx, CAPTURE_TO_VICC, 0, 0, p - 1, VPCD_CTRL_LEN);
+    p += frame_encode_header(ctx->features, p, VPCD_CTRL_LEN, 0, 0);
+    *p++ = VPCD_CTRL_ATR;
+    capture_frame(ctx, CAPTURE_TO_VICC, 0, 0, p - 1, VPCD_CTRL_LEN);
+    slot->hs_out_len = p - slot->hs_out;
+    slot->hs_out_sent = 0;
+    slot->hs_state = HANDSHAKE_HELLO;
+}
+
+static void handshake_frame(struct reactor_slot *slot)
+{
+    struct vicc_ctx *ctx = slot->ctx;
+    unsigned char *p = slot->hs_out;
+
+    if (slot->hs_state == HANDSHAKE_HELLO) {
+        if (!slot->rx_discard && frame_decode_hello(slot->hs_in, slot->rx_len,
+                    &slot->hs_version, &slot->hs_features))
+            slot->hs_state = HANDSHAKE_ATR;
+        else
+            /* vicc ignored the hello and sent its ATR */
+            slot->hs_state = HANDSHAKE_NONE;
+        return;
+    }
+
+    /* select the features we both support, they are used from the next
+     * frame on. Frames are not (de)compressed on the reactor's thread, which
+     * neither sends heartbeats nor resumes sessions. */
+    slot->hs_features = frame_select_features(&slot->hs_version,
+            slot->hs_features,
+            ctx->requested_features
+            & ~(VPCD_FEATURE_DEFLATE|VPCD_FEATURE_HEARTBEAT
+                |VPCD_FEATURE_RESUME));
+    p += frame_encode_header(ctx->features, p, FRAME_HELLO_LEN, 0, 0);
+    frame_encode_hello(p, slot->hs_version, slot->hs_features);
+    capture_frame(ctx, CAPTURE_TO_VICC, 0, 0, p, FRAME_HELLO_LEN);
+    slot->hs_out_len = p + FRAME_HELLO_LEN - slot->hs_out;
+    slot->hs_out_sent = 0;
+    slot->hs_state = HANDSHAKE_SELECT;
+}
+
+static void slot_write(struct vicc_reactor *reactor, struct reactor_slot *slot)
+{
+    struct vicc_ctx *ctx = slot->ctx;
+    struct vicc_request *req;
+    int r;
+
+    if (slot->hs_out_sent < slot->hs_out_len) {
+        r = send_frame(ctx->client_sock, slot->hs_out, slot->hs_out_len,
+                NULL, 0, &slot->hs_out_sent);
+        if (r <= 0)
+            goto err;
+        if (slot->hs_state == HANDSHAKE_SELECT) {
+            ctx->features = slot->hs_features;
+            slot->hs_state = HANDSHAKE_NONE;
+        }
+    }
+    if (slot->hs_state != HANDSHAKE_NONE)
+        /* requests are held back until the handshake is finished */
+        return;
+
+    while (slot->tx_head) {
+        req = slot->tx_head;
+
+        if (!req->prepared) {
+            if (req->apdu_len > frame_max_len(ctx->features)) {
+                slot->tx_head = req->next;
+                if (!slot->tx_head)
+                    slot->tx_tail = NULL;
+                complete(reactor, req, -1, EINVAL);
+                continue;
+            }
+            if (ctx->features & VPCD_FEATURE_TAGGED) {
+                if (++ctx->tag == 0)
+                    ctx->tag = 1;
+                req->tag = ctx->tag;
+            } else {
+                req->tag = 0;
+            }
+            req->header_len = req->apdu_len ? frame_encode_header(ctx->features,
+                    req->header, req->apdu_len, 0, req->tag) : 0;
+            req->prepared = 1;
+        }
+
+        r = send_frame(ctx->client_sock, req->header, req->header_len,
+                req->apdu, req->apdu_len, &req->sent);
+        if (r <= 0)
+            goto err;
+        req->sent_us = now_us();
+        if (req->apdu_len)
+            capture_frame(ctx, CAPTURE_TO_VICC, 0, req->tag, req->apdu,
+                    req->apdu_len);
+
+        slot->tx_head = req->next;
+        if (!slot->tx_head)
+            slot->tx_tail = NULL;
+
+        if (req->rapdu)
+            enqueue(&slot->rx_head, &slot->rx_tail, req);
+        else
+            complete(reactor, req, req->sent ? (ssize_t) req->sent : 1, 0);
+    }
+    return;
+
+err:
+    if (r < 0)
+        slot_eject(reactor, slot, -1, errno);
+}
+
+/* Look up the target of a received frame, returns 0 if there is none */
+static int rx_target(struct reactor_slot *slot, unsigned char flags,
+        unsigned short tag)
+{
+    struct vicc_request *req;
+
+    if ((flags & FRAME_FLAG_EVENT)
+            && (slot->ctx->features & VPCD_FEATURE_EVENTS)) {
+        slot->rx_req = NULL;
+        slot->rx_event = 1;
+        slot->rx_buf = slot->ev_buf;
+        /* not an event we know of */
+        slot->rx_discard = slot->rx_size > sizeof slot->ev_buf;
+        return 1;
+    }
+
+    if (slot->hs_state == HANDSHAKE_HELLO || slot->hs_state == HANDSHAKE_ATR) {
+        slot->rx_req = NULL;
+        slot->rx_buf = slot->hs_in;
+        slot->rx_discard = slot->rx_size > sizeof slot->hs_in;
+        return 1;
+    }
+
+    req = slot->rx_head;
+    if (slot->ctx->features & VPCD_FEATURE_TAGGED)
+        while (req && req->tag != tag)
+            req = req->next;
+    if (!req)
+        return 0;
+
+    req->header_us = now_us();
+    slot->rx_req = req;
+    slot->rx_discard = 0;
+    if (slot->rx_size > req->rapdu_size) {
+        if (req->realloc_rapdu) {
+            slot->rx_buf = realloc(*req->rapdu, slot->rx_size);
+            if (!slot->rx_buf) {
+                errno = ENOMEM;
+                return 0;
+            }
+            *req->rapdu = slot->rx_buf;
+        } else {
+            slot->rx_discard = 1;
+        }
+    } else {
+        slot->rx_buf = *req->rapdu;
+    }
+
+    return 1;
+}
+
+static void slot_read(struct vicc_reactor *reactor, struct reactor_slot *slot)
+{
+    struct vicc_request *req;
+    unsigned char discard[256];
+    size_t header_len;
+    ssize_t r;
+
+    while (slot->ctx->client_sock != INVALID_SOCKET) {
+        header_len = frame_header_len(slot->ctx->features);
+
+        if (slot->rx_header_len < header_len) {
+            r = recv(slot->ctx->client_sock,
+                    slot->rx_header + slot->rx_header_len,
+                    header_len - slot->rx_header_len,
+                    MSG_DONTWAIT);
+            if (r == 0) {
+                slot_eject(reactor, slot, 0, ECONNRESET);
+                return;
+            }
+            if (r < 0)
+                goto err;
+            sockopts_rearm(slot->ctx, slot->ctx->client_sock);
+            slot->rx_header_len += r;
+            if (slot->rx_header_len < header_len)
+                continue;
+
+            frame_decode_header(slot->ctx->features, slot->rx_header,
+                    &slot->rx_size, &slot->rx_flags, &slot->rx_tag);
+            slot->rx_len = 0;
+            errno = EPROTO;
+            if (!rx_target(slot, slot->rx_flags, slot->rx_tag)) {
+                /* vicc must not send anything on its own */
+                slot_eject(reactor, slot, -1, errno);
+                return;
+            }
+        }
+
+        if (slot->rx_len < slot->rx_size) {
+            if (slot->rx_discard)
+                r = recv(slot->ctx->client_sock, discard,
+                        slot->rx_size - slot->rx_len < sizeof discard ?
+                        slot->rx_size - slot->rx_len : sizeof discard,
+                        MSG_DONTWAIT);
+            else
+                r = recv(slot->ctx->client_sock, slot->rx_buf + slot->rx_len,
+                        slot->rx_size - slot->rx_len, MSG_DONTWAIT);
+            if (r == 0) {
+                slot_eject(reactor, slot, -1, ECONNRESET);
+                return;
+            }
+            if (r < 0)
+                goto err;
+            slot->rx_len += r;
+            if (slot->rx_len < slot->rx_size)
+                continue;
+        }
+
+        /* the frame is complete */
+        slot->rx_header_len = 0;
+        capture_frame(slot->ctx, CAPTURE_FROM_VICC, slot->rx_flags,
+                slot->rx_tag, slot->rx_buf,
+                slot->rx_discard ? 0 : slot->rx_size);
+        req = slot->rx_req;
+        slot->rx_req = NULL;
+        if (slot->rx_event) {
+            slot->rx_event = 0;
+            if (slot->rx_size && !slot->rx_discard)
+                slot_event(slot, slot->ev_buf, slot->rx_size);
+            continue;
+        }
+        if (slot->rx_size == 0) {
+            /* same as in blocking mode, an empty response is an error */
+            if (req) {
+                unlink_rx(slot, req);
+                stats_failure(slot->ctx, ECONNRESET);
+                complete(reactor, req, 0, 0);
+            }
+            slot_eject(reactor, slot, -1, ECONNRESET);
+            return;
+        }
+        state_touch(slot->ctx);
+        if (!req) {
+            handshake_frame(slot);
+            if (slot->hs_state == HANDSHAKE_SELECT
+                    || slot->hs_state == HANDSHAKE_NONE)
+                slot_write(reactor, slot);
+            continue;
+        }
+        unlink_rx(slot, req);
+        if (slot->rx_discard) {
+            stats_failure(slot->ctx, ENOBUFS);
+            complete(reactor, req, -1, ENOBUFS);
+        } else {
+            if (req->apdu_len)
+                stats_command(slot->ctx, req->apdu_len, slot->rx_size,
+                        req->submitted_us, req->sent_us, req->header_us,
+                        now_us());
+            complete(reactor, req, slot->rx_size, 0);
+        }
+    }
+    return;
+
+err:
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        slot_eject(reactor, slot, -1, errno);
+}
+
+static void slot_io(struct vicc_reactor *reactor, struct reactor_slot *slot,
+        uint32_t events)
+{
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    if (slot->ctx->client_sock == INVALID_SOCKET)
+        return;
+
+    if (slot->connecting) {
+        if (!(events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+            return;
+        if (getsockopt(slot->ctx->client_sock, SOL_SOCKET, SO_ERROR,
+                    &error, &len) != 0 || error != 0) {
+            connect_done(slot->ctx, 0);
+            slot_eject(reactor, slot, -1, error ? error : errno);
+            return;
+        }
+        slot->connecting = 0;
+        connect_done(slot->ctx, 1);
+        slot_connection(slot, 1);
+    }
+
+    if (events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+        slot_read(reactor, slot);
+    if (slot->ctx->client_sock != INVALID_SOCKET && (events & EPOLLOUT))
+        slot_write(reactor, slot);
+}
+
+/* returns 0 if the slot has been removed */
+static int slot_update(struct vicc_reactor *reactor, struct reactor_slot *slot)
+{
+    int flags;
+
+    if (slot->detach) {
+        /* hand the sockets back to the context in blocking mode */
+        if (slot->ctx->client_sock != INVALID_SOCKET) {
+            if (slot->client_events)
+                epoll_ctl(reactor->epfd, EPOLL_CTL_DEL,
+                        slot->ctx->client_sock, NULL);
+            flags = fcntl(slot->ctx->client_sock, F_GETFL);
+            if (flags >= 0)
+                fcntl(slot->ctx->client_sock, F_SETFL, flags & ~O_NONBLOCK);
+            if (slot->connecting) {
+                close(slot->ctx->client_sock);
+                slot->ctx->client_sock = INVALID_SOCKET;
+            }
+        }
+        slot->client_events = 0;
+        update_server(reactor, slot);
+        fail_requests(reactor, slot, -1, ECONNABORTED);
+        return 0;
+    }
+
+    if (slot->ctx->client_sock == INVALID_SOCKET) {
+        fail_requests(reactor, slot, -1, ENOTCONN);
+        if (slot->ctx->hostname && connect_due(slot->ctx))
+            slot_connect(slot);
+    } else if (slot->connecting) {
+        fail_requests(reactor, slot, -1, ENOTCONN);
+        if (now_ms() >= slot->connect_deadline) {
+            connect_done(slot->ctx, 0);
+            slot_eject(reactor, slot, -1, ETIMEDOUT);
+        }
+    } else {
+        if (slot->ctx->handshake_pending && slot->hs_state == HANDSHAKE_NONE
+                && !slot->rx_head && !(slot->tx_head && slot->tx_head->sent))
+            handshake_start(slot);
+        if (slot->tx_head || slot->hs_out_sent < slot->hs_out_len)
+            /* try to send right away, most of the time this succeeds */
+            slot_write(reactor, slot);
+    }
+
+    update_client(reactor, slot);
+    update_server(reactor, slot);
+
+    return 1;
+}
+
+static void *reactor_run(void *arg)
+{
+    struct vicc_reactor *reactor = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct reactor_handle *handle;
+    struct reactor_slot **slot, *next, *s;
+    struct vicc_request *req;
+    uint64_t counter;
+    int i, n;
+
+    pthread_mutex_lock(&reactor->mutex);
+    while (!reactor->stop) {
+        pthread_mutex_unlock(&reactor->mutex);
+        n = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS,
+                REACTOR_RECONNECT_INTERVAL);
+        pthread_mutex_lock(&reactor->mutex);
+
+        for (i = 0; i < n; i++) {
+            handle = events[i].data.ptr;
+            if (!handle) {
+                if (read(reactor->wakefd, &counter, sizeof counter) < 0) {
+                    /* nothing to do, the counter has been reset already */
+                }
+            } else if (handle == &handle->slot->server_handle) {
+                slot_accept(reactor, handle->slot);
+            } else {
+                slot_io(reactor, handle->slot, events[i].events);
+            }
+        }
+
+        slot = &reactor->slots;
+        while (*slot) {
+            if (slot_update(reactor, *slot)) {
+                slot = &(*slot)->next;
+            } else {
+                next = (*slot)->next;
+                (*slot)->ctx->reactor = NULL;
+                (*slot)->ctx->reactor_data = NULL;
+                free(*slot);
+                *slot = next;
+            }
+        }
+
+        pthread_cond_broadcast(&reactor->changed);
+
+        while (reactor->completed_head) {
+            req = reactor->completed_head;
+            reactor->completed_head = req->next;
+            if (!reactor->completed_head)
+                reactor->completed_tail = NULL;
+            pthread_mutex_unlock(&reactor->mutex);
+            req->callback(req, req->user_data);
+            pthread_mutex_lock(&reactor->mutex);
+        }
+
+        /* slots are only removed by this thread, so they stay valid */
+        for (s = reactor->slots; s; s = s->next) {
+            if (!s->events_pending)
+                continue;
+            s->events_pending = 0;
+            pthread_mutex_unlock(&reactor->mutex);
+            event_dispatch(s->ctx);
+            pthread_mutex_lock(&reactor->mutex);
+        }
+    }
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return NULL;
+}
+
+struct vicc_reactor *vicc_reactor_new(void)
+{
+    struct epoll_event ev;
+    struct vicc_reactor *reactor = calloc(1, sizeof *reactor);
+
+    if (!reactor)
+        return NULL;
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (reactor->epfd < 0 || reactor->wakefd < 0)
+        goto err;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) != 0)
+        goto err;
+
+    pthread_mutex_init(&reactor->mutex, NULL);
+    pthread_cond_init(&reactor->changed, NULL);
+    if (pthread_create(&reactor->thread, NULL, reactor_run, reactor) != 0) {
+        pthread_cond_destroy(&reactor->changed);
+        pthread_mutex_destroy(&reactor->mutex);
+        goto err;
+    }
+
+    return reactor;
+
+err:
+    if (reactor->epfd >= 0)
+        close(reactor->epfd);
+    if (reactor->wakefd >= 0)
+        close(reactor->wakefd);
+    free(reactor);
+    return NULL;
+}
+
+void vicc_reactor_free(struct vicc_reactor *reactor)
+{
+    struct reactor_slot *slot;
+
+    if (!reactor)
+        return;
+
+    pthread_mutex_lock(&reactor->mutex);
+    for (slot = reactor->slots; slot; slot = slot->next)
+        slot->detach = 1;
+    while (reactor->slots) {
+        wake(reactor);
+        pthread_cond_wait(&reactor->changed, &reactor->mutex);
+    }
+    reactor->stop = 1;
+    wake(reactor);
+    pthread_mutex_unlock(&reactor->mutex);
+
+    pthread_join(reactor->thread, NULL);
+    pthread_cond_destroy(&reactor->changed);
+    pthread_mutex_destroy(&reactor->mutex);
+    close(reactor->epfd);
+    close(reactor->wakefd);
+    free(reactor);
+}
+
+int vicc_reactor_attach(struct vicc_reactor *reactor, struct vicc_ctx *ctx)
+{
+    struct reactor_slot *slot;
+
+    if (!reactor || !ctx || ctx->reactor) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctx->shm || ctx->inproc) {
+        /* there is nothing to poll */
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    slot = calloc(1, sizeof *slot);
+    if (!slot)
+        return -1;
+    slot->ctx = ctx;
+    slot->server_handle.slot = slot;
+    slot->client_handle.slot = slot;
+
+    pthread_mutex_lock(&reactor->mutex);
+    if (ctx->client_sock != INVALID_SOCKET
+            && set_nonblocking(ctx->client_sock) < 0) {
+        pthread_mutex_unlock(&reactor->mutex);
+        free(slot);
+        return -1;
+    }
+    slot->next = reactor->slots;
+    reactor->slots = slot;
+    ctx->reactor = reactor;
+    ctx->reactor_data = slot;
+    wake(reactor);
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return 0;
+}
+
+void reactor_detach(struct vicc_ctx *ctx)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+    struct reactor_slot *slot = ctx->reactor_data;
+
+    pthread_mutex_lock(&reactor->mutex);
+    slot->detach = 1;
+    while (ctx->reactor) {
+        wake(reactor);
+        pthread_cond_wait(&reactor->changed, &reactor->mutex);
+    }
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+int reactor_submit(struct vicc_ctx *ctx, struct vicc_request *req)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+    struct reactor_slot *slot = ctx->reactor_data;
+
+    req->reactor = reactor;
+    req->submitted_us = now_us();
+
+    pthread_mutex_lock(&reactor->mutex);
+    enqueue(&slot->tx_head, &slot->tx_tail, req);
+    wake(reactor);
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return 0;
+}
+
+void reactor_wait(struct vicc_request *req)
+{
+    struct vicc_reactor *reactor = req->reactor;
+
+    pthread_mutex_lock(&reactor->mutex);
+    while (!req->done)
+        pthread_cond_wait(&reactor->changed, &reactor->mutex);
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+int reactor_done(struct vicc_request *req)
+{
+    struct vicc_reactor *reactor = req->reactor;
+    int r;
+
+    pthread_mutex_lock(&reactor->mutex);
+    r = req->done;
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return r;
+}
+
+/* Waits for a request until the deadline (monotonic time in milliseconds).
+ * Afterwards, vicc is ejected, which fails the request with ETIMEDOUT. */
+static void reactor_wait_until(struct vicc_ctx *ctx, struct vicc_request *req,
+        long long deadline)
+{
+    struct vicc_reactor *reactor = req->reactor;
+    struct timespec ts;
+    long long left = deadline - now_ms();
+
+    if (left < 0)
+        left = 0;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += left / 1000;
+    ts.tv_nsec += (left % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&reactor->mutex);
+    while (!req->done) {
+        if (pthread_cond_timedwait(&reactor->changed, &reactor->mutex,
+                    &ts) == ETIMEDOUT) {
+            if (!req->done) {
+                slot_eject(reactor, ctx->reactor_data, -1, ETIMEDOUT);
+                wake(reactor);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+ssize_t reactor_transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu,
+        long long deadline)
+{
+    struct vicc_request req;
+
+    if (!(apdu_len && apdu) && !rapdu)
+        return 1;
+
+    memset(&req, 0, sizeof req);
+    req.apdu = apdu;
+    req.apdu_len = apdu ? apdu_len : 0;
+    req.rapdu = rapdu;
+    req.rapdu_size = rapdu_size;
+    req.realloc_rapdu = realloc_rapdu;
+
+    reactor_submit(ctx, &req);
+    if (deadline)
+        reactor_wait_until(ctx, &req, deadline);
+    else
+        reactor_wait(&req);
+
+    errno = req.error;
+    return req.result;
+}
+
+void reactor_set_features(struct vicc_ctx *ctx, unsigned int features)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+
+    pthread_mutex_lock(&reactor->mutex);
+    ctx->requested_features = features;
+    ctx->handshake_pending = 1;
+    ctx->legacy_peer = 0;
+    wake(reactor);
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+void reactor_set_capture(struct vicc_ctx *ctx, struct vicc_capture *capture,
+        unsigned short slot)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+
+    pthread_mutex_lock(&reactor->mutex);
+    ctx->capture = capture;
+    ctx->capture_slot = slot;
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+int reactor_set_sockopts(struct vicc_ctx *ctx,
+        const struct vicc_sockopts *opts)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+    int r;
+
+    pthread_mutex_lock(&reactor->mutex);
+    ctx->sockopts = *opts;
+    r = sockopts_apply(ctx, ctx->client_sock);
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return r;
+}
+
+int reactor_connect(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+    struct reactor_slot *slot = ctx->reactor_data;
+    struct timespec deadline;
+    int r;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs + usecs / 1000000;
+    deadline.tv_nsec += (usecs % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&reactor->mutex);
+    while (ctx->client_sock == INVALID_SOCKET || slot->connecting) {
+        if (pthread_cond_timedwait(&reactor->changed, &reactor->mutex,
+                    &deadline) == ETIMEDOUT)
+            break;
+    }
+    r = ctx->client_sock != INVALID_SOCKET && !slot->connecting;
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return r;
+}
+
+int reactor_eject(struct vicc_ctx *ctx)
+{
+    struct vicc_reactor *reactor = ctx->reactor;
+    int r;
+
+    pthread_mutex_lock(&reactor->mutex);
+    r = slot_eject(reactor, ctx->reactor_data, -1, ECONNABORTED);
+    wake(reactor);
+    pthread_mutex_unlock(&reactor->mutex);
+
+    return r;
+}
+
+#else
+
+struct vicc_reactor *vicc_reactor_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void vicc_reactor_free(struct vicc_reactor *reactor)
+{
+}
+
+int vicc_reactor_attach(struct vicc_reactor *reactor, struct vicc_ctx *ctx)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int reactor_submit(struct vicc_ctx *ctx, struct vicc_request *req)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void reactor_wait(struct vicc_request *req)
+{
+}
+
+int reactor_done(struct vicc_request *req)
+{
+    return 1;
+}
+
+ssize_t reactor_transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu,
+        long long deadline)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void reactor_set_features(struct vicc_ctx *ctx, unsigned int features)
+{
+}
+
+void reactor_set_capture(struct vicc_ctx *ctx, struct vicc_capture *capture,
+        unsigned short slot)
+{
+}
+
+int reactor_set_sockopts(struct vicc_ctx *ctx,
+        const struct vicc_sockopts *opts)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int reactor_connect(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    return 0;
+}
+
+int reactor_eject(struct vicc_ctx *ctx)
+{
+    return -1;
+}
+
+void reactor_detach(struct vicc_ctx *ctx)
+{
+}
+
+#endif
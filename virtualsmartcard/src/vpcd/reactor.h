@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "frame.h"
+#include "vpcd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vicc_request {
+    struct vicc_request *next;
+    /* NULL if the request has been completed synchronously */
+    struct vicc_reactor *reactor;
+    const unsigned char *apdu;
+    size_t apdu_len;
+    unsigned char header[FRAME_MAX_HEADER_LEN];
+    size_t header_len;
+    /* number of bytes of header and apdu written so far */
+    size_t sent;
+    int prepared;
+    unsigned short tag;
+    /* NULL if no response is expected */
+    unsigned char **rapdu;
+    size_t rapdu_size;
+    int realloc_rapdu;
+    /* caller's buffer of an asynchronous request */
+    unsigned char *buffer;
+    vicc_callback callback;
+    void *user_data;
+    int done;
+    ssize_t result;
+    int error;
+    /* monotonic time in microseconds for the statistics */
+    long long submitted_us;
+    long long sent_us;
+    long long header_us;
+};
+
+/* Used by libvpcd for contexts which are attached to a reactor */
+int reactor_submit(struct vicc_ctx *ctx, struct vicc_request *req);
+void reactor_wait(struct vicc_request *req);
+int reactor_done(struct vicc_request *req);
+void reactor_set_features(struct vicc_ctx *ctx, unsigned int features);
+void reactor_set_capture(struct vicc_ctx *ctx, struct vicc_capture *capture,
+        unsigned short slot);
+int reactor_set_sockopts(struct vicc_ctx *ctx,
+        const struct vicc_sockopts *opts);
+ssize_t reactor_transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu,
+        long long deadline);
+int reactor_connect(struct vicc_ctx *ctx, long secs, long usecs);
+int reactor_eject(struct vicc_ctx *ctx);
+void reactor_detach(struct vicc_ctx *ctx);
+
+/* Used by the reactor, implemented in vpcd.c. event_handle() updates the
+ * context according to an event's body and queues the event, connects and
+ * disconnects are handled as events of their own. event_dispatch() invokes
+ * the callback for the queued events. */
+void event_post(struct vicc_ctx *ctx, int event);
+void event_handle(struct vicc_ctx *ctx, const unsigned char *body, size_t len);
+void event_dispatch(struct vicc_ctx *ctx);
+/* Updates the state when vicc connects or disconnects and queues the
+ * corresponding event */
+void event_connection(struct vicc_ctx *ctx, int connected);
+/* Records that vicc has just sent something */
+void state_touch(struct vicc_ctx *ctx);
+
+/* Used by the reactor, implemented in vpcd.c. sockopts_apply() applies the
+ * context's socket options to a new connection, sockopts_rearm() restores
+ * options which the system resets after receiving data. */
+int sockopts_apply(struct vicc_ctx *ctx, SOCKET sock);
+void sockopts_rearm(struct vicc_ctx *ctx, SOCKET sock);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "lock.h"
+#include "shard.h"
+#include "stats.h"
+#include "vpcd.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct shard_host {
+    char *hostname;
+    unsigned short port;
+    /* connects which failed in a row and the monotonic time in milliseconds
+     * until which the host is skipped, 0 if it is not */
+    unsigned int failures;
+    long long down_until;
+};
+
+struct shard_point {
+    unsigned long long hash;
+    size_t host;
+};
+
+struct shard_slot {
+    struct vicc_ctx *ctx;
+    char *identity;
+    unsigned long long hash;
+    /* added to the port of the host */
+    unsigned short offset;
+    /* host the context has been pointed at, if routed */
+    int routed;
+    size_t host;
+    unsigned long long moves;
+};
+
+struct vicc_shard {
+    void *lock;
+    struct shard_host *hosts;
+    size_t hosts_len;
+    /* SHARD_REPLICAS points per host, sorted by their hash */
+    struct shard_point *points;
+    size_t points_len;
+    /* in the order the slots have been added */
+    struct shard_slot *slots;
+    size_t slots_len;
+    size_t slots_size;
+};
+
+/* FNV-1a followed by the finalizer of SplitMix64, which spreads names
+ * differing only in their last characters over the whole ring */
+static unsigned long long hash(const char *s, unsigned long long seed)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL ^ seed;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    const struct shard_point *p = a, *q = b;
+
+    if (p->hash != q->hash)
+        return p->hash < q->hash ? -1 : 1;
+    /* the same ring regardless of the order of qsort */
+    if (p->host != q->host)
+        return p->host < q->host ? -1 : 1;
+
+    return 0;
+}
+
+struct vicc_shard *vicc_shard_new(void)
+{
+    struct vicc_shard *shard;
+
+    shard = calloc(1, sizeof *shard);
+    if (!shard)
+        return NULL;
+
+    shard->lock = create_lock();
+    if (!shard->lock) {
+        free(shard);
+        return NULL;
+    }
+
+    return shard;
+}
+
+void vicc_shard_free(struct vicc_shard *shard)
+{
+    size_t i;
+
+    if (!shard)
+        return;
+
+    for (i = 0; i < shard->slots_len; i++) {
+        shard->slots[i].ctx->shard = NULL;
+        free(shard->slots[i].identity);
+    }
+    free(shard->slots);
+    for (i = 0; i < shard->hosts_len; i++)
+        free(shard->hosts[i].hostname);
+    free(shard->hosts);
+    free(shard->points);
+    free_lock(shard->lock);
+    free(shard);
+}
+
+int vicc_shard_add_host(struct vicc_shard *shard, const char *hostname,
+        unsigned short port)
+{
+    struct shard_host *hosts;
+    struct shard_point *points;
+    char key[VICC_SHARD_HOSTNAME_MAX + 8];
+    size_t i;
+    int r = -1;
+
+    if (!shard || !hostname || !*hostname
+            || strncmp(hostname, VPCD_UNIX_PREFIX,
+                strlen(VPCD_UNIX_PREFIX)) == 0
+            || strncmp(hostname, VPCD_SHM_PREFIX,
+                strlen(VPCD_SHM_PREFIX)) == 0
+            || strncmp(hostname, VPCD_INPROC_PREFIX,
+                strlen(VPCD_INPROC_PREFIX)) == 0) {
+        /* only a remote vicc can be one of many hosts */
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!lock(shard->lock))
+        return -1;
+
+    for (i = 0; i < shard->hosts_len; i++) {
+        if (shard->hosts[i].port == port
+                && strcmp(shard->hosts[i].hostname, hostname) == 0) {
+            errno = EEXIST;
+            goto err;
+        }
+    }
+
+    hosts = realloc(shard->hosts, (shard->hosts_len + 1) * sizeof *hosts);
+    if (!hosts)
+        goto err;
+    shard->hosts = hosts;
+    points = realloc(shard->points,
+            (shard->points_len + SHARD_REPLICAS) * sizeof *points);
+    if (!points)
+        goto err;
+    shard->points = points;
+
+    hosts[shard->hosts_len].hostname = strdup(hostname);
+    if (!hosts[shard->hosts_len].hostname)
+        goto err;
+    hosts[shard->hosts_len].port = port;
+    hosts[shard->hosts_len].failures = 0;
+    hosts[shard->hosts_len].down_until = 0;
+
+    /* the points only depend on the host's name, so that adding a host only
+     * takes over the slots which now hash to it */
+    snprintf(key, sizeof key, "%s:%hu", hostname, port);
+    for (i = 0; i < SHARD_REPLICAS; i++) {
+        points[shard->points_len + i].hash = hash(key, i);
+        points[shard->points_len + i].host = shard->hosts_len;
+    }
+    shard->hosts_len++;
+    shard->points_len += SHARD_REPLICAS;
+    qsort(shard->points, shard->points_len, sizeof *shard->points,
+            point_cmp);
+    r = 0;
+
+err:
+    unlock(shard->lock);
+
+    return r;
+}
+
+static struct shard_slot *find(struct vicc_shard *shard, struct vicc_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < shard->slots_len; i++)
+        if (shard->slots[i].ctx == ctx)
+            return &shard->slots[i];
+
+    return NULL;
+}
+
+/* Returns the first healthy host clockwise from the hash, or the first host
+ * if all of them are down */
+static size_t lookup(struct vicc_shard *shard, unsigned long long h,
+        long long now)
+{
+    size_t lo = 0, hi = shard->points_len, mid, i, host;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (shard->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = 0; i < shard->points_len; i++) {
+        host = shard->points[(lo + i) % shard->points_len].host;
+        if (shard->hosts[host].down_until <= now)
+            return host;
+    }
+
+    return shard->points[lo % shard->points_len].host;
+}
+
+/* Points the context at the host of the slot, must be called with the lock
+ * of the shard held */
+static int route(struct vicc_shard *shard, struct shard_slot *slot)
+{
+    struct shard_host *host;
+    char *hostname;
+    size_t h;
+
+    h = lookup(shard, slot->hash, now_us() / 1000);
+    if (slot->routed && h == slot->host)
+        return 0;
+
+    host = &shard->hosts[h];
+    hostname = strdup(host->hostname);
+    if (!hostname)
+        return -1;
+    free(slot->ctx->hostname);
+    slot->ctx->hostname = hostname;
+    slot->ctx->port = (unsigned short) (host->port + slot->offset);
+    if (slot->routed)
+        slot->moves++;
+    slot->routed = 1;
+    slot->host = h;
+
+    return 1;
+}
+
+int shard_register(struct vicc_shard *shard, struct vicc_ctx *ctx,
+        const char *identity, unsigned short offset)
+{
+    struct shard_slot *p;
+    size_t i;
+    int r = -1;
+
+    if (!lock(shard->lock))
+        return -1;
+
+    if (!shard->hosts_len) {
+        errno = EDESTADDRREQ;
+        goto err;
+    }
+
+    for (i = 0; i < shard->slots_len; i++) {
+        if (strcmp(shard->slots[i].identity, identity) == 0) {
+            errno = EADDRINUSE;
+            goto err;
+        }
+    }
+
+    if (shard->slots_len == shard->slots_size) {
+        p = realloc(shard->slots, (shard->slots_size + 8) * sizeof *p);
+        if (!p)
+            goto err;
+        shard->slots = p;
+        shard->slots_size += 8;
+    }
+
+    p = &shard->slots[shard->slots_len];
+    p->identity = strdup(identity);
+    if (!p->identity)
+        goto err;
+    p->ctx = ctx;
+    p->hash = hash(identity, 0);
+    p->offset = offset;
+    p->routed = 0;
+    p->host = 0;
+    p->moves = 0;
+    if (route(shard, p) < 0) {
+        free(p->identity);
+        goto err;
+    }
+    shard->slots_len++;
+    ctx->shard = shard;
+    r = 0;
+
+err:
+    unlock(shard->lock);
+
+    return r;
+}
+
+void shard_unregister(struct vicc_ctx *ctx)
+{
+    struct vicc_shard *shard = ctx->shard;
+    struct shard_slot *p;
+
+    if (!shard || !lock(shard->lock))
+        return;
+
+    p = find(shard, ctx);
+    if (p) {
+        free(p->identity);
+        /* keep the order of the map */
+        shard->slots_len--;
+        memmove(p, p + 1, (shard->slots + shard->slots_len - p) * sizeof *p);
+    }
+    ctx->shard = NULL;
+
+    unlock(shard->lock);
+}
+
+int shard_route(struct vicc_ctx *ctx)
+{
+    struct vicc_shard *shard = ctx->shard;
+    struct shard_slot *p;
+    int r = -1;
+
+    if (!shard || !lock(shard->lock))
+        return -1;
+
+    p = find(shard, ctx);
+    if (p)
+        r = route(shard, p);
+
+    unlock(shard->lock);
+
+    return r;
+}
+
+void shard_report(struct vicc_ctx *ctx, int connected)
+{
+    struct vicc_shard *shard = ctx->shard;
+    struct shard_slot *p;
+    struct shard_host *host;
+
+    if (!shard || !lock(shard->lock))
+        return;
+
+    p = find(shard, ctx);
+    if (p && p->routed) {
+        host = &shard->hosts[p->host];
+        if (connected) {
+            host->failures = 0;
+            host->down_until = 0;
+        } else if (++host->failures >= SHARD_FAILURES) {
+            /* the other slots on this host move on with their next connect,
+             * the host is tried again after a while */
+            host->down_until = now_us() / 1000 + SHARD_RETRY_MS;
+        }
+    }
+
+    unlock(shard->lock);
+}
+
+size_t vicc_shard_get_map(struct vicc_shard *shard,
+        struct vicc_shard_entry *map, size_t len)
+{
+    struct vicc_shard_entry *e;
+    struct shard_slot *p;
+    struct shard_host *host;
+    struct vicc_state state;
+    long long now;
+    size_t i, r;
+
+    if (!shard || !lock(shard->lock))
+        return 0;
+
+    now = now_us() / 1000;
+    for (i = 0; i < shard->slots_len && i < len; i++) {
+        p = &shard->slots[i];
+        e = &map[i];
+        memset(e, 0, sizeof *e);
+        snprintf(e->identity, sizeof e->identity, "%s", p->identity);
+        if (p->routed) {
+            host = &shard->hosts[p->host];
+            snprintf(e->hostname, sizeof e->hostname, "%s", host->hostname);
+            e->port = (unsigned short) (host->port + p->offset);
+            e->healthy = host->down_until <= now;
+            e->failures = host->failures;
+        }
+        e->moves = p->moves;
+        vicc_get_state(p->ctx, &state);
+        e->connected = state.connected;
+    }
+    r = shard->slots_len;
+
+    unlock(shard->lock);
+
+    return r;
+}
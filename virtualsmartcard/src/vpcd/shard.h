@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include "vpcd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Points of each host on the ring, which spread the slots evenly */
+#define SHARD_REPLICAS 160
+
+/* Failed connects in a row after which a host is considered down and the
+ * milliseconds until it is tried again */
+#define SHARD_FAILURES 3
+#define SHARD_RETRY_MS 5000
+
+/* Adds the context as slot to the shard and routes it to its host */
+int shard_register(struct vicc_shard *shard, struct vicc_ctx *ctx,
+        const char *identity, unsigned short offset);
+void shard_unregister(struct vicc_ctx *ctx);
+
+/* Points the context at the first healthy host on the ring after its
+ * identity. Returns 1 if the host has changed, 0 if not and -1 on errors. */
+int shard_route(struct vicc_ctx *ctx);
+/* Accounts a connect of the context to the health of its host */
+void shard_report(struct vicc_ctx *ctx, int connected);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "shm.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_LINUX_FUTEX_H)
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/* must be a power of 2 */
+#define SHM_RING_SIZE (1 << 20)
+/* number of polls before going to sleep if the peer may run in parallel */
+#define SHM_SPIN 4000
+/* interval for checking whether the peer is still alive */
+#define SHM_WAIT_MS 100
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
+    uint32_t generation;
+    uint32_t vpcd_pid;
+    uint32_t vicc_pid;
+    uint32_t ring_size;
+    unsigned char reserved[36];
+};
+
+struct shm_ring {
+    uint32_t head;
+    uint32_t head_waiting;
+    unsigned char pad0[56];
+    uint32_t tail;
+    uint32_t tail_waiting;
+    unsigned char pad1[56];
+};
+
+#define SHM_LEN (sizeof(struct shm_header) \
+        + 2*(sizeof(struct shm_ring) + SHM_RING_SIZE))
+
+struct vicc_shm {
+    char *name;
+    unsigned char *base;
+    struct shm_header *hdr;
+    /* from vpcd to vicc */
+    struct shm_ring *tx;
+    unsigned char *tx_data;
+    /* from vicc to vpcd */
+    struct shm_ring *rx;
+    unsigned char *rx_data;
+    uint32_t generation;
+    int connected;
+    int spin;
+};
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static void futex_wait(uint32_t *word, uint32_t value, long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    /* not FUTEX_PRIVATE_FLAG, the word is shared with an other process */
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int attached(struct vicc_shm *shm)
+{
+    return shm->connected && LOAD(&shm->hdr->state) == SHM_CONNECTED
+        && LOAD(&shm->hdr->generation) == shm->generation;
+}
+
+/* Additionally checks for a crashed vicc, which costs a system call */
+static int alive(struct vicc_shm *shm)
+{
+    pid_t pid;
+
+    if (!attached(shm))
+        return 0;
+
+    pid = (pid_t) LOAD(&shm->hdr->vicc_pid);
+    if (pid && kill(pid, 0) != 0 && errno == ESRCH)
+        return 0;
+
+    return 1;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Waits until *word differs from value. Returns 0 if the peer is gone and -1
+ * if the deadline has passed. */
+static int wait_for(struct vicc_shm *shm, uint32_t *word, uint32_t value,
+        uint32_t *waiting, long long deadline)
+{
+    long long left;
+    long ms;
+    int i;
+
+    for (i = 0; i < shm->spin; i++) {
+        if (LOAD(word) != value)
+            return 1;
+        cpu_relax();
+    }
+
+    while (LOAD(word) == value) {
+        STORE(waiting, 1);
+        if (LOAD(word) != value)
+            break;
+        ms = SHM_WAIT_MS;
+        if (deadline) {
+            left = deadline - now_ms();
+            if (left <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (left < ms)
+                ms = (long) left;
+        }
+        futex_wait(word, value, ms);
+        if (!alive(shm))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void wake(uint32_t *word, uint32_t *waiting)
+{
+    if (EXCHANGE(waiting, 0))
+        futex_wake(word);
+}
+
+static void wake_all(struct vicc_shm *shm)
+{
+    futex_wake(&shm->hdr->state);
+    futex_wake(&shm->tx->head);
+    futex_wake(&shm->tx->tail);
+    futex_wake(&shm->rx->head);
+    futex_wake(&shm->rx->tail);
+}
+
+struct vicc_shm *shm_create(const char *name)
+{
+    struct vicc_shm *shm = calloc(1, sizeof *shm);
+    int fd = -1;
+
+    if (!shm)
+        return NULL;
+
+    /* POSIX wants the name to start with a slash */
+    shm->name = malloc(strlen(name) + 2);
+    if (!shm->name)
+        goto err;
+    sprintf(shm->name, "%s%s", name[0] == '/' ? "" : "/", name);
+
+    fd = shm_open(shm->name, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd < 0)
+        goto err;
+    if (ftruncate(fd, SHM_LEN) != 0)
+        goto err;
+    shm->base = mmap(NULL, SHM_LEN, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm->base == MAP_FAILED) {
+        shm->base = NULL;
+        goto err;
+    }
+    close(fd);
+
+    shm->hdr = (struct shm_header *) shm->base;
+    shm->tx = (struct shm_ring *) (shm->base + sizeof *shm->hdr);
+    shm->tx_data = (unsigned char *) (shm->tx + 1);
+    shm->rx = (struct shm_ring *) (shm->tx_data + SHM_RING_SIZE);
+    shm->rx_data = (unsigned char *) (shm->rx + 1);
+
+    /* with a single CPU, spinning only delays the peer */
+    shm->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+
+    shm->hdr->version = SHM_VERSION;
+    shm->hdr->state = SHM_LISTENING;
+    shm->hdr->vpcd_pid = (uint32_t) getpid();
+    shm->hdr->ring_size = SHM_RING_SIZE;
+    /* vicc checks the magic before attaching */
+    STORE(&shm->hdr->magic, SHM_MAGIC);
+
+    return shm;
+
+err:
+    if (fd >= 0) {
+        close(fd);
+        shm_unlink(shm->name);
+    }
+    free(shm->name);
+    free(shm);
+    return NULL;
+}
+
+void shm_free(struct vicc_shm *shm)
+{
+    if (!shm)
+        return;
+
+    shm_eject(shm);
+    STORE(&shm->hdr->magic, 0);
+    munmap(shm->base, SHM_LEN);
+    shm_unlink(shm->name);
+    free(shm->name);
+    free(shm);
+}
+
+int shm_accept(struct vicc_shm *shm, long secs, long usecs, int *attached)
+{
+    struct timespec now, deadline;
+    long ms;
+
+    *attached = 0;
+    if (shm->connected) {
+        if (alive(shm))
+            return 1;
+        shm_eject(shm);
+        *attached = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += secs + usecs / 1000000;
+    deadline.tv_nsec += (usecs % 1000000) * 1000;
+
+    while (LOAD(&shm->hdr->state) != SHM_CONNECTED) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (deadline.tv_sec - now.tv_sec) * 1000
+            + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0)
+            return 0;
+        futex_wait(&shm->hdr->state, SHM_LISTENING, ms);
+    }
+
+    shm->generation = LOAD(&shm->hdr->generation);
+    shm->connected = 1;
+    if (!alive(shm)) {
+        /* a vicc which crashed */
+        shm_eject(shm);
+        return 0;
+    }
+    *attached = 1;
+
+    return 1;
+}
+
+int shm_eject(struct vicc_shm *shm)
+{
+    if (!shm->connected)
+        return 0;
+
+    shm->connected = 0;
+    STORE(&shm->hdr->state, SHM_LISTENING);
+    wake_all(shm);
+
+    return 1;
+}
+
+ssize_t shm_send(struct vicc_shm *shm, const void *buffer, size_t size,
+        long long deadline)
+{
+    const unsigned char *p = buffer;
+    uint32_t head, tail, n, offset;
+    size_t sent = 0;
+    int r;
+
+    while (sent < size) {
+        if (!attached(shm)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        head = shm->tx->head;
+        tail = LOAD(&shm->tx->tail);
+        if (head - tail == SHM_RING_SIZE) {
+            /* the ring is full */
+            r = wait_for(shm, &shm->tx->tail, tail, &shm->tx->tail_waiting,
+                    deadline);
+            if (r < 0)
+                return -1;
+            if (r == 0) {
+                errno = EPIPE;
+                return -1;
+            }
+            continue;
+        }
+
+        offset = head & (SHM_RING_SIZE - 1);
+        n = SHM_RING_SIZE - (head - tail);
+        if (n > SHM_RING_SIZE - offset)
+            n = SHM_RING_SIZE - offset;
+        if (n > size - sent)
+            n = size - sent;
+        memcpy(shm->tx_data + offset, p + sent, n);
+        STORE(&shm->tx->head, head + n);
+        wake(&shm->tx->head, &shm->tx->head_waiting);
+        sent += n;
+    }
+
+    return (ssize_t) sent;
+}
+
+ssize_t shm_recv(struct vicc_shm *shm, void *buffer, size_t size,
+        long long deadline)
+{
+    unsigned char *p = buffer;
+    uint32_t head, tail, n, offset;
+    size_t received = 0;
+    int r;
+
+    while (received < size) {
+        tail = shm->rx->tail;
+        head = LOAD(&shm->rx->head);
+        if (head == tail) {
+            /* the ring is empty */
+            if (!attached(shm))
+                break;
+            r = wait_for(shm, &shm->rx->head, head, &shm->rx->head_waiting,
+                    deadline);
+            if (r < 0)
+                return -1;
+            if (r == 0)
+                break;
+            continue;
+        }
+
+        offset = tail & (SHM_RING_SIZE - 1);
+        n = head - tail;
+        if (n > SHM_RING_SIZE - offset)
+            n = SHM_RING_SIZE - offset;
+        if (n > size - received)
+            n = size - received;
+        memcpy(p + received, shm->rx_data + offset, n);
+        STORE(&shm->rx->tail, tail + n);
+        wake(&shm->rx->tail, &shm->rx->tail_waiting);
+        received += n;
+    }
+
+    /* a closed connection, the partial message is of no use */
+    if (received < size)
+        return 0;
+
+    return (ssize_t) received;
+}
+
+size_t shm_pending(struct vicc_shm *shm)
+{
+    if (!attached(shm))
+        return 0;
+
+    return LOAD(&shm->rx->head) - shm->rx->tail;
+}
+
+#else
+
+struct vicc_shm *shm_create(const char *name)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void shm_free(struct vicc_shm *shm)
+{
+}
+
+int shm_accept(struct vicc_shm *shm, long secs, long usecs, int *attached)
+{
+    *attached = 0;
+    return 0;
+}
+
+int shm_eject(struct vicc_shm *shm)
+{
+    return -1;
+}
+
+ssize_t shm_send(struct vicc_shm *shm, const void *buffer, size_t size,
+        long long deadline)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t shm_recv(struct vicc_shm *shm, void *buffer, size_t size,
+        long long deadline)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+size_t shm_pending(struct vicc_shm *shm)
+{
+    return 0;
+}
+
+#endif
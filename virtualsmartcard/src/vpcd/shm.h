@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef HAVE_CONFIG_H
+typedef int ssize_t;
+#endif
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Transport via a POSIX shared memory object, which is created by vpcd and
+ * attached by vicc. It holds a pair of single-producer/single-consumer rings,
+ * which carry the same byte stream as the socket would:
+ *
+ *   offset   0: magic "VPCS", version, state, generation, vpcd's pid,
+ *                vicc's pid and size of a ring (32 bit each, host order)
+ *   offset  64: ring from vpcd to vicc
+ *   then:        ring from vicc to vpcd
+ *
+ * Each ring starts with its control block of 128 bytes: the producer's
+ * counter of bytes written (offset 0) followed by a flag of a consumer waiting
+ * for it and, in a cache line of its own, the consumer's counter of bytes read
+ * (offset 64) followed by a flag of a producer waiting for it. The data follows
+ * the control block. A waiting side sleeps on the counter with a futex. vicc
+ * attaches by changing the state from 0 (listening) to 1 (connected) after
+ * resetting both rings and incrementing the generation. */
+
+#define SHM_MAGIC     0x53435056
+#define SHM_VERSION   1
+#define SHM_LISTENING 0
+#define SHM_CONNECTED 1
+
+struct vicc_shm;
+
+/* Returns NULL and sets errno on errors */
+struct vicc_shm *shm_create(const char *name);
+void shm_free(struct vicc_shm *shm);
+
+/* Returns 1 if a vicc is attached, waiting for it up to the given time.
+ * attached is set to 1 if the vicc has attached during this call and to -1 if
+ * the previously attached vicc has vanished. */
+int shm_accept(struct vicc_shm *shm, long secs, long usecs, int *attached);
+/* Returns 1 if a vicc has been detached, 0 if none was attached */
+int shm_eject(struct vicc_shm *shm);
+
+/* Same semantics as send() and recv() with MSG_WAITALL. Waiting for the peer
+ * fails with ETIMEDOUT after the deadline (monotonic time in milliseconds) if
+ * it is not 0. */
+ssize_t shm_send(struct vicc_shm *shm, const void *buffer, size_t size,
+        long long deadline);
+ssize_t shm_recv(struct vicc_shm *shm, void *buffer, size_t size,
+        long long deadline);
+
+/* Returns the number of bytes which can be received without waiting */
+size_t shm_pending(struct vicc_shm *shm);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
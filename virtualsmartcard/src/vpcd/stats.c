@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stats.h"
+#include "lock.h"
+#include "vpcd.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* each power of two is divided into 2^HISTOGRAM_SUB_BITS buckets */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+long long now_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (long long) (counter.QuadPart / frequency.QuadPart * 1000000
+            + counter.QuadPart % frequency.QuadPart * 1000000
+            / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static unsigned int bucket_of(unsigned long long value)
+{
+    unsigned int magnitude = HISTOGRAM_SUB_BITS, index;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (unsigned int) value;
+
+    while (magnitude < 63 && value >> (magnitude + 1))
+        magnitude++;
+
+    index = (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + (unsigned int) ((value >> (magnitude - HISTOGRAM_SUB_BITS))
+                & (HISTOGRAM_SUB_BUCKETS - 1));
+    if (index >= VICC_HISTOGRAM_BUCKETS)
+        index = VICC_HISTOGRAM_BUCKETS - 1;
+
+    return index;
+}
+
+static unsigned long long bucket_upper(unsigned int index)
+{
+    unsigned int magnitude, sub;
+
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    magnitude = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    sub = index % HISTOGRAM_SUB_BUCKETS;
+
+    return ((unsigned long long) (HISTOGRAM_SUB_BUCKETS + sub + 1)
+            << (magnitude - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static void record(struct vicc_histogram *h, long long value)
+{
+    unsigned long long v = value > 0 ? (unsigned long long) value : 0;
+
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+    h->buckets[bucket_of(v)]++;
+}
+
+unsigned long long vicc_histogram_percentile(const struct vicc_histogram *h,
+        double percentile)
+{
+    unsigned long long target, seen = 0, upper;
+    unsigned int i;
+
+    if (!h || !h->count)
+        return 0;
+
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
+    target = (unsigned long long) (h->count * percentile / 100 + .5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < VICC_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            break;
+    }
+
+    upper = bucket_upper(i);
+    if (upper > h->max)
+        upper = h->max;
+    if (upper < h->min)
+        upper = h->min;
+
+    return upper;
+}
+
+void stats_command(struct vicc_ctx *ctx, size_t sent, size_t received,
+        long long start, long long sent_at, long long header_at,
+        long long done)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.commands++;
+    ctx->stats.bytes_sent += sent;
+    ctx->stats.bytes_received += received;
+    /* the header may have arrived before we noticed that sending is done */
+    if (header_at < sent_at)
+        header_at = sent_at;
+    record(&ctx->stats.send, sent_at - start);
+    record(&ctx->stats.think, header_at - sent_at);
+    record(&ctx->stats.receive, done - header_at);
+    record(&ctx->stats.total, done - start);
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_failure(struct vicc_ctx *ctx, int error)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.failures++;
+    if (error == ETIMEDOUT)
+        ctx->stats.timeouts++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_eject(struct vicc_ctx *ctx, int error)
+{
+    /* ejected on request */
+    if (!error || error == ECONNABORTED)
+        return;
+
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.ejects++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_connect(struct vicc_ctx *ctx)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.connects++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_failover(struct vicc_ctx *ctx)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.failovers++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_resume(struct vicc_ctx *ctx)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.resumes++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_deflate(struct vicc_ctx *ctx, size_t len, size_t deflated_len,
+        long long us)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    if (deflated_len) {
+        ctx->stats.deflated++;
+        ctx->stats.deflate_bytes_in += len;
+        ctx->stats.deflate_bytes_out += deflated_len;
+    } else {
+        ctx->stats.deflate_skipped++;
+    }
+    ctx->stats.deflate_us += us > 0 ? us : 0;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_inflate(struct vicc_ctx *ctx, size_t deflated_len, size_t len,
+        long long us)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->stats.inflated++;
+    ctx->stats.inflate_bytes_in += deflated_len;
+    ctx->stats.inflate_bytes_out += len;
+    ctx->stats.inflate_us += us > 0 ? us : 0;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_heartbeat(struct vicc_ctx *ctx, int missed)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    if (missed)
+        ctx->stats.heartbeats_missed++;
+    else
+        ctx->stats.heartbeats++;
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_rtt(struct vicc_ctx *ctx, long long rtt)
+{
+    long long delta;
+
+    if (rtt < 1)
+        rtt = 1;
+
+    if (!lock(ctx->stats_lock))
+        return;
+
+    /* smoothed like TCP's estimate (RFC 6298) */
+    if (!ctx->srtt) {
+        ctx->srtt = rtt;
+        ctx->rttvar = rtt / 2;
+    } else {
+        delta = ctx->srtt - rtt;
+        if (delta < 0)
+            delta = -delta;
+        ctx->rttvar = (3 * ctx->rttvar + delta) / 4;
+        ctx->srtt = (7 * ctx->srtt + rtt) / 8;
+    }
+
+    unlock(ctx->stats_lock);
+}
+
+void stats_rtt_reset(struct vicc_ctx *ctx)
+{
+    if (!lock(ctx->stats_lock))
+        return;
+
+    ctx->srtt = 0;
+    ctx->rttvar = 0;
+
+    unlock(ctx->stats_lock);
+}
+
+int vicc_get_stats(struct vicc_ctx *ctx, struct vicc_stats *stats, int reset)
+{
+    long long now;
+
+    if (!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lock(ctx->stats_lock);
+    memcpy(stats, &ctx->stats, sizeof *stats);
+    if (reset)
+        memset(&ctx->stats, 0, sizeof ctx->stats);
+    /* the backoff is part of the connection's state, not a counter */
+    stats->backoff_failures = ctx->connect_failures;
+    stats->srtt_us = ctx->srtt;
+    stats->rttvar_us = ctx->rttvar;
+    stats->backoff_ms = 0;
+    now = now_us() / 1000;
+    if (ctx->connect_next > now)
+        stats->backoff_ms = (long) (ctx->connect_next - now);
+    unlock(ctx->stats_lock);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vicc_ctx;
+
+/* Monotonic time in microseconds */
+long long now_us(void);
+
+/* Records a command which vicc has answered. The points in time are when the
+ * command was started, when it has been sent, when the response's header
+ * has been received and when the response has been received completely. */
+void stats_command(struct vicc_ctx *ctx, size_t sent, size_t received,
+        long long start, long long sent_at, long long header_at,
+        long long done);
+/* Records a command which failed with the given error */
+void stats_failure(struct vicc_ctx *ctx, int error);
+/* Records a disconnect of vicc because of the given error */
+void stats_eject(struct vicc_ctx *ctx, int error);
+void stats_connect(struct vicc_ctx *ctx);
+/* Records the promotion of a standby connection */
+void stats_failover(struct vicc_ctx *ctx);
+/* Records a session resumed after the connection was lost */
+void stats_resume(struct vicc_ctx *ctx);
+/* Records the compression of a command from len to deflated_len bytes, 0 if
+ * it has been sent uncompressed, which took the given microseconds */
+void stats_deflate(struct vicc_ctx *ctx, size_t len, size_t deflated_len,
+        long long us);
+/* Records the decompression of a response */
+void stats_inflate(struct vicc_ctx *ctx, size_t deflated_len, size_t len,
+        long long us);
+/* Records a heartbeat which has been sent or an interval in which it has not
+ * been answered */
+void stats_heartbeat(struct vicc_ctx *ctx, int missed);
+/* Updates the round trip time with the one of an answered heartbeat */
+void stats_rtt(struct vicc_ctx *ctx, long long rtt);
+/* Forgets the round trip time of the previous connection */
+void stats_rtt_reset(struct vicc_ctx *ctx);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) \
+    && HAVE_DECL___NR_IO_URING_SETUP && HAVE_DECL_IORING_OP_LINK_TIMEOUT \
+    && HAVE_DECL_IORING_REGISTER_PROBE
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* a round trip needs at most three entries: send, receive and timeout */
+#define URING_ENTRIES 4
+/* big enough for the response to an extended length APDU of 4 KiB */
+#define URING_RX_SIZE (16 * 1024)
+
+#define URING_SEND    1
+#define URING_RECV    2
+#define URING_TIMEOUT 3
+
+struct vicc_uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* the receive buffer is registered with the kernel if possible, which
+     * saves mapping it for every read */
+    int fixed;
+    unsigned char *rx;
+    size_t rx_head, rx_tail;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns 1 if the kernel supports all operations of a round trip */
+static int probe(int fd)
+{
+    struct io_uring_probe *p;
+    size_t len = sizeof *p + 256 * sizeof p->ops[0];
+    int r = 0;
+
+    p = calloc(1, len);
+    if (!p)
+        return 0;
+
+    if (sys_register(fd, IORING_REGISTER_PROBE, p, 256) == 0
+            && p->last_op >= IORING_OP_LINK_TIMEOUT
+            && (p->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED)
+            && (p->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED)
+            && (p->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED))
+        r = 1;
+
+    free(p);
+
+    return r;
+}
+
+struct vicc_uring *uring_new(void)
+{
+    struct vicc_uring *uring = NULL;
+    struct io_uring_params p;
+    struct iovec iov;
+
+    uring = calloc(1, sizeof *uring);
+    if (!uring)
+        goto err;
+    uring->fd = -1;
+    uring->sq_ring = MAP_FAILED;
+    uring->cq_ring = MAP_FAILED;
+    uring->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof p);
+#ifdef IORING_SETUP_COOP_TASKRUN
+    /* completions are processed when we wait for them anyway, which saves
+     * interrupting us beforehand (Linux 5.19) */
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+#endif
+    uring->fd = sys_setup(URING_ENTRIES, &p);
+    if (uring->fd < 0 && errno == EINVAL && p.flags) {
+        memset(&p, 0, sizeof p);
+        uring->fd = sys_setup(URING_ENTRIES, &p);
+    }
+    if (uring->fd < 0)
+        goto err;
+    if (!(p.features & IORING_FEAT_NODROP) || !probe(uring->fd)) {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    uring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring->cq_ring_len = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED
+            || uring->sqes == MAP_FAILED)
+        goto err;
+
+    uring->sq_head = (unsigned *) ((char *) uring->sq_ring + p.sq_off.head);
+    uring->sq_tail = (unsigned *) ((char *) uring->sq_ring + p.sq_off.tail);
+    uring->sq_mask = (unsigned *) ((char *) uring->sq_ring
+            + p.sq_off.ring_mask);
+    uring->sq_array = (unsigned *) ((char *) uring->sq_ring + p.sq_off.array);
+    uring->cq_head = (unsigned *) ((char *) uring->cq_ring + p.cq_off.head);
+    uring->cq_tail = (unsigned *) ((char *) uring->cq_ring + p.cq_off.tail);
+    uring->cq_mask = (unsigned *) ((char *) uring->cq_ring
+            + p.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) ((char *) uring->cq_ring
+            + p.cq_off.cqes);
+
+    uring->rx = malloc(URING_RX_SIZE);
+    if (!uring->rx)
+        goto err;
+    iov.iov_base = uring->rx;
+    iov.iov_len = URING_RX_SIZE;
+    /* may fail because of the limit of locked memory, then the buffer is
+     * passed with every read */
+    uring->fixed = sys_register(uring->fd, IORING_REGISTER_BUFFERS,
+            &iov, 1) == 0;
+
+    return uring;
+
+err:
+    uring_free(uring);
+
+    return NULL;
+}
+
+void uring_free(struct vicc_uring *uring)
+{
+    int error = errno;
+
+    if (!uring)
+        return;
+
+    if (uring->sqes != MAP_FAILED)
+        munmap(uring->sqes, uring->sqes_len);
+    if (uring->cq_ring != MAP_FAILED)
+        munmap(uring->cq_ring, uring->cq_ring_len);
+    if (uring->sq_ring != MAP_FAILED)
+        munmap(uring->sq_ring, uring->sq_ring_len);
+    if (uring->fd >= 0)
+        close(uring->fd);
+    free(uring->rx);
+    free(uring);
+
+    errno = error;
+}
+
+static struct io_uring_sqe *queue(struct vicc_uring *uring, unsigned *tail,
+        unsigned char opcode, int fd, unsigned long long user_data)
+{
+    unsigned index = *tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    uring->sq_array[index] = index;
+    (*tail)++;
+
+    return sqe;
+}
+
+ssize_t uring_roundtrip(struct vicc_uring *uring, int sock,
+        const void *header, size_t header_len,
+        const void *body, size_t body_len, long long deadline)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct __kernel_timespec ts;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, submit, pending;
+    long long left;
+    ssize_t sent = -1, total = header_len + body_len;
+    size_t sent_len;
+    int r, error = 0;
+
+    memset(&msg, 0, sizeof msg);
+    iov[0].iov_base = (void *) header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len = body_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = body_len ? 2 : 1;
+
+    if (uring->rx_head == uring->rx_tail)
+        uring->rx_head = uring->rx_tail = 0;
+
+    /* send the command and, as soon as it is out, receive the response */
+    tail = *uring->sq_tail;
+    sqe = queue(uring, &tail, IORING_OP_SENDMSG, sock, URING_SEND);
+    sqe->addr = (uintptr_t) &msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+    if (uring->rx_tail < URING_RX_SIZE) {
+        sqe->flags = IOSQE_IO_LINK;
+        if (uring->fixed) {
+            sqe = queue(uring, &tail, IORING_OP_READ_FIXED, sock, URING_RECV);
+            sqe->buf_index = 0;
+        } else {
+            sqe = queue(uring, &tail, IORING_OP_RECV, sock, URING_RECV);
+        }
+        sqe->addr = (uintptr_t) (uring->rx + uring->rx_tail);
+        sqe->len = (unsigned) (URING_RX_SIZE - uring->rx_tail);
+        if (deadline) {
+            left = deadline - now_ms();
+            if (left < 1)
+                left = 1;
+            ts.tv_sec = left / 1000;
+            ts.tv_nsec = (left % 1000) * 1000000;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = queue(uring, &tail, IORING_OP_LINK_TIMEOUT, -1,
+                    URING_TIMEOUT);
+            sqe->addr = (uintptr_t) &ts;
+            sqe->len = 1;
+        }
+    }
+    submit = pending = tail - *uring->sq_tail;
+    __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* all operations refer to our stack, so we wait for every one of them */
+    while (pending) {
+        r = sys_enter(uring->fd, submit, pending, IORING_ENTER_GETEVENTS);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            if (submit == pending) {
+                /* nothing has been submitted, withdraw it */
+                __atomic_store_n(uring->sq_tail, *uring->sq_head,
+                        __ATOMIC_RELEASE);
+                return -1;
+            }
+            error = errno;
+            break;
+        }
+        submit -= (unsigned) r < submit ? (unsigned) r : submit;
+
+        head = *uring->cq_head;
+        while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &uring->cqes[head & *uring->cq_mask];
+            switch (cqe->user_data) {
+                case URING_SEND:
+                    if (cqe->res < 0)
+                        error = -cqe->res;
+                    else
+                        sent = cqe->res;
+                    break;
+                case URING_RECV:
+                    /* errors are reported by the next read from the socket,
+                     * a canceled read by the timeout of the next read */
+                    if (cqe->res > 0)
+                        uring->rx_tail += cqe->res;
+                    break;
+                default:
+                    break;
+            }
+            head++;
+            pending--;
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (sent < 0) {
+        errno = error ? error : EIO;
+        return -1;
+    }
+
+    /* the rest of a short send, the response cannot have arrived before */
+    sent_len = (size_t) sent;
+    while (sent_len < (size_t) total) {
+        if (sent_len < header_len) {
+            iov[0].iov_base = (unsigned char *) header + sent_len;
+            iov[0].iov_len = header_len - sent_len;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = body_len ? 2 : 1;
+        } else {
+            iov[1].iov_base = (unsigned char *) body + sent_len - header_len;
+            iov[1].iov_len = total - sent_len;
+            msg.msg_iov = &iov[1];
+            msg.msg_iovlen = 1;
+        }
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent_len += sent;
+    }
+
+    return total;
+}
+
+size_t uring_take(struct vicc_uring *uring, void *buffer, size_t size)
+{
+    size_t n = uring_pending(uring);
+
+    if (n > size)
+        n = size;
+    if (n) {
+        memcpy(buffer, uring->rx + uring->rx_head, n);
+        uring->rx_head += n;
+    }
+
+    return n;
+}
+
+size_t uring_pending(const struct vicc_uring *uring)
+{
+    return uring ? uring->rx_tail - uring->rx_head : 0;
+}
+
+void uring_reset(struct vicc_uring *uring)
+{
+    if (uring)
+        uring->rx_head = uring->rx_tail = 0;
+}
+
+#else
+
+struct vicc_uring *uring_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_free(struct vicc_uring *uring)
+{
+}
+
+ssize_t uring_roundtrip(struct vicc_uring *uring, int sock,
+        const void *header, size_t header_len,
+        const void *body, size_t body_len, long long deadline)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+size_t uring_take(struct vicc_uring *uring, void *buffer, size_t size)
+{
+    return 0;
+}
+
+size_t uring_pending(const struct vicc_uring *uring)
+{
+    return 0;
+}
+
+void uring_reset(struct vicc_uring *uring)
+{
+}
+
+#endif
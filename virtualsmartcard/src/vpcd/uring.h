@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef HAVE_CONFIG_H
+typedef int ssize_t;
+#endif
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Round trips via io_uring (Linux). A command is sent and the beginning of
+ * the response is received into a registered buffer with the same call of
+ * io_uring_enter(), which replaces the separate system calls for sending the
+ * command and for receiving the response's header and body. Whatever has been
+ * received in advance is taken from the buffer before reading from the socket
+ * again. */
+
+struct vicc_uring;
+
+/* Returns NULL and sets errno if the system does not support what is needed,
+ * the caller then uses the classic system calls */
+struct vicc_uring *uring_new(void);
+void uring_free(struct vicc_uring *uring);
+
+/* Sends the header and the body completely and receives what the peer has
+ * answered so far, waiting for the first bytes of the answer until the
+ * deadline (monotonic time in milliseconds) if it is not 0. Returns the number
+ * of bytes sent or -1. A failure to receive is left to the next read from the
+ * socket. */
+ssize_t uring_roundtrip(struct vicc_uring *uring, int sock,
+        const void *header, size_t header_len,
+        const void *body, size_t body_len, long long deadline);
+
+/* Moves up to size bytes which have been received in advance to the buffer
+ * and returns their number */
+size_t uring_take(struct vicc_uring *uring, void *buffer, size_t size);
+/* Returns the number of bytes which have been received in advance */
+size_t uring_pending(const struct vicc_uring *uring);
+/* Drops what has been received in advance, e.g. after a disconnect */
+void uring_reset(struct vicc_uring *uring);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2026 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Interface of a card which is loaded into the process of vpcd
+ *
+ * A shared library given as \c "inproc:/path/card.so" to \a vicc_init exports
+ * a \c struct \c vicc_card named \c vicc_card. libvpcd calls the card directly
+ * instead of exchanging frames with vicc, which avoids the sockets and copies
+ * between vpcd and vicc. See handler-test.c for an example.
+ *
+ * Every slot opens a card of its own. The calls for one card are serialized
+ * by libvpcd, calls for different cards may happen concurrently.
+ */
+#ifndef _VICC_CARD_H_
+#define _VICC_CARD_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef HAVE_CONFIG_H
+typedef int ssize_t;
+#endif
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Version of \c struct \c vicc_card implemented by the card */
+#define VICC_CARD_VERSION 1
+/** Name of the \c struct \c vicc_card exported by the card's library */
+#define VICC_CARD_SYMBOL "vicc_card"
+
+struct vicc_card {
+        /** Must be \c VICC_CARD_VERSION */
+        unsigned int version;
+        /**
+         * @brief Inserts a new card
+         *
+         * @return The card's state passed to the other calls, NULL on error
+         */
+        void *(*open)(void);
+        /** Removes the card and frees its state */
+        void (*close)(void *card);
+        /**
+         * @brief Writes the ATR of the card
+         *
+         * @return Length of the ATR or -1 on error
+         */
+        ssize_t (*atr)(void *card, unsigned char *atr, size_t atr_size);
+        /**
+         * @brief Powers the card on (\a on is 1) or off (\a on is 0)
+         *
+         * @return 0 on success, -1 on error
+         */
+        int (*power)(void *card, int on);
+        /**
+         * @brief Resets the card
+         *
+         * @return 0 on success, -1 on error
+         */
+        int (*reset)(void *card);
+        /**
+         * @brief Processes a command APDU
+         *
+         * @param[in]  apdu       Command APDU
+         * @param[in]  apdu_len   Length of \a apdu
+         * @param[out] rapdu      Buffer for the response APDU
+         * @param[in]  rapdu_size Size of \a rapdu, which holds at least 65538
+         *                        bytes unless the application passed a
+         *                        smaller buffer
+         *
+         * @return Length of the response APDU. -1 on error, where \c ENOBUFS
+         *         indicates that \a rapdu is too small. Any other error
+         *         removes the card.
+         */
+        ssize_t (*transmit)(void *card, const unsigned char *apdu,
+                size_t apdu_len, unsigned char *rapdu, size_t rapdu_size);
+};
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,149 @@
+--
+-- Copyright (C) 2026 Frank Morgner
+--
+-- This file is part of virtualsmartcard.
+--
+-- virtualsmartcard is free software: you can redistribute it and/or modify it
+-- under the terms of the GNU General Public License as published by the Free
+-- Software Foundation, either version 3 of the License, or (at your option) any
+-- later version.
+--
+-- virtualsmartcard is distributed in the hope that it will be useful, but
+-- WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+-- FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+-- more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Wireshark dissector for frames captured by libvpcd (see capture.h), e.g.
+-- with the option capture=PATH of ifd-vpcd. Copy this file to Wireshark's
+-- personal plugin folder or run
+--
+--   wireshark -X lua_script:vpcd-capture.lua vpcd.pcapng
+
+local vpcd = Proto("vpcd", "Virtual Smart Card Frame")
+
+local directions = { [0] = "vpcd -> vicc", [1] = "vicc -> vpcd" }
+local controls = {
+    [0] = "Power Off", [1] = "Power On", [2] = "Reset", [4] = "Get ATR",
+    [8] = "Hello",
+}
+local events = {
+    [1] = "Card inserted", [2] = "Card removed", [3] = "ATR changed",
+}
+
+local f = vpcd.fields
+f.version = ProtoField.uint8("vpcd.version", "Capture Version")
+f.direction = ProtoField.uint8("vpcd.direction", "Direction", base.DEC,
+    directions)
+f.slot = ProtoField.uint16("vpcd.slot", "Slot")
+f.flags = ProtoField.uint8("vpcd.flags", "Flags", base.HEX)
+f.flag_event = ProtoField.bool("vpcd.flags.event", "Event", 8, nil, 0x01)
+f.flag_deflate = ProtoField.bool("vpcd.flags.deflate", "Compressed", 8, nil,
+    0x02)
+f.flag_heartbeat = ProtoField.bool("vpcd.flags.heartbeat", "Heartbeat", 8,
+    nil, 0x04)
+f.tag = ProtoField.uint16("vpcd.tag", "Tag", base.HEX)
+f.control = ProtoField.uint8("vpcd.control", "Control", base.DEC, controls)
+f.event = ProtoField.uint8("vpcd.event", "Event", base.DEC, events)
+f.hello_version = ProtoField.uint8("vpcd.hello.version", "Protocol Version")
+f.hello_features = ProtoField.uint32("vpcd.hello.features", "Features",
+    base.HEX)
+f.session = ProtoField.bytes("vpcd.session", "Session")
+f.atr = ProtoField.bytes("vpcd.atr", "ATR")
+f.cla = ProtoField.uint8("vpcd.apdu.cla", "CLA", base.HEX)
+f.ins = ProtoField.uint8("vpcd.apdu.ins", "INS", base.HEX)
+f.p1 = ProtoField.uint8("vpcd.apdu.p1", "P1", base.HEX)
+f.p2 = ProtoField.uint8("vpcd.apdu.p2", "P2", base.HEX)
+f.data = ProtoField.bytes("vpcd.apdu.data", "Data")
+f.sw = ProtoField.uint16("vpcd.apdu.sw", "SW", base.HEX)
+
+local HEADER_LEN = 8
+
+function vpcd.dissector(tvb, pinfo, tree)
+    if tvb:len() < HEADER_LEN then
+        return 0
+    end
+
+    local direction = tvb(1, 1):uint()
+    local flags = tvb(4, 1):uint()
+    -- the length of the frame, of which only a part may have been captured
+    local len = tvb:reported_length_remaining() - HEADER_LEN
+    local body
+    local info
+
+    pinfo.cols.protocol = "VPCD"
+    local subtree = tree:add(vpcd, tvb(), "Virtual Smart Card Frame")
+    subtree:add(f.version, tvb(0, 1))
+    subtree:add(f.direction, tvb(1, 1))
+    subtree:add(f.slot, tvb(2, 2))
+    local flagtree = subtree:add(f.flags, tvb(4, 1))
+    flagtree:add(f.flag_event, tvb(4, 1))
+    flagtree:add(f.flag_deflate, tvb(4, 1))
+    flagtree:add(f.flag_heartbeat, tvb(4, 1))
+    subtree:add(f.tag, tvb(6, 2))
+
+    if tvb:len() > HEADER_LEN then
+        body = tvb(HEADER_LEN)
+    end
+
+    if bit.band(flags, 0x04) ~= 0 then
+        info = "Heartbeat"
+    elseif len == 0 then
+        info = "Empty"
+    elseif not body then
+        info = string.format("%d bytes not captured", len)
+    elseif bit.band(flags, 0x01) ~= 0 then
+        local event = body(0, 1):uint()
+        subtree:add(f.event, body(0, 1))
+        if body:len() > 1 then
+            subtree:add(f.atr, body(1))
+        end
+        info = events[event] or "Unknown event"
+    elseif len == 9 and body(0, 4):string() == "vpcd" then
+        subtree:add(f.hello_version, body(4, 1))
+        subtree:add(f.hello_features, body(5, 4))
+        info = string.format("Hello, version %d, features 0x%08X",
+            body(4, 1):uint(), body(5, 4):uint())
+    elseif len == 12 and body(0, 4):string() == "sess" then
+        subtree:add(f.session, body(4, 8))
+        info = "Session " .. tostring(body(4, 8):bytes())
+    elseif direction == 0 and len == 1 then
+        local control = body(0, 1):uint()
+        subtree:add(f.control, body(0, 1))
+        info = controls[control] or "Unknown control"
+    elseif direction == 0 then
+        if len >= 4 then
+            subtree:add(f.cla, body(0, 1))
+            subtree:add(f.ins, body(1, 1))
+            subtree:add(f.p1, body(2, 1))
+            subtree:add(f.p2, body(3, 1))
+            info = string.format("C-APDU INS=%02X", body(1, 1):uint())
+        else
+            info = "C-APDU"
+        end
+        if body:len() > 4 then
+            subtree:add(f.data, body(4))
+        end
+    elseif len >= 2 and body:len() == len then
+        if len > 2 then
+            subtree:add(f.data, body(0, len - 2))
+        end
+        subtree:add(f.sw, body(len - 2, 2))
+        info = string.format("R-APDU SW=%04X", body(len - 2, 2):uint())
+    else
+        -- a response or an ATR, possibly truncated
+        subtree:add(f.data, body)
+        info = "Response"
+    end
+
+    pinfo.cols.info = string.format("Slot %d %s: %s", tvb(2, 2):uint(),
+        directions[direction] or "?", info)
+
+    return tvb:len()
+end
+
+-- libvpcd writes its captures with LINKTYPE_USER0
+DissectorTable.get("wtap_encap"):add(wtap.USER0, vpcd)
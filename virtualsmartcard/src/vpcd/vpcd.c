@@ -17,7 +17,18 @@
  * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "vpcd.h"
+#include "capture.h"
+#include "connect.h"
+#include "fault.h"
+#include "frame.h"
+#include "inproc.h"
 #include "lock.h"
+#include "mux.h"
+#include "reactor.h"
+#include "shard.h"
+#include "shm.h"
+#include "stats.h"
+#include "uring.h"
 
 #if HAVE_CONFIG_H
 #include "config.h"
@@ -35,62 +46,214 @@
 #define AI_NUMERICSERV 0
 #endif
 typedef WORD uint16_t;
+/* WSABUF is the Windows equivalent of struct iovec */
+#define iovec _WSABUF
+#define iov_base buf
+#define iov_len len
+/* a socket is only read or written after select() reported it ready */
+#define MSG_DONTWAIT 0
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #define INVALID_SOCKET -1
 #endif
 
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+/* interval for checking for vicc while waiting for events, if there is nothing
+ * to poll */
+#define VPCD_EVENT_POLL_MS 100
+
+/* milliseconds a connect to a remote vicc may take if the context has no
+ * timeout */
+#define VPCD_CONNECT_TIMEOUT_MS 2000
+
+/* largest command sent via io_uring, which fits into the socket's default
+ * send buffer */
+#define VPCD_URING_MAX_SEND 8192
+
+/* milliseconds a standby may take for its ATR if the context has no timeout */
+#define VPCD_STANDBY_TIMEOUT_MS 1000
+
+/* interval between attempts to connect to the remote vicc while resuming a
+ * session */
+#define VPCD_RESUME_POLL_MS 100
+
+/* seconds between unanswered keepalive probes if not configured, so that a
+ * vanished vicc is noticed soon after the idle time */
+#define VPCD_KEEPALIVE_INTERVAL 5
+
+/* most buffers passed to a single call of sendmsg() for a batch, well below
+ * IOV_MAX */
+#define VPCD_BATCH_IOV 256
+
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
-static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t size, const unsigned char *buffer);
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer);
+static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t size,
+        const unsigned char *buffer, unsigned short tag, int reply);
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer,
+        size_t buffer_size, int realloc_buffer, unsigned short tag);
 
-static ssize_t sendall(SOCKET sock, const void *buffer, size_t size);
-static ssize_t recvall(SOCKET sock, void *buffer, size_t size);
+static ssize_t sendallv(SOCKET sock, struct iovec *iov, int iovcnt,
+        long long deadline);
+static ssize_t recvall(SOCKET sock, void *buffer, size_t size,
+        long long deadline);
+static int wait_io(SOCKET sock, int write, long long deadline);
+static int readable(SOCKET sock);
+static long long now_ms(void);
 
 static SOCKET opensock(unsigned short port);
-static SOCKET connectsock(const char *hostname, unsigned short port);
+static SOCKET opensock_unix(const char *path);
+static SOCKET connectsock(struct vicc_ctx *ctx);
+
+static int failover(struct vicc_ctx *ctx, SOCKET failed);
+static void standby_fill(struct vicc_ctx *ctx);
+static unsigned int standby_trim(struct vicc_ctx *ctx, unsigned int keep,
+        struct vicc_ctx **trimmed);
+static int suspend(struct vicc_ctx *ctx);
 
-ssize_t sendall(SOCKET sock, const void *buffer, size_t size)
+ssize_t sendallv(SOCKET sock, struct iovec *iov, int iovcnt,
+        long long deadline)
 {
     size_t sent = 0;
     ssize_t r;
-
-    /* FIXME we should actually check the length instead of simply casting from
-     * size_t to ssize_t (or int), which have both the same width! */
-    while (sent < size) {
-        r = send(sock, (void *) (((unsigned char *) buffer)+sent),
 #ifdef _WIN32
-                (int)
+    DWORD n;
+#else
+    struct msghdr msg;
 #endif
-                (size-sent), MSG_NOSIGNAL);
 
-        if (r < 0)
+    while (iovcnt > 0) {
+        if (deadline && wait_io(sock, 1, deadline) < 0)
+            return -1;
+#ifdef _WIN32
+        if (WSASend(sock, iov, iovcnt, &n, 0, NULL, NULL) != 0)
+            return -1;
+        r = n;
+#else
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        /* with a deadline, send only what fits into the socket's buffer and
+         * wait for the rest */
+        r = sendmsg(sock, &msg,
+                MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0));
+        if (r < 0) {
+            if (deadline && (errno == EAGAIN || errno == EWOULDBLOCK
+                        || errno == EINTR))
+                continue;
             return r;
+        }
+#endif
 
         sent += r;
+
+        /* skip what has been sent completely and continue with the rest */
+        while (iovcnt > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (void *) (((unsigned char *) iov->iov_base) + r);
+            iov->iov_len -= r;
+        }
     }
 
     return (ssize_t) sent;
 }
 
-ssize_t recvall(SOCKET sock, void *buffer, size_t size) {
-    return recv(sock, buffer,
+ssize_t recvall(SOCKET sock, void *buffer, size_t size, long long deadline)
+{
+    size_t received = 0;
+    ssize_t r;
+
+    if (!deadline)
+        return recv(sock, buffer,
+#ifdef _WIN32
+                (int)
+#endif
+                size, MSG_WAITALL|MSG_NOSIGNAL);
+
+    /* collect what arrives until the deadline */
+    while (received < size) {
+        if (wait_io(sock, 0, deadline) < 0)
+            return -1;
+        r = recv(sock, (void *) (((unsigned char *) buffer)+received),
+#ifdef _WIN32
+                (int)
+#endif
+                (size-received), MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (r == 0)
+            break;
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            return r;
+        }
+        received += r;
+    }
+
+    return (ssize_t) received;
+}
+
+/* Waits until the socket is readable or writable. Returns -1 and sets errno
+ * to ETIMEDOUT if the deadline has passed. */
+static int wait_io(SOCKET sock, int write, long long deadline)
+{
+    long long left;
+    int r;
+#ifdef _WIN32
+    fd_set fds;
+    struct timeval tv;
+#else
+    struct pollfd pfd;
+#endif
+
+    do {
+        left = deadline - now_ms();
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
 #ifdef _WIN32
-            (int)
+        FD_ZERO(&fds);
+#pragma warning(disable:4127)
+        FD_SET(sock, &fds);
+#pragma warning(default:4127)
+        tv.tv_sec = (long) (left / 1000);
+        tv.tv_usec = (long) (left % 1000) * 1000;
+        r = select((int) sock + 1, write ? NULL : &fds, write ? &fds : NULL,
+                NULL, &tv);
+#else
+        pfd.fd = sock;
+        pfd.events = write ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        r = poll(&pfd, 1, left > INT_MAX ? INT_MAX : (int) left);
+        if (r < 0 && errno == EINTR)
+            r = 0;
 #endif
-            size, MSG_WAITALL|MSG_NOSIGNAL);
+    } while (r == 0);
+
+    return r < 0 ? -1 : 1;
 }
 
 static SOCKET opensock(unsigned short port)
@@ -122,7 +285,8 @@ static SOCKET opensock(unsigned short port)
         goto err;
     }
 
-    if (listen(sock, 0) != 0) {
+    /* standbys may connect while the active vicc is served */
+    if (listen(sock, VICC_MAX_STANDBY) != 0) {
         perror(NULL);
         goto err;
     }
@@ -135,47 +299,137 @@ err:
     return INVALID_SOCKET;
 }
 
-static SOCKET connectsock(const char *hostname, unsigned short port)
+static SOCKET opensock_unix(const char *path)
 {
-	struct addrinfo hints, *res = NULL, *cur;
-	SOCKET sock = INVALID_SOCKET;
-    char _port[10];
+#ifdef HAVE_SYS_UN_H
+    SOCKET sock;
+    struct sockaddr_un server_sockaddr;
+
+    if (strlen(path) >= sizeof server_sockaddr.sun_path) {
+        errno = ENAMETOOLONG;
+        return INVALID_SOCKET;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    memset(&server_sockaddr, 0, sizeof server_sockaddr);
+    server_sockaddr.sun_family = AF_UNIX;
+    strcpy(server_sockaddr.sun_path, path);
+
+    /* remove the socket file of a previous instance */
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &server_sockaddr,
+                sizeof server_sockaddr) != 0)  {
+        perror(NULL);
+        goto err;
+    }
 
-    if (snprintf(_port, sizeof _port, "%hu", port) < 0)
+    /* standbys may connect while the active vicc is served */
+    if (listen(sock, VICC_MAX_STANDBY) != 0) {
+        perror(NULL);
         goto err;
-    _port[(sizeof _port) -1] = '\0';
+    }
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_NUMERICSERV;
+    return sock;
 
-	if (getaddrinfo(hostname, _port, &hints, &res) != 0)
-		goto err;
+err:
+    close(sock);
 
-	for (cur = res; cur; cur = cur->ai_next) {
-		sock = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
-		if (sock == INVALID_SOCKET)
-			continue;
+    return INVALID_SOCKET;
+#else
+    errno = ENOSYS;
+    return INVALID_SOCKET;
+#endif
+}
 
-		if (connect(sock, cur->ai_addr,
+/* Connects the socket without waiting longer than the deadline */
+static int connect_until(SOCKET sock, const struct sockaddr *addr,
+        socklen_t addrlen, long long deadline)
+{
+    int error = 0, r;
+    socklen_t len = sizeof error;
 #ifdef _WIN32
-                    (int)
+    u_long mode = 1;
+
+    if (ioctlsocket(sock, FIONBIO, &mode) != 0)
+        return -1;
+    r = connect(sock, addr, (int) addrlen);
+    if (r != 0 && WSAGetLastError() != WSAEWOULDBLOCK)
+        return -1;
+#else
+    int flags = fcntl(sock, F_GETFL);
+
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    r = connect(sock, addr, addrlen);
+    if (r != 0 && errno != EINPROGRESS)
+        return -1;
 #endif
-                    cur->ai_addrlen) != -1)
-			break;
 
-		close(sock);
-	}
+    if (r != 0) {
+        if (wait_io(sock, 1, deadline) < 0)
+            return -1;
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *) &error,
+                    &len) != 0)
+            return -1;
+        if (error) {
+            errno = error;
+            return -1;
+        }
+    }
 
-err:
-	freeaddrinfo(res);
-	return sock;
+#ifdef _WIN32
+    mode = 0;
+    if (ioctlsocket(sock, FIONBIO, &mode) != 0)
+        return -1;
+#else
+    if (fcntl(sock, F_SETFL, flags) < 0)
+        return -1;
+#endif
+
+    return 0;
+}
+
+/* Connects to the remote vicc unless the backoff after the previous failure
+ * has not yet passed */
+static SOCKET connectsock(struct vicc_ctx *ctx)
+{
+    const struct addrinfo *cur;
+    SOCKET sock = INVALID_SOCKET;
+    long long deadline;
+
+    if (!connect_due(ctx)) {
+        errno = EAGAIN;
+        return INVALID_SOCKET;
+    }
+
+    deadline = now_ms()
+        + (ctx->timeout ? ctx->timeout : VPCD_CONNECT_TIMEOUT_MS);
+
+    for (cur = connect_resolve(ctx); cur; cur = cur->ai_next) {
+        sock = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+        if (sock == INVALID_SOCKET)
+            continue;
+
+        if (connect_until(sock, cur->ai_addr,
+                    (socklen_t) cur->ai_addrlen, deadline) == 0)
+            break;
+
+        close(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    connect_done(ctx, sock != INVALID_SOCKET);
+
+    return sock;
 }
 
 SOCKET waitforclient(SOCKET server, long secs, long usecs)
 {
-    struct sockaddr_in client_sockaddr;
+    struct sockaddr_storage client_sockaddr;
     socklen_t client_socklen = sizeof client_sockaddr;
 
 #if _WIN32
@@ -217,244 +471,2491 @@ SOCKET waitforclient(SOCKET server, long secs, long usecs)
     return INVALID_SOCKET;
 }
 
-static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length, const unsigned char* buffer)
+/* Returns 1 if a round trip may go via io_uring, setting it up on first use */
+static int use_uring(struct vicc_ctx *ctx, size_t length)
 {
-    ssize_t r;
-    uint16_t size;
-    char *sendBuffer;
-
-    if (!ctx || length > 0xFFFF) {
-        errno = EINVAL;
-        return -1;
-    }
+    if (!ctx->sockopts.uring || ctx->client_sock == INVALID_SOCKET
+            || ctx->uring_unavailable
+            /* faults are injected between sending and receiving */
+            || ctx->fault
+            /* a bigger command may have to wait for the socket's buffer,
+             * which the deadline does not cover */
+            || length > VPCD_URING_MAX_SEND)
+        return 0;
 
-    /* allocate buffer for outgoing message */
-    sendBuffer = (char *) malloc(length + 2);
-    if (sendBuffer == NULL) {
-        errno = ENOMEM;
-	return -1;
+    if (!ctx->uring) {
+        ctx->uring = uring_new();
+        ctx->uring_unavailable = !ctx->uring;
     }
 
-    /* send size of message on 2 bytes */
-    size = htons((uint16_t) length);
-    memcpy(sendBuffer, &size, 2);
-    memcpy(sendBuffer + 2, buffer, length);
-    r = sendall(ctx->client_sock, sendBuffer, length + 2);
-
-    if (r < 0)
-        vicc_eject(ctx);
-
-    free(sendBuffer);
-    return r;
+    return ctx->uring != NULL;
 }
 
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer)
+/* Makes room for a compressed frame of size bytes */
+static int deflate_reserve(struct vicc_ctx *ctx, size_t size)
 {
-    ssize_t r;
-    uint16_t size;
-    unsigned char *p = NULL;
+    unsigned char *p;
 
-    if (!buffer || !ctx) {
-        errno = EINVAL;
+    if (size <= ctx->deflate_buf_len)
+        return 0;
+
+    p = realloc(ctx->deflate_buf, size);
+    if (!p) {
+        errno = ENOMEM;
         return -1;
     }
+    ctx->deflate_buf = p;
+    ctx->deflate_buf_len = size;
 
-    /* receive size of message on 2 bytes */
-    r = recvall(ctx->client_sock, &size, sizeof size);
-    if (r < sizeof size)
-        return r;
+    return 0;
+}
 
-    size = ntohs(size);
+/* Compresses a command into the context's buffer if that makes it smaller.
+ * Returns the length of the compressed frame or 0 to send it as it is. */
+static size_t deflate_command(struct vicc_ctx *ctx, size_t length,
+        const unsigned char *buffer)
+{
+    size_t deflated_len;
+    long long start;
 
-    if (0 != size) {
-        p = realloc(*buffer, size);
-        if (p == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-        *buffer = p;
-    }
+    if (!(ctx->features & VPCD_FEATURE_DEFLATE)
+            || length < ctx->deflate_threshold
+            || deflate_reserve(ctx, length) < 0)
+        return 0;
 
-    /* receive message */
-    return recvall(ctx->client_sock, *buffer, size);
+    start = now_us();
+    deflated_len = frame_deflate(buffer, length, ctx->deflate_buf, length - 1);
+    stats_deflate(ctx, length, deflated_len, now_us() - start);
+
+    return deflated_len;
 }
 
-int vicc_eject(struct vicc_ctx *ctx)
+/* Injects the faults of the scenario into a frame of len bytes, sleeping for
+ * its delay. Returns the fate of the frame, the number of bytes to pass in
+ * keep and -1 if the delay has run out of time. */
+static int inject(struct vicc_ctx *ctx, int direction, size_t len,
+        size_t *keep)
 {
-    int r = 0;
-    if (ctx && ctx->client_sock != INVALID_SOCKET) {
-        if (close(ctx->client_sock) < 0) {
-            r = -1;
-        }
-        ctx->client_sock = INVALID_SOCKET;
+    long long delay, limit = -1;
+    int fate;
+
+    *keep = len;
+    if (!ctx->fault)
+        return FAULT_PASS;
+
+    fate = fault_frame(ctx->fault, direction, len, &delay, keep);
+    if (ctx->deadline) {
+        limit = (ctx->deadline - now_ms()) * 1000;
+        if (limit < 0)
+            limit = 0;
     }
-    return r;
+    if (fault_sleep(delay, limit) < 0)
+        return -1;
+
+    return fate;
 }
 
-struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
+/* Sends a frame. If a reply is awaited right away, the beginning of it may be
+ * received along with sending. */
+static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length,
+        const unsigned char* buffer, unsigned short tag, int reply)
 {
-    struct vicc_ctx *r = NULL;
-
-    struct vicc_ctx *ctx = malloc(sizeof *ctx);
-    if (!ctx) {
-        goto err;
+    ssize_t r;
+    unsigned char header[FRAME_MAX_HEADER_LEN];
+    unsigned char flags = 0;
+    size_t deflated_len;
+    struct iovec iov[2];
+    const unsigned char *data = buffer;
+    size_t data_len = length, keep;
+
+    if (!ctx || length > frame_max_len(ctx->features)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    ctx->hostname = NULL;
-    ctx->io_lock = NULL;
-    ctx->server_sock = INVALID_SOCKET;
-    ctx->client_sock = INVALID_SOCKET;
-    ctx->port = port;
-
-#ifdef _WIN32
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
-
-    ctx->io_lock = create_lock();
-    if (!ctx->io_lock) {
-        goto err;
+    deflated_len = deflate_command(ctx, length, buffer);
+    if (deflated_len) {
+        buffer = ctx->deflate_buf;
+        length = deflated_len;
+        flags = FRAME_FLAG_DEFLATE;
     }
 
-    if (hostname) {
-        ctx->hostname = strdup(hostname);
-        if (!ctx->hostname) {
+    /* send the header of the message together with the message itself */
+    iov[0].iov_base = (void *) header;
+    iov[0].iov_len = frame_encode_header(ctx->features, header, length, flags,
+            tag);
+    iov[1].iov_base = (void *) buffer;
+    iov[1].iov_len = length;
+    switch (inject(ctx, FAULT_TO_VICC, iov[0].iov_len + length, &keep)) {
+        case FAULT_PASS:
+            break;
+        case FAULT_TRUNCATE:
+            /* only the beginning of the frame makes it to vicc */
+            if (keep < iov[0].iov_len) {
+                iov[0].iov_len = keep;
+                iov[1].iov_len = 0;
+            } else {
+                iov[1].iov_len = keep - iov[0].iov_len;
+            }
+            if (!ctx->shm) {
+                sendallv(ctx->client_sock, iov, 2, ctx->deadline);
+            } else if (shm_send(ctx->shm, iov[0].iov_base, iov[0].iov_len,
+                        ctx->deadline) > 0 && iov[1].iov_len) {
+                shm_send(ctx->shm, buffer, iov[1].iov_len, ctx->deadline);
+            }
+            /* fall through */
+        case FAULT_DROP:
+            errno = ECONNRESET;
+            /* fall through */
+        default:
+            r = -1;
             goto err;
-        }
-        ctx->client_sock = connectsock(hostname, port);
+    }
+    if (ctx->shm) {
+        r = shm_send(ctx->shm, iov[0].iov_base, iov[0].iov_len,
+                ctx->deadline);
+        if (r > 0 && length)
+            r = shm_send(ctx->shm, buffer, length, ctx->deadline);
+    } else if (reply && use_uring(ctx, length)) {
+        r = uring_roundtrip(ctx->uring, ctx->client_sock, header,
+                iov[0].iov_len, buffer, length, ctx->deadline);
     } else {
-        ctx->server_sock = opensock(port);
-        if (ctx->server_sock == INVALID_SOCKET) {
-            goto err;
-        }
+        r = sendallv(ctx->client_sock, iov, length ? 2 : 1, ctx->deadline);
     }
-    r = ctx;
 
 err:
-    if (!r) {
-        vicc_exit(ctx);
-    }
+    if (r < 0 && !suspend(ctx))
+        vicc_eject(ctx);
+    else if (r >= 0)
+        capture_frame(ctx, CAPTURE_TO_VICC, flags, tag, data, data_len);
 
     return r;
 }
 
-int vicc_exit(struct vicc_ctx *ctx)
+static ssize_t recvFrom(struct vicc_ctx *ctx, void *buffer, size_t size)
 {
-    int r = vicc_eject(ctx);
-    if (ctx) {
-        free_lock(ctx->io_lock);
-        free(ctx->hostname);
-        if (ctx->server_sock != INVALID_SOCKET) {
-            ctx->server_sock = close(ctx->server_sock);
-            if (ctx->server_sock == INVALID_SOCKET) {
-                r = -1;
-            }
-        }
-        free(ctx);
-#ifdef _WIN32
-        WSACleanup();
-#endif
-    }
+    ssize_t r;
+    size_t taken;
 
-    return r;
-}
+    if (ctx->shm)
+        return shm_recv(ctx->shm, buffer, size, ctx->deadline);
 
-ssize_t vicc_transmit(struct vicc_ctx *ctx,
-        size_t apdu_len, const unsigned char *apdu,
-        unsigned char **rapdu)
-{
-    ssize_t r = -1;
+    /* what has been received along with the command comes first */
+    taken = uring_take(ctx->uring, buffer, size);
+    if (taken == size)
+        return (ssize_t) size;
 
-    if (ctx && lock(ctx->io_lock)) {
-        if (apdu_len && apdu)
-            r = sendToVICC(ctx, apdu_len, apdu);
-        else
-            r = 1;
+    r = recvall(ctx->client_sock, (unsigned char *) buffer + taken,
+            size - taken, ctx->deadline);
+    sockopts_rearm(ctx, ctx->client_sock);
 
-        if (r > 0 && rapdu)
-            r = recvFromVICC(ctx, rapdu);
+    return r > 0 ? (ssize_t) taken + r : r;
+}
 
-        unlock(ctx->io_lock);
-    }
+/* Receive and drop size bytes */
+static ssize_t drop(struct vicc_ctx *ctx, size_t size)
+{
+    ssize_t r;
+    unsigned char discard[256];
 
-    if (r <= 0)
-        vicc_eject(ctx);
+    while (size > 0) {
+        r = recvFrom(ctx, discard,
+                size < sizeof discard ? size : sizeof discard);
+        if (r <= 0)
+            return r;
+        size -= r;
+    }
 
-    return r;
+    return 1;
 }
 
-
-int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
+/* Receive the body of an event frame */
+static ssize_t recvEvent(struct vicc_ctx *ctx, size_t size)
 {
-    if (!ctx)
-        return 0;
+    unsigned char body[FRAME_MAX_EVENT_LEN];
+    ssize_t r;
 
-    if (ctx->client_sock == INVALID_SOCKET) {
-        if(!ctx->hostname) {
-            /* server mode, try to accept a client */
-            ctx->client_sock = waitforclient(ctx->server_sock, secs, usecs);
-        } else {
-            /* client mode, try to connect (again) */
-            ctx->client_sock = connectsock(ctx->hostname, ctx->port);
-        }
+    if (size == 0 || size > sizeof body)
+        /* not an event we know of */
+        return drop(ctx, size);
+
+    r = recvFrom(ctx, body, size);
+    if (r > 0) {
+        capture_frame(ctx, CAPTURE_FROM_VICC, FRAME_FLAG_EVENT, 0, body, size);
+        event_handle(ctx, body, size);
     }
 
-    if (ctx->client_sock == INVALID_SOCKET)
-        /* not connected */
-        return 0;
-    else
-        return 1;
+    return r;
 }
 
-int vicc_present(struct vicc_ctx *ctx) {
-    unsigned char *atr = NULL;
+/* Receive the answer to a heartbeat */
+static ssize_t recvHeartbeat(struct vicc_ctx *ctx, unsigned short tag,
+        size_t size)
+{
+    ssize_t r;
 
-    /* get the atr to check if the card is still alive */
-    if (!vicc_connect(ctx, 0, 0) || vicc_getatr(ctx, &atr) <= 0)
-        return 0;
+    if (size) {
+        /* heartbeats are empty, but tolerate what a later version adds */
+        r = drop(ctx, size);
+        if (r <= 0)
+            return r;
+    }
+    capture_frame(ctx, CAPTURE_FROM_VICC, FRAME_FLAG_HEARTBEAT, tag, NULL, 0);
 
-    free(atr);
+    if (ctx->heartbeat_sent && tag == ctx->heartbeat_tag) {
+        stats_rtt(ctx, now_us() - ctx->heartbeat_sent);
+        ctx->heartbeat_sent = 0;
+        ctx->heartbeat_missed = 0;
+    }
+    state_touch(ctx);
 
     return 1;
 }
 
-ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char **atr) {
-    unsigned char i = VPCD_CTRL_ATR;
-    return vicc_transmit(ctx, VPCD_CTRL_LEN, &i, atr);
-}
-
-int vicc_poweron(struct vicc_ctx *ctx) {
-    unsigned char i = VPCD_CTRL_ON;
-    int r = 0;
+/* Receive and decompress the body of a compressed frame */
+static ssize_t recvDeflated(struct vicc_ctx *ctx, unsigned char **buffer,
+        size_t buffer_size, int realloc_buffer, unsigned short tag,
+        size_t size)
+{
+    ssize_t r;
+    size_t len;
+    long long start;
+    unsigned char *p;
+
+    if (deflate_reserve(ctx, size) < 0) {
+        /* drop the message to keep the stream in sync */
+        r = drop(ctx, size);
+        if (r <= 0)
+            return r;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    r = recvFrom(ctx, ctx->deflate_buf, size);
+    if (r <= 0)
+        return r;
+
+    len = frame_inflated_len(ctx->deflate_buf, size);
+    if (!len || len > frame_max_len(ctx->features)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (len > buffer_size) {
+        if (!realloc_buffer) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        p = realloc(*buffer, len);
+        if (p == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buffer = p;
+    }
+
+    start = now_us();
+    if (!frame_inflate(ctx->deflate_buf, size, *buffer)) {
+        errno = EPROTO;
+        return -1;
+    }
+    stats_inflate(ctx, size, len, now_us() - start);
+    capture_frame(ctx, CAPTURE_FROM_VICC, FRAME_FLAG_DEFLATE, tag, *buffer,
+            len);
+
+    return (ssize_t) len;
+}
+
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer,
+        size_t buffer_size, int realloc_buffer, unsigned short tag)
+{
+    ssize_t r;
+    unsigned char header[FRAME_MAX_HEADER_LEN];
+    size_t header_len, size;
+    unsigned char flags;
+    unsigned short frame_tag;
+    unsigned char *p = NULL;
+    size_t keep;
+    int fate;
+
+    if (!buffer || !ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (1) {
+        /* receive the header of the message */
+        header_len = frame_header_len(ctx->features);
+        r = recvFrom(ctx, header, header_len);
+        if (r < (ssize_t) header_len)
+            return r;
+
+        frame_decode_header(ctx->features, header, &size, &flags, &frame_tag);
+        if ((flags & FRAME_FLAG_EVENT)
+                && (ctx->features & VPCD_FEATURE_EVENTS)) {
+            /* an event which vicc sent before the response */
+            r = recvEvent(ctx, size);
+        } else if ((flags & FRAME_FLAG_HEARTBEAT)
+                && (ctx->features & VPCD_FEATURE_HEARTBEAT)) {
+            /* the answer to a heartbeat sent before the command */
+            r = recvHeartbeat(ctx, frame_tag, size);
+        } else {
+            fate = inject(ctx, FAULT_FROM_VICC, header_len + size, &keep);
+            if (fate != FAULT_PASS) {
+                /* a truncated response is as good as a lost one */
+                if (fate > 0)
+                    errno = ECONNRESET;
+                return -1;
+            }
+            ctx->rx_header_us = now_us();
+            break;
+        }
+        if (r <= 0)
+            return r;
+    }
+
+    if (frame_tag != tag) {
+        /* we are waiting for only one response at a time */
+        errno = EPROTO;
+        return -1;
+    }
+
+    if ((flags & FRAME_FLAG_DEFLATE) && (ctx->features & VPCD_FEATURE_DEFLATE))
+        return recvDeflated(ctx, buffer, buffer_size, realloc_buffer, tag,
+                size);
+
+    if (size > buffer_size) {
+        if (realloc_buffer) {
+            p = realloc(*buffer, size);
+            if (p == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            *buffer = p;
+        } else {
+            /* drop the message to keep the stream in sync */
+            r = drop(ctx, size);
+            if (r <= 0)
+                return r;
+            capture_frame(ctx, CAPTURE_FROM_VICC, flags, tag, NULL, 0);
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    /* receive message */
+    r = recvFrom(ctx, *buffer, size);
+    if (r > 0)
+        capture_frame(ctx, CAPTURE_FROM_VICC, flags, tag, *buffer, size);
+
+    return r;
+}
+
+static unsigned short next_tag(struct vicc_ctx *ctx);
+
+/* Names the session vpcd had with vicc, which answers with the session it
+ * has. Returns -1 on I/O errors. */
+static int session(struct vicc_ctx *ctx)
+{
+    unsigned char buf[FRAME_SESSION_LEN], *p = buf;
+    unsigned char id[FRAME_SESSION_ID_LEN];
+    unsigned short tag;
+    ssize_t r;
+
+    if (ctx->session_valid)
+        memcpy(id, ctx->session, sizeof id);
+    else
+        memset(id, 0, sizeof id);
+    frame_encode_session(buf, id);
+
+    tag = next_tag(ctx);
+    if (sendToVICC(ctx, sizeof buf, buf, tag, 1) < 0)
+        return -1;
+    r = recvFromVICC(ctx, &p, sizeof buf, 0, tag);
+    if (r <= 0)
+        return -1;
+    if (!frame_decode_session(buf, r, id)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    ctx->session_resumed = ctx->session_valid
+        && memcmp(id, ctx->session, sizeof id) == 0;
+    memcpy(ctx->session, id, sizeof id);
+    ctx->session_valid = 1;
+
+    return 0;
+}
+
+/* Negotiate the protocol features with vicc. Returns -1 on I/O errors. */
+static int handshake(struct vicc_ctx *ctx)
+{
+    unsigned char hello = VPCD_CTRL_HELLO, getatr = VPCD_CTRL_ATR;
+    unsigned char buf[64], *p = buf;
+    unsigned char version;
+    unsigned int features;
+    ssize_t r;
+
+    ctx->handshake_pending = 0;
+
+    /* vicc answers the hello with its own features. An old vicc ignores the
+     * hello and only answers the request for the ATR. */
+    if (sendToVICC(ctx, VPCD_CTRL_LEN, &hello, 0, 0) < 0
+            || sendToVICC(ctx, VPCD_CTRL_LEN, &getatr, 0, 1) < 0)
+        return -1;
+
+    r = recvFromVICC(ctx, &p, sizeof buf, 0, 0);
+    if (r < 0 && errno == ENOBUFS)
+        /* an unusually long ATR, vicc ignored the hello */
+        return 0;
+    if (r <= 0) {
+        /* an old vicc which does not tolerate the hello */
+        ctx->legacy_peer = 1;
+        return -1;
+    }
+    if (!frame_decode_hello(buf, r, &version, &features))
+        return 0;
+
+    r = recvFromVICC(ctx, &p, sizeof buf, 0, 0);
+    if (r <= 0 && !(r < 0 && errno == ENOBUFS))
+        return -1;
+
+    /* select the features we both support, they are used from the next
+     * frame on */
+    features = frame_select_features(&version, features,
+            ctx->requested_features);
+    frame_encode_hello(buf, version, features);
+    if (sendToVICC(ctx, FRAME_HELLO_LEN, buf, 0, 0) < 0)
+        return -1;
+    ctx->features = features;
+
+    ctx->session_resumed = 0;
+    if (!(features & VPCD_FEATURE_RESUME)) {
+        ctx->session_valid = 0;
+        return 0;
+    }
+
+    return session(ctx);
+}
+
+static unsigned short next_tag(struct vicc_ctx *ctx)
+{
+    if (!(ctx->features & VPCD_FEATURE_TAGGED))
+        return 0;
+    if (++ctx->tag == 0)
+        ctx->tag = 1;
+    return ctx->tag;
+}
+
+/* Changes of the state are serialized by the state lock and published with
+ * the sequence counter, so that readers never wait for a lock */
+static void state_begin(struct vicc_ctx *ctx)
+{
+    lock(ctx->state_lock);
+    seq_write_begin(&ctx->state_seq);
+}
+
+static void state_end(struct vicc_ctx *ctx)
+{
+    seq_write_end(&ctx->state_seq);
+    unlock(ctx->state_lock);
+}
+
+static void read_state(struct vicc_ctx *ctx, struct vicc_state *state,
+        unsigned int *atr_epoch)
+{
+    unsigned int start;
+
+    do {
+        start = seq_read_begin(&ctx->state_seq);
+        memcpy(state, &ctx->state, sizeof *state);
+        if (atr_epoch)
+            *atr_epoch = ctx->atr_epoch;
+    } while (seq_read_retry(&ctx->state_seq, start));
+}
+
+void state_touch(struct vicc_ctx *ctx)
+{
+    state_begin(ctx);
+    ctx->state.last_activity = now_ms();
+    state_end(ctx);
+}
+
+void vicc_get_state(struct vicc_ctx *ctx, struct vicc_state *state)
+{
+    if (!state)
+        return;
+
+    if (ctx)
+        read_state(ctx, state, NULL);
+    else
+        memset(state, 0, sizeof *state);
+}
+
+int vicc_eject(struct vicc_ctx *ctx)
+{
+    int r = 0, removed = 0;
+    vicc_invalidate_atr(ctx);
+    if (ctx && ctx->reactor)
+        return reactor_eject(ctx);
+    if (ctx && ctx->shm) {
+        r = shm_eject(ctx->shm);
+        if (r > 0) {
+            removed = 1;
+            r = 0;
+        }
+        ctx->features = 0;
+    }
+    if (ctx && ctx->inproc && inproc_eject(ctx->inproc))
+        removed = 1;
+    if (ctx && ctx->resume_until) {
+        /* the card has been kept for resuming the session */
+        ctx->resume_until = 0;
+        removed = 1;
+    }
+    if (ctx)
+        ctx->session_valid = 0;
+    if (ctx && ctx->client_sock != INVALID_SOCKET) {
+        if (close(ctx->client_sock) < 0) {
+            r = -1;
+        }
+        ctx->client_sock = INVALID_SOCKET;
+        ctx->features = 0;
+        ctx->heartbeat_sent = 0;
+        ctx->heartbeat_missed = 0;
+        stats_rtt_reset(ctx);
+        removed = 1;
+    }
+    if (ctx)
+        uring_reset(ctx->uring);
+    if (removed)
+        event_connection(ctx, 0);
+    return r;
+}
+
+void vicc_set_features(struct vicc_ctx *ctx, unsigned int features)
+{
+    if (!ctx)
+        return;
+
+    if (ctx->reactor) {
+        reactor_set_features(ctx, features);
+    } else if (lock(ctx->io_lock)) {
+        ctx->requested_features = features;
+        ctx->handshake_pending = 1;
+        ctx->legacy_peer = 0;
+        unlock(ctx->io_lock);
+    }
+}
+
+void vicc_set_deflate_threshold(struct vicc_ctx *ctx, size_t threshold)
+{
+    if (!ctx)
+        return;
+
+    if (lock(ctx->io_lock)) {
+        ctx->deflate_threshold = threshold ? threshold : VPCD_DEFLATE_THRESHOLD;
+        unlock(ctx->io_lock);
+    }
+}
+
+void vicc_set_resume(struct vicc_ctx *ctx, long window)
+{
+    if (!ctx)
+        return;
+
+    if (lock(ctx->io_lock)) {
+        ctx->resume_window = window > 0 ? window : VPCD_RESUME_WINDOW;
+        unlock(ctx->io_lock);
+    }
+}
+
+void vicc_set_heartbeat(struct vicc_ctx *ctx, long interval,
+        unsigned int misses)
+{
+    if (!ctx)
+        return;
+
+    if (lock(ctx->io_lock)) {
+        ctx->heartbeat_interval = interval > 0 ?
+            interval : VPCD_HEARTBEAT_INTERVAL;
+        ctx->heartbeat_misses = misses ? misses : VPCD_HEARTBEAT_MISSES;
+        unlock(ctx->io_lock);
+    }
+}
+
+void vicc_set_capture(struct vicc_ctx *ctx, struct vicc_capture *capture,
+        unsigned short slot)
+{
+    if (!ctx)
+        return;
+
+    if (ctx->reactor) {
+        reactor_set_capture(ctx, capture, slot);
+    } else if (lock(ctx->io_lock)) {
+        ctx->capture = capture;
+        ctx->capture_slot = slot;
+        unlock(ctx->io_lock);
+    }
+}
+
+int vicc_set_fault(struct vicc_ctx *ctx, struct vicc_fault *fault,
+        unsigned short stream)
+{
+    struct fault_stream *p = NULL;
+
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctx->reactor || ctx->inproc) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (fault) {
+        p = malloc(sizeof *p);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        fault_stream_init(p, fault, stream);
+    }
+
+    if (!lock(ctx->io_lock)) {
+        free(p);
+        return -1;
+    }
+    free(ctx->fault);
+    ctx->fault = p;
+    unlock(ctx->io_lock);
+
+    return 0;
+}
+
+void vicc_sockopts_default(struct vicc_sockopts *opts)
+{
+    if (opts) {
+        memset(opts, 0, sizeof *opts);
+        opts->nodelay = 1;
+    }
+}
+
+static const struct {
+    const char *name;
+    size_t offset;
+    /* value used if none is given, -1 if a value is required */
+    int implicit;
+} sockopt_names[] = {
+    { "nodelay", offsetof(struct vicc_sockopts, nodelay), 1 },
+    { "quickack", offsetof(struct vicc_sockopts, quickack), 1 },
+    { "busypoll", offsetof(struct vicc_sockopts, busy_poll), -1 },
+    { "sndbuf", offsetof(struct vicc_sockopts, sndbuf), -1 },
+    { "rcvbuf", offsetof(struct vicc_sockopts, rcvbuf), -1 },
+    { "keepalive", offsetof(struct vicc_sockopts, keepalive), -1 },
+    { "keepintvl", offsetof(struct vicc_sockopts, keepalive_interval), -1 },
+    { "uring", offsetof(struct vicc_sockopts, uring), 1 },
+};
+
+int vicc_parse_sockopt(struct vicc_sockopts *opts,
+        const char *option, size_t len)
+{
+    size_t i, name_len;
+    const char *value;
+    char buf[16], *end;
+    long l;
+
+    if (!opts || !option)
+        return 0;
+
+    value = memchr(option, '=', len);
+    name_len = value ? (size_t) (value - option) : len;
+
+    for (i = 0; i < sizeof sockopt_names/sizeof *sockopt_names; i++) {
+        if (strlen(sockopt_names[i].name) == name_len
+                && strncmp(sockopt_names[i].name, option, name_len) == 0)
+            break;
+    }
+    if (i >= sizeof sockopt_names/sizeof *sockopt_names)
+        return 0;
+
+    if (!value) {
+        if (sockopt_names[i].implicit < 0)
+            return 0;
+        l = sockopt_names[i].implicit;
+    } else {
+        value++;
+        len -= name_len + 1;
+        if (len == 0 || len >= sizeof buf)
+            return 0;
+        memcpy(buf, value, len);
+        buf[len] = '\0';
+        l = strtol(buf, &end, 10);
+        if (*end != '\0' || l < 0 || l > 0x7fffffff)
+            return 0;
+    }
+
+    *(int *) ((char *) opts + sockopt_names[i].offset) = (int) l;
+
+    return 1;
+}
+
+int vicc_parse_sockopts(struct vicc_sockopts *opts, const char *options)
+{
+    const char *end;
+    size_t len;
+
+    if (!opts) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (options && *options) {
+        end = strchr(options, ',');
+        len = end ? (size_t) (end - options) : strlen(options);
+        if (len && !vicc_parse_sockopt(opts, options, len)) {
+            errno = EINVAL;
+            return -1;
+        }
+        options = end ? end + 1 : NULL;
+    }
+
+    return 0;
+}
+
+int sockopts_apply(struct vicc_ctx *ctx, SOCKET sock)
+{
+    const struct vicc_sockopts *opts = &ctx->sockopts;
+    int r = 0, yes = 1;
+#ifdef TCP_KEEPINTVL
+    int interval;
+#endif
+
+    if (sock == INVALID_SOCKET)
+        return 0;
+
+    if (opts->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
+                (void *) &opts->sndbuf, sizeof opts->sndbuf) != 0)
+        r = -1;
+    if (opts->rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                (void *) &opts->rcvbuf, sizeof opts->rcvbuf) != 0)
+        r = -1;
+
+    if (ctx->path)
+        /* the remaining options only apply to TCP */
+        return r;
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                (void *) &opts->nodelay, sizeof opts->nodelay) != 0)
+        r = -1;
+#ifdef TCP_QUICKACK
+    if (opts->quickack && setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK,
+                (void *) &yes, sizeof yes) != 0)
+        r = -1;
+#endif
+#ifdef SO_BUSY_POLL
+    if (opts->busy_poll && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                (void *) &opts->busy_poll, sizeof opts->busy_poll) != 0)
+        r = -1;
+#endif
+    if (opts->keepalive) {
+        if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE,
+                    (void *) &yes, sizeof yes) != 0)
+            r = -1;
+#if defined TCP_KEEPIDLE
+        if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE,
+                    (void *) &opts->keepalive, sizeof opts->keepalive) != 0)
+            r = -1;
+#elif defined TCP_KEEPALIVE
+        if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPALIVE,
+                    (void *) &opts->keepalive, sizeof opts->keepalive) != 0)
+            r = -1;
+#endif
+#ifdef TCP_KEEPINTVL
+        interval = opts->keepalive_interval;
+        if (!interval)
+            interval = opts->keepalive < VPCD_KEEPALIVE_INTERVAL
+                ? opts->keepalive : VPCD_KEEPALIVE_INTERVAL;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+                    (void *) &interval, sizeof interval) != 0)
+            r = -1;
+#endif
+    }
+
+    return r;
+}
+
+void sockopts_rearm(struct vicc_ctx *ctx, SOCKET sock)
+{
+#ifdef TCP_QUICKACK
+    /* Linux falls back to delayed acknowledgements, so the flag needs to be
+     * set again after receiving */
+    int yes = 1;
+    if (ctx->sockopts.quickack && !ctx->path && sock != INVALID_SOCKET)
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, (void *) &yes, sizeof yes);
+#endif
+}
+
+int vicc_set_sockopts(struct vicc_ctx *ctx, const struct vicc_sockopts *opts)
+{
+    int r;
+
+    if (!ctx || !opts) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->reactor)
+        return reactor_set_sockopts(ctx, opts);
+
+    if (!lock(ctx->io_lock))
+        return -1;
+    ctx->sockopts = *opts;
+    r = sockopts_apply(ctx, ctx->client_sock);
+    unlock(ctx->io_lock);
+
+    return r;
+}
+
+/* Returns a context which is neither listening nor connected */
+static struct vicc_ctx *ctx_new(unsigned short port)
+{
+    struct vicc_ctx *r = NULL;
+
+    struct vicc_ctx *ctx = malloc(sizeof *ctx);
+    if (!ctx) {
+        goto err;
+    }
+
+    ctx->hostname = NULL;
+    ctx->path = NULL;
+    ctx->shm = NULL;
+    ctx->inproc = NULL;
+    ctx->mux = NULL;
+    ctx->slot = 0;
+    ctx->shard = NULL;
+    ctx->io_lock = NULL;
+    ctx->reactor = NULL;
+    ctx->reactor_data = NULL;
+    ctx->requested_features = VPCD_FEATURES_DEFAULT;
+    ctx->legacy_peer = 0;
+    ctx->features = 0;
+    ctx->handshake_pending = 0;
+    ctx->tag = 0;
+    ctx->state_lock = NULL;
+    ctx->state_seq = 0;
+    memset(&ctx->state, 0, sizeof ctx->state);
+    ctx->atr_epoch = 0;
+    ctx->event_pipe[0] = -1;
+    ctx->event_pipe[1] = -1;
+    ctx->event_callback = NULL;
+    ctx->event_user_data = NULL;
+    vicc_sockopts_default(&ctx->sockopts);
+    ctx->timeout = 0;
+    ctx->deadline = 0;
+    ctx->rx_header_us = 0;
+    ctx->stats_lock = NULL;
+    memset(&ctx->stats, 0, sizeof ctx->stats);
+    ctx->addrs = NULL;
+    ctx->addrs_expire = 0;
+    ctx->connect_failures = 0;
+    ctx->connect_backoff = 0;
+    ctx->connect_next = 0;
+    ctx->uring = NULL;
+    ctx->uring_unavailable = 0;
+    ctx->deflate_threshold = VPCD_DEFLATE_THRESHOLD;
+    ctx->deflate_buf = NULL;
+    ctx->deflate_buf_len = 0;
+    ctx->capture = NULL;
+    ctx->capture_slot = 0;
+    ctx->fault = NULL;
+    ctx->heartbeat_interval = VPCD_HEARTBEAT_INTERVAL;
+    ctx->heartbeat_misses = VPCD_HEARTBEAT_MISSES;
+    ctx->heartbeat_tag = 0;
+    ctx->heartbeat_sent = 0;
+    ctx->heartbeat_missed = 0;
+    ctx->srtt = 0;
+    ctx->rttvar = 0;
+    memset(ctx->session, 0, sizeof ctx->session);
+    ctx->session_valid = 0;
+    ctx->session_resumed = 0;
+    ctx->resume_window = VPCD_RESUME_WINDOW;
+    ctx->resume_until = 0;
+    ctx->failover = VICC_FAILOVER_OFF;
+    ctx->standby_max = 0;
+    ctx->standby_len = 0;
+    ctx->server_sock = INVALID_SOCKET;
+    ctx->client_sock = INVALID_SOCKET;
+    ctx->port = port;
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    ctx->io_lock = create_lock();
+    ctx->state_lock = create_lock();
+    ctx->stats_lock = create_lock();
+    if (!ctx->io_lock || !ctx->state_lock || !ctx->stats_lock) {
+        goto err;
+    }
+
+#ifndef _WIN32
+    if (pipe(ctx->event_pipe) != 0
+            || fcntl(ctx->event_pipe[0], F_SETFL, O_NONBLOCK) != 0
+            || fcntl(ctx->event_pipe[1], F_SETFL, O_NONBLOCK) != 0
+            || fcntl(ctx->event_pipe[0], F_SETFD, FD_CLOEXEC) != 0
+            || fcntl(ctx->event_pipe[1], F_SETFD, FD_CLOEXEC) != 0) {
+        goto err;
+    }
+#endif
+    r = ctx;
+
+err:
+    if (!r) {
+        vicc_exit(ctx);
+    }
+
+    return r;
+}
+
+struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
+{
+    struct vicc_ctx *r = NULL;
+
+    struct vicc_ctx *ctx = ctx_new(port);
+    if (!ctx) {
+        goto err;
+    }
+
+    if (hostname && strncmp(hostname, VPCD_SHM_PREFIX,
+                strlen(VPCD_SHM_PREFIX)) == 0) {
+        ctx->shm = shm_create(hostname + strlen(VPCD_SHM_PREFIX));
+        if (!ctx->shm) {
+            goto err;
+        }
+    } else if (hostname && strncmp(hostname, VPCD_INPROC_PREFIX,
+                strlen(VPCD_INPROC_PREFIX)) == 0) {
+        ctx->inproc = inproc_open(hostname + strlen(VPCD_INPROC_PREFIX));
+        if (!ctx->inproc) {
+            goto err;
+        }
+    } else if (hostname && strncmp(hostname, VPCD_UNIX_PREFIX,
+                strlen(VPCD_UNIX_PREFIX)) == 0) {
+        ctx->path = strdup(hostname + strlen(VPCD_UNIX_PREFIX));
+        if (!ctx->path) {
+            goto err;
+        }
+        ctx->server_sock = opensock_unix(ctx->path);
+        if (ctx->server_sock == INVALID_SOCKET) {
+            goto err;
+        }
+    } else if (hostname) {
+        ctx->hostname = strdup(hostname);
+        if (!ctx->hostname) {
+            goto err;
+        }
+        ctx->client_sock = connectsock(ctx);
+        sockopts_apply(ctx, ctx->client_sock);
+        ctx->state.connected = ctx->client_sock != INVALID_SOCKET;
+    } else {
+        ctx->server_sock = opensock(port);
+        if (ctx->server_sock == INVALID_SOCKET) {
+            goto err;
+        }
+    }
+    r = ctx;
+
+err:
+    if (!r) {
+        vicc_exit(ctx);
+    }
+
+    return r;
+}
+
+struct vicc_ctx *vicc_mux_add(struct vicc_mux *mux, unsigned short slot)
+{
+    struct vicc_ctx *ctx;
+
+    if (!mux) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = ctx_new(0);
+    if (ctx && mux_register(mux, ctx, slot) != 0) {
+        vicc_exit(ctx);
+        ctx = NULL;
+    }
+
+    return ctx;
+}
+
+struct vicc_ctx *vicc_shard_add(struct vicc_shard *shard,
+        const char *identity, unsigned short offset)
+{
+    struct vicc_ctx *ctx;
+
+    if (!shard || !identity) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = ctx_new(0);
+    if (ctx && shard_register(shard, ctx, identity, offset) != 0) {
+        vicc_exit(ctx);
+        return NULL;
+    }
+    if (ctx) {
+        /* connect right away like a context for a remote vicc */
+        ctx->client_sock = connectsock(ctx);
+        sockopts_apply(ctx, ctx->client_sock);
+        ctx->state.connected = ctx->client_sock != INVALID_SOCKET;
+    }
+
+    return ctx;
+}
+
+int vicc_exit(struct vicc_ctx *ctx)
+{
+    struct vicc_ctx *trimmed[VICC_MAX_STANDBY];
+    unsigned int n;
+    int r;
+
+    if (ctx && ctx->reactor)
+        reactor_detach(ctx);
+
+    r = vicc_eject(ctx);
+    if (ctx) {
+        n = standby_trim(ctx, 0, trimmed);
+        while (n)
+            vicc_exit(trimmed[--n]);
+        if (ctx->mux)
+            mux_unregister(ctx);
+        if (ctx->shard)
+            shard_unregister(ctx);
+        free_lock(ctx->io_lock);
+        if (ctx->state_lock)
+            free_lock(ctx->state_lock);
+        if (ctx->stats_lock)
+            free_lock(ctx->stats_lock);
+        free(ctx->hostname);
+        if (ctx->addrs)
+            freeaddrinfo(ctx->addrs);
+        uring_free(ctx->uring);
+        free(ctx->deflate_buf);
+        free(ctx->fault);
+        if (ctx->server_sock != INVALID_SOCKET) {
+            ctx->server_sock = close(ctx->server_sock);
+            if (ctx->server_sock == INVALID_SOCKET) {
+                r = -1;
+            }
+            if (ctx->path && !ctx->mux)
+                unlink(ctx->path);
+        }
+        free(ctx->path);
+        shm_free(ctx->shm);
+        inproc_free(ctx->inproc);
+#ifndef _WIN32
+        if (ctx->event_pipe[0] >= 0)
+            close(ctx->event_pipe[0]);
+        if (ctx->event_pipe[1] >= 0)
+            close(ctx->event_pipe[1]);
+#endif
+        free(ctx);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    return r;
+}
+
+/* Returns the deadline of a call which may take timeout milliseconds, a
+ * negative timeout selects the one of the context */
+static long long deadline_in(struct vicc_ctx *ctx, long timeout)
+{
+    if (timeout < 0)
+        timeout = ctx->timeout;
+
+    return timeout ? now_ms() + timeout : 0;
+}
+
+/* Closes the lost connection to vicc, but keeps the card for resuming the
+ * session. Returns 0 if the session cannot be resumed. io_lock must be
+ * held. */
+static int suspend(struct vicc_ctx *ctx)
+{
+    if (!ctx->session_valid || ctx->shm || ctx->inproc || ctx->mux
+            || ctx->reactor
+            || (!ctx->hostname && ctx->server_sock == INVALID_SOCKET))
+        /* a standby cannot be connected to again */
+        return 0;
+    if (ctx->resume_until && now_ms() >= ctx->resume_until)
+        /* vicc did not come back in time */
+        return 0;
+
+    if (ctx->client_sock != INVALID_SOCKET) {
+        close(ctx->client_sock);
+        ctx->client_sock = INVALID_SOCKET;
+    }
+    uring_reset(ctx->uring);
+    ctx->features = 0;
+    ctx->handshake_pending = 1;
+    ctx->heartbeat_sent = 0;
+    ctx->heartbeat_missed = 0;
+    stats_rtt_reset(ctx);
+    if (!ctx->resume_until)
+        ctx->resume_until = now_ms() + ctx->resume_window;
+
+    return 1;
+}
+
+static void pause_ms(long long ms)
+{
+#ifdef _WIN32
+    Sleep((DWORD) ms);
+#else
+    poll(NULL, 0, (int) ms);
+#endif
+}
+
+/* Waits until deadline, at most until the end of the window for resuming,
+ * for vicc to come back and resumes the session. Returns 1 if the session has
+ * been resumed and 0 if vicc has not come back in time. If vicc has come back
+ * without the session, its card replaces the old one and -1 is returned.
+ * io_lock must be held. */
+static int resume(struct vicc_ctx *ctx, long long deadline)
+{
+    SOCKET sock;
+    long long left, call_deadline = ctx->deadline;
+    int r = 0, failed;
+
+    if (!deadline || deadline > ctx->resume_until)
+        deadline = ctx->resume_until;
+
+    do {
+        left = deadline - now_ms();
+        if (left < 0)
+            left = 0;
+        if (ctx->hostname) {
+            sock = connectsock(ctx);
+            if (sock == INVALID_SOCKET && left)
+                pause_ms(left < VPCD_RESUME_POLL_MS ?
+                        left : VPCD_RESUME_POLL_MS);
+        } else {
+            sock = waitforclient(ctx->server_sock, (long) (left / 1000),
+                    (long) (left % 1000) * 1000);
+        }
+        if (sock == INVALID_SOCKET)
+            continue;
+
+        sockopts_apply(ctx, sock);
+        ctx->client_sock = sock;
+        ctx->deadline = now_ms()
+            + (ctx->timeout ? ctx->timeout : VPCD_CONNECT_TIMEOUT_MS);
+        failed = handshake(ctx) < 0;
+        ctx->deadline = call_deadline;
+        if (failed) {
+            /* wait for the next connection */
+            if (ctx->client_sock != INVALID_SOCKET) {
+                close(ctx->client_sock);
+                ctx->client_sock = INVALID_SOCKET;
+            }
+            ctx->features = 0;
+            ctx->handshake_pending = 1;
+            ctx->legacy_peer = 0;
+            if (!ctx->resume_until)
+                /* ejected, since the window has passed meanwhile */
+                break;
+        } else {
+            r = ctx->session_resumed ? 1 : -1;
+        }
+    } while (!r && now_ms() < deadline);
+
+    if (r > 0) {
+        ctx->resume_until = 0;
+        stats_resume(ctx);
+    } else if (r < 0) {
+        ctx->resume_until = 0;
+        vicc_invalidate_atr(ctx);
+        event_connection(ctx, 0);
+        event_connection(ctx, 1);
+    }
+
+    return r;
+}
+
+/* Returns 1 while vicc is awaited for resuming the session */
+static int suspended(struct vicc_ctx *ctx)
+{
+    return ctx->resume_until && now_ms() < ctx->resume_until;
+}
+
+static ssize_t transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu, size_t rapdu_size, int realloc_rapdu,
+        long timeout)
+{
+    ssize_t r = -1;
+    unsigned short tag;
+    int error;
+    long long start = 0, sent_at = 0;
+    int connected = 0, resumed = 0, kept = 0;
+    SOCKET failed = INVALID_SOCKET;
+
+    if (ctx && ctx->reactor)
+        return reactor_transmit(ctx, apdu_len, apdu,
+                rapdu, rapdu_size, realloc_rapdu, deadline_in(ctx, timeout));
+
+    if (ctx && lock(ctx->io_lock)) {
+        start = now_us();
+        connected = ctx->state.connected;
+        ctx->deadline = deadline_in(ctx, timeout);
+        if (ctx->inproc) {
+            /* the card runs on this thread, so all of its time is spent
+             * waiting for the response */
+            sent_at = start;
+            capture_frame(ctx, CAPTURE_TO_VICC, 0, 0, apdu, apdu_len);
+            r = inproc_transmit(ctx->inproc, apdu_len, apdu, rapdu,
+                    rapdu_size, realloc_rapdu);
+            ctx->rx_header_us = now_us();
+            if (r > 0 && rapdu)
+                capture_frame(ctx, CAPTURE_FROM_VICC, 0, 0, *rapdu, r);
+        } else if (ctx->resume_until
+                && (resumed = resume(ctx, ctx->deadline)) <= 0) {
+            errno = resumed < 0 ? ECONNRESET : ETIMEDOUT;
+            r = -1;
+        } else if (ctx->handshake_pending && !ctx->legacy_peer
+                && (ctx->requested_features || ctx->features)
+                && handshake(ctx) < 0) {
+            r = -1;
+        } else {
+            tag = next_tag(ctx);
+
+            while (1) {
+                if (apdu_len && apdu)
+                    r = sendToVICC(ctx, apdu_len, apdu, tag, rapdu != NULL);
+                else
+                    r = 1;
+                sent_at = now_us();
+
+                if (r > 0 && rapdu)
+                    r = recvFromVICC(ctx, rapdu, rapdu_size, realloc_rapdu,
+                            tag);
+                if (r > 0 || (r < 0 && errno == ENOBUFS) || !suspend(ctx))
+                    break;
+
+                /* the command is sent again with the same tag, which vicc
+                 * answers with the response it may have given already */
+                resumed = resume(ctx, ctx->deadline);
+                if (resumed <= 0) {
+                    errno = resumed < 0 ? ECONNRESET : ETIMEDOUT;
+                    r = -1;
+                    break;
+                }
+            }
+        }
+        /* the card stays while vicc is awaited and a card which replaced it
+         * stays, too */
+        kept = suspended(ctx) || resumed < 0;
+
+        /* only a command with a response is measured, otherwise we are
+         * the card waiting for the next command */
+        if (r > 0 && rapdu && apdu_len && apdu)
+            stats_command(ctx, apdu_len, r, start, sent_at, ctx->rx_header_us,
+                    now_us());
+
+        ctx->deadline = 0;
+        failed = ctx->client_sock;
+        unlock(ctx->io_lock);
+    }
+
+    /* a response which is too big for the caller's buffer has been dropped,
+     * but the connection is still intact */
+    if (r <= 0 && !(r < 0 && errno == ENOBUFS)) {
+        error = r < 0 ? errno : ECONNRESET;
+        if (connected)
+            stats_failure(ctx, error);
+        if (!kept) {
+            if (connected)
+                stats_eject(ctx, error);
+            if (!failover(ctx, failed))
+                vicc_eject(ctx);
+        }
+        errno = r < 0 ? error : errno;
+    } else if (r < 0 && connected) {
+        stats_failure(ctx, ENOBUFS);
+    } else if (r > 0 && rapdu) {
+        state_touch(ctx);
+    }
+
+    event_dispatch(ctx);
+
+    return r;
+}
+
+ssize_t vicc_transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu)
+{
+    return transmit(ctx, apdu_len, apdu, rapdu, 0, 1, -1);
+}
+
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size)
+{
+    return transmit(ctx, apdu_len, apdu, rapdu ? &rapdu : NULL,
+            rapdu_size, 0, -1);
+}
+
+ssize_t vicc_transmit_timeout(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size, long secs, long usecs)
+{
+    return transmit(ctx, apdu_len, apdu, rapdu ? &rapdu : NULL,
+            rapdu_size, 0, secs * 1000 + usecs / 1000);
+}
+
+/* Returns 1 if the response completes a command successfully */
+static int batch_ok(const struct vicc_apdu *apdu)
+{
+    return apdu->rapdu_len >= 2
+        && apdu->rapdu[apdu->rapdu_len - 2] == 0x90
+        && apdu->rapdu[apdu->rapdu_len - 1] == 0x00;
+}
+
+/* Marks the commands which have not been sent */
+static void batch_cancel(struct vicc_apdu *apdus, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        apdus[i].rapdu_len = -1;
+        apdus[i].error = ECANCELED;
+    }
+}
+
+/* Transmits the commands of a batch one after the other. The reactor gets all
+ * commands at once unless it has to stop early. */
+static ssize_t batch_each(struct vicc_ctx *ctx, struct vicc_apdu *apdus,
+        size_t count, int flags)
+{
+    struct vicc_request **requests = NULL;
+    size_t i, answered = 0;
+    ssize_t r = -1;
+
+    if (ctx->reactor && !(flags & VICC_BATCH_STOP)) {
+        requests = calloc(count, sizeof *requests);
+        if (!requests)
+            return -1;
+        for (i = 0; i < count; i++) {
+            requests[i] = vicc_submit(ctx, apdus[i].apdu_len, apdus[i].apdu,
+                    apdus[i].rapdu, apdus[i].rapdu_size, NULL, NULL);
+            if (!requests[i])
+                break;
+        }
+        batch_cancel(apdus + i, count - i);
+        r = i == count ? 0 : -1;
+        for (i = 0; i < count && requests[i]; i++) {
+            apdus[i].rapdu_len = vicc_request_wait(requests[i]);
+            apdus[i].error = apdus[i].rapdu_len < 0 ? errno : 0;
+            if (apdus[i].rapdu_len < 0 && apdus[i].error != ENOBUFS)
+                r = -1;
+            else
+                answered++;
+            vicc_request_free(requests[i]);
+        }
+        free(requests);
+        return r < 0 ? -1 : (ssize_t) answered;
+    }
+
+    for (i = 0; i < count; i++) {
+        apdus[i].rapdu_len = vicc_transmit_into(ctx, apdus[i].apdu_len,
+                apdus[i].apdu, apdus[i].rapdu, apdus[i].rapdu_size);
+        apdus[i].error = apdus[i].rapdu_len < 0 ? errno : 0;
+        if (apdus[i].rapdu_len < 0 && apdus[i].error != ENOBUFS) {
+            batch_cancel(apdus + i + 1, count - i - 1);
+            errno = apdus[i].error;
+            return -1;
+        }
+        if ((flags & VICC_BATCH_STOP) && !batch_ok(&apdus[i])) {
+            batch_cancel(apdus + i + 1, count - i - 1);
+            return i + 1;
+        }
+    }
+
+    return count;
+}
+
+#ifndef _WIN32
+struct batch_frame {
+    unsigned char header[FRAME_MAX_HEADER_LEN];
+    unsigned short tag;
+    long long sent_at;
+};
+
+/* Waits until the socket is readable (returns 0) if read is set or writable
+ * (returns 1) if write is set */
+static int batch_wait(SOCKET sock, int read, int write, long long deadline)
+{
+    struct pollfd pfd;
+    long long left;
+    int r;
+
+    pfd.fd = sock;
+    pfd.events = (read ? POLLIN : 0) | (write ? POLLOUT : 0);
+    do {
+        left = deadline ? deadline - now_ms() : -1;
+        if (deadline && left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        pfd.revents = 0;
+        r = poll(&pfd, 1, left > INT_MAX ? INT_MAX : (int) left);
+        if (r < 0 && errno != EINTR)
+            return -1;
+    } while (r <= 0);
+
+    /* receive first, vicc may be waiting for us to make room */
+    return read && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) ? 0 : 1;
+}
+
+/* Writes the frames of all commands while receiving their responses, so that
+ * neither side blocks on a full socket buffer. Once stopped, no further
+ * command is sent, but the responses of those sent already are received. */
+static ssize_t batch_pipelined(struct vicc_ctx *ctx, struct vicc_apdu *apdus,
+        size_t count, int flags)
+{
+    struct batch_frame *frames;
+    struct iovec *iov;
+    struct msghdr msg;
+    size_t i, next_iov = 0, end_iov = 2 * count, received = 0;
+    unsigned char *rapdu;
+    int partial = 0, error = 0;
+    ssize_t r;
+
+    frames = malloc(count * sizeof *frames);
+    iov = malloc(end_iov * sizeof *iov);
+    if (!frames || !iov) {
+        free(frames);
+        free(iov);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        frames[i].tag = next_tag(ctx);
+        iov[2 * i].iov_base = (void *) frames[i].header;
+        iov[2 * i].iov_len = frame_encode_header(ctx->features,
+                frames[i].header, apdus[i].apdu_len, 0, frames[i].tag);
+        iov[2 * i + 1].iov_base = (void *) apdus[i].apdu;
+        iov[2 * i + 1].iov_len = apdus[i].apdu_len;
+    }
+
+    while (received < end_iov / 2) {
+        /* a batch which may stop early looks at the responses as soon as
+         * they arrive */
+        if (next_iov < end_iov && !((flags & VICC_BATCH_STOP)
+                    && received < next_iov / 2
+                    && readable(ctx->client_sock))) {
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov + next_iov;
+            msg.msg_iovlen = end_iov - next_iov < VPCD_BATCH_IOV
+                ? end_iov - next_iov : VPCD_BATCH_IOV;
+            r = sendmsg(ctx->client_sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                    && errno != EINTR) {
+                error = errno;
+                break;
+            }
+            if (r > 0) {
+                /* skip what has been sent completely */
+                partial = 0;
+                while (next_iov < end_iov
+                        && (size_t) r >= iov[next_iov].iov_len) {
+                    r -= iov[next_iov].iov_len;
+                    if (next_iov % 2) {
+                        i = next_iov / 2;
+                        frames[i].sent_at = now_us();
+                        capture_frame(ctx, CAPTURE_TO_VICC, 0, frames[i].tag,
+                                apdus[i].apdu, apdus[i].apdu_len);
+                    }
+                    next_iov++;
+                }
+                if (r > 0) {
+                    iov[next_iov].iov_base =
+                        (unsigned char *) iov[next_iov].iov_base + r;
+                    iov[next_iov].iov_len -= r;
+                    partial = 1;
+                }
+                continue;
+            }
+        }
+
+        /* the response of a command can only arrive once it has been sent
+         * completely */
+        r = received < next_iov / 2 ? 0 : 1;
+        if (next_iov < end_iov) {
+            r = batch_wait(ctx->client_sock, received < next_iov / 2, 1,
+                    ctx->deadline);
+            if (r < 0) {
+                error = errno;
+                break;
+            }
+        }
+        if (r)
+            continue;
+
+        rapdu = apdus[received].rapdu;
+        r = recvFromVICC(ctx, &rapdu, apdus[received].rapdu_size, 0,
+                frames[received].tag);
+        if (r <= 0 && !(r < 0 && errno == ENOBUFS)) {
+            error = r < 0 ? errno : ECONNRESET;
+            break;
+        }
+        apdus[received].rapdu_len = r;
+        apdus[received].error = r < 0 ? errno : 0;
+        if (r > 0)
+            stats_command(ctx, apdus[received].apdu_len, r,
+                    frames[received].sent_at, frames[received].sent_at,
+                    ctx->rx_header_us, now_us());
+
+        if ((flags & VICC_BATCH_STOP) && !batch_ok(&apdus[received])
+                && end_iov == 2 * count) {
+            /* finish the frame which is being sent to stay in sync */
+            end_iov = next_iov % 2 || partial ? next_iov / 2 * 2 + 2
+                : next_iov;
+        }
+        received++;
+    }
+
+    batch_cancel(apdus + received, count - received);
+    free(frames);
+    free(iov);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    return (ssize_t) received;
+}
+#endif
+
+ssize_t vicc_transmit_batch(struct vicc_ctx *ctx, struct vicc_apdu *apdus,
+        size_t count, int flags)
+{
+    ssize_t r = -1;
+    size_t i;
+    int connected = 0, kept = 0, error;
+    SOCKET failed;
+
+    if (!ctx || (count && !apdus)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (!apdus[i].apdu || !apdus[i].apdu_len || !apdus[i].rapdu) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (!count)
+        return 0;
+
+#ifndef _WIN32
+    if (!ctx->reactor && !ctx->shm && !ctx->inproc && lock(ctx->io_lock)) {
+        if (ctx->client_sock != INVALID_SOCKET && !ctx->fault) {
+            connected = ctx->state.connected;
+            ctx->deadline = deadline_in(ctx, -1);
+            if (ctx->handshake_pending && !ctx->legacy_peer
+                    && (ctx->requested_features || ctx->features)
+                    && handshake(ctx) < 0) {
+                r = -1;
+            } else {
+                for (i = 0; i < count
+                        && apdus[i].apdu_len <= frame_max_len(ctx->features);
+                        i++)
+                    ;
+                if (i < count) {
+                    batch_cancel(apdus, count);
+                    errno = EINVAL;
+                    ctx->deadline = 0;
+                    unlock(ctx->io_lock);
+                    return -1;
+                }
+                r = batch_pipelined(ctx, apdus, count, flags);
+            }
+            if (r < 0) {
+                /* the commands which are not answered are not sent again,
+                 * but the session may still be resumed */
+                error = errno;
+                kept = suspend(ctx);
+                errno = error;
+            }
+            ctx->deadline = 0;
+            failed = ctx->client_sock;
+            unlock(ctx->io_lock);
+
+            if (r < 0) {
+                error = errno;
+                if (connected)
+                    stats_failure(ctx, error);
+                if (!kept) {
+                    if (connected)
+                        stats_eject(ctx, error);
+                    if (!failover(ctx, failed))
+                        vicc_eject(ctx);
+                }
+                errno = error;
+            } else {
+                state_touch(ctx);
+            }
+            event_dispatch(ctx);
+
+            return r;
+        }
+        unlock(ctx->io_lock);
+    }
+#endif
+
+    return batch_each(ctx, apdus, count, flags);
+}
+
+void vicc_set_timeout(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    if (ctx)
+        ctx->timeout = secs * 1000 + usecs / 1000;
+}
+
+int vicc_set_failover(struct vicc_ctx *ctx, int policy, unsigned int standbys)
+{
+    struct vicc_ctx *trimmed[VICC_MAX_STANDBY];
+    unsigned int n;
+
+    if (!ctx || standbys > VICC_MAX_STANDBY
+            || (policy != VICC_FAILOVER_OFF
+                && policy != VICC_FAILOVER_REINSERT
+                && policy != VICC_FAILOVER_TRANSPARENT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (policy == VICC_FAILOVER_OFF)
+        standbys = 0;
+
+    if (!lock(ctx->state_lock))
+        return -1;
+    ctx->failover = policy;
+    ctx->standby_max = standbys;
+    unlock(ctx->state_lock);
+
+    n = standby_trim(ctx, standbys, trimmed);
+    while (n)
+        vicc_exit(trimmed[--n]);
+
+    return 0;
+}
+
+struct vicc_request *vicc_submit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size,
+        vicc_callback callback, void *user_data)
+{
+    struct vicc_request *req;
+
+    if (!ctx || !apdu || !apdu_len) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    req = calloc(1, sizeof *req);
+    if (!req)
+        return NULL;
+    req->apdu = apdu;
+    req->apdu_len = apdu_len;
+    req->buffer = rapdu;
+    req->rapdu = rapdu ? &req->buffer : NULL;
+    req->rapdu_size = rapdu_size;
+    req->callback = callback;
+    req->user_data = user_data;
+
+    if (ctx->reactor) {
+        if (reactor_submit(ctx, req) < 0) {
+            free(req);
+            return NULL;
+        }
+    } else {
+        req->result = transmit(ctx, apdu_len, apdu, req->rapdu, rapdu_size, 0,
+                -1);
+        req->error = errno;
+        req->done = 1;
+        if (callback)
+            callback(req, user_data);
+    }
+
+    return req;
+}
+
+int vicc_request_done(struct vicc_request *request)
+{
+    if (!request)
+        return 1;
+    if (request->reactor)
+        return reactor_done(request);
+    return request->done;
+}
+
+ssize_t vicc_request_wait(struct vicc_request *request)
+{
+    if (!request) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (request->reactor)
+        reactor_wait(request);
+    errno = request->error;
+    return request->result;
+}
 
-    if (ctx && lock(ctx->io_lock)) {
-        r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
+void vicc_request_free(struct vicc_request *request)
+{
+    if (request && request->reactor)
+        reactor_wait(request);
+    free(request);
+}
+
+int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    int attached, r;
+
+    if (!ctx)
+        return 0;
+
+    if (ctx->reactor)
+        return reactor_connect(ctx, secs, usecs);
+
+    if (ctx->inproc) {
+        r = inproc_accept(ctx->inproc, &attached);
+        if (attached)
+            event_connection(ctx, 1);
+        return r;
+    }
+
+    if (ctx->shm) {
+        r = shm_accept(ctx->shm, secs, usecs, &attached);
+        if (attached < 0) {
+            ctx->features = 0;
+            event_connection(ctx, 0);
+        }
+        if (r && attached > 0) {
+            ctx->handshake_pending = 1;
+            event_connection(ctx, 1);
+        }
+        return r;
+    }
+
+    if (ctx->client_sock == INVALID_SOCKET && ctx->resume_until) {
+        /* the card stays until the session is resumed or the window has
+         * passed. A command being processed resumes the session by itself. */
+        if (!trylock(ctx->io_lock))
+            return 1;
+        r = 1;
+        if (ctx->client_sock == INVALID_SOCKET && ctx->resume_until)
+            r = resume(ctx, now_ms() + secs * 1000 + usecs / 1000) != 0
+                || suspended(ctx);
         unlock(ctx->io_lock);
+        if (r)
+            return 1;
+        vicc_eject(ctx);
+    }
+
+    if (ctx->client_sock == INVALID_SOCKET && failover(ctx, INVALID_SOCKET))
+        return 1;
+
+    if (ctx->client_sock != INVALID_SOCKET)
+        standby_fill(ctx);
+
+    if (ctx->client_sock == INVALID_SOCKET) {
+        if(!ctx->hostname) {
+            /* server mode, try to accept a client */
+            ctx->client_sock = ctx->mux ? mux_accept(ctx, secs, usecs)
+                : waitforclient(ctx->server_sock, secs, usecs);
+        } else {
+            /* client mode, try to connect (again) */
+            ctx->client_sock = connectsock(ctx);
+        }
+        sockopts_apply(ctx, ctx->client_sock);
+        ctx->handshake_pending = 1;
+        if (ctx->client_sock != INVALID_SOCKET)
+            event_connection(ctx, 1);
+    }
+
+    if (ctx->client_sock == INVALID_SOCKET)
+        /* not connected */
+        return 0;
+    else
+        return 1;
+}
+
+/* Returns 1 if the socket is readable without blocking */
+static int readable(SOCKET sock)
+{
+#ifdef _WIN32
+    fd_set rfds;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+#pragma warning(disable:4127)
+    FD_SET(sock, &rfds);
+#pragma warning(default:4127)
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    return select((int) sock + 1, &rfds, NULL, NULL, &tv) > 0;
+#else
+    /* select() cannot take the descriptors above FD_SETSIZE, which pcscd
+     * reaches with many clients */
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+/* Sends a heartbeat if nothing has been received for an interval. Returns 0
+ * if vicc has left the previous heartbeat unanswered for too long or if the
+ * connection has failed. */
+static int heartbeat(struct vicc_ctx *ctx)
+{
+    struct vicc_state state;
+    unsigned char header[FRAME_MAX_HEADER_LEN];
+    struct iovec iov;
+    long long now = now_us(), interval = ctx->heartbeat_interval * 1000LL;
+    unsigned int missed;
+    ssize_t r;
+
+    if (ctx->heartbeat_sent) {
+        /* TCP keeps retransmitting the heartbeat, so it is not sent again */
+        missed = (unsigned int) ((now - ctx->heartbeat_sent) / interval);
+        while (ctx->heartbeat_missed < missed) {
+            ctx->heartbeat_missed++;
+            stats_heartbeat(ctx, 1);
+        }
+        if (missed >= ctx->heartbeat_misses) {
+            stats_eject(ctx, ETIMEDOUT);
+            return 0;
+        }
+        return 1;
+    }
+
+    read_state(ctx, &state, NULL);
+    if (state.last_activity && now / 1000 - state.last_activity
+            < ctx->heartbeat_interval)
+        return 1;
+
+    ctx->heartbeat_tag = next_tag(ctx);
+    iov.iov_base = (void *) header;
+    iov.iov_len = frame_encode_header(ctx->features, header, 0,
+            FRAME_FLAG_HEARTBEAT, ctx->heartbeat_tag);
+    /* the header fits into any buffer of an idle connection, but sending it
+     * must not take longer than an interval */
+    if (ctx->shm)
+        r = shm_send(ctx->shm, iov.iov_base, iov.iov_len,
+                now / 1000 + ctx->heartbeat_interval);
+    else
+        r = sendallv(ctx->client_sock, &iov, 1,
+                now / 1000 + ctx->heartbeat_interval);
+    if (r < 0)
+        return 0;
+    capture_frame(ctx, CAPTURE_TO_VICC, FRAME_FLAG_HEARTBEAT,
+            ctx->heartbeat_tag, NULL, 0);
+
+    ctx->heartbeat_sent = now;
+    ctx->heartbeat_missed = 0;
+    stats_heartbeat(ctx, 0);
+
+    return 1;
+}
+
+/* Receive the events and heartbeats which vicc has sent while no request was
+ * pending and send a heartbeat if it is due. Returns 0 if the vicc has closed
+ * the connection. */
+static int poll_vicc(struct vicc_ctx *ctx)
+{
+    int r = 1;
+    unsigned char header[FRAME_MAX_HEADER_LEN], flags;
+    unsigned short tag;
+    size_t header_len, size;
+    ssize_t received;
+    int pass;
+    SOCKET failed;
+
+    /* the reactor receives everything by itself and a card in this process
+     * does not send anything on its own */
+    if (ctx->reactor || ctx->inproc)
+        return 1;
+
+    /* a command is being processed, which receives the events by itself */
+    if (!trylock(ctx->io_lock))
+        return -1;
+
+    if (!ctx->shm && ctx->client_sock == INVALID_SOCKET) {
+        r = suspended(ctx);
+    } else if (!(ctx->features
+                & (VPCD_FEATURE_EVENTS|VPCD_FEATURE_HEARTBEAT))) {
+        /* a closed connection is readable, but yields no data. vicc
+         * must not send anything on its own. */
+        if (!ctx->shm && readable(ctx->client_sock))
+            r = 0;
+    } else {
+        /* a partial event must not block the caller either. The answer
+         * to a heartbeat sent in the first pass is received in the
+         * second if it is already there, otherwise with the next poll,
+         * so that io_lock is not held while waiting for it. */
+        ctx->deadline = deadline_in(ctx, -1);
+        for (pass = 0; r && pass < 2; pass++) {
+            while (r && (ctx->shm ? shm_pending(ctx->shm) > 0
+                        : uring_pending(ctx->uring) > 0
+                        || readable(ctx->client_sock))) {
+                header_len = frame_header_len(ctx->features);
+                if (recvFrom(ctx, header, header_len)
+                        < (ssize_t) header_len) {
+                    r = 0;
+                    break;
+                }
+                frame_decode_header(ctx->features, header, &size, &flags,
+                        &tag);
+                if ((flags & FRAME_FLAG_EVENT)
+                        && (ctx->features & VPCD_FEATURE_EVENTS))
+                    received = recvEvent(ctx, size);
+                else if ((flags & FRAME_FLAG_HEARTBEAT)
+                        && (ctx->features & VPCD_FEATURE_HEARTBEAT))
+                    received = recvHeartbeat(ctx, tag, size);
+                else
+                    received = 0;
+                if (received <= 0)
+                    r = 0;
+            }
+            if (!r || pass || !(ctx->features & VPCD_FEATURE_HEARTBEAT))
+                break;
+            r = heartbeat(ctx);
+        }
+        ctx->deadline = 0;
+    }
+    /* a lost connection may come back */
+    if (!r && suspend(ctx))
+        r = 1;
+    failed = ctx->client_sock;
+    unlock(ctx->io_lock);
+
+    if (!r) {
+        r = failover(ctx, failed);
+        if (!r)
+            vicc_eject(ctx);
     }
 
     return r;
 }
 
-int vicc_poweroff(struct vicc_ctx *ctx) {
-    unsigned char i = VPCD_CTRL_OFF;
-    int r = 0;
+/* Returns 0 if vicc has closed the connection */
+static int alive(SOCKET sock)
+{
+    char c;
 
-    if (ctx && lock(ctx->io_lock)) {
-        r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
+    if (!readable(sock))
+        return 1;
+
+    return recv(sock, &c, 1, MSG_PEEK) > 0;
+}
+
+/* Removes the oldest standby from the pool. The pool is guarded by the state
+ * lock, since it is changed without doing any I/O. */
+static struct vicc_ctx *standby_pop(struct vicc_ctx *ctx)
+{
+    struct vicc_ctx *standby = NULL;
+
+    lock(ctx->state_lock);
+    if (ctx->standby_len) {
+        standby = ctx->standby[0];
+        ctx->standby_len--;
+        memmove(ctx->standby, ctx->standby + 1,
+                ctx->standby_len * sizeof *ctx->standby);
+    }
+    unlock(ctx->state_lock);
+
+    return standby;
+}
+
+/* Removes the newest standbys from the pool until at most \a keep are left
+ * and stores them in \a trimmed. The caller frees them with vicc_exit() after
+ * the state lock is released, since closing them does I/O. Returns the number
+ * of standbys removed. */
+static unsigned int standby_trim(struct vicc_ctx *ctx, unsigned int keep,
+        struct vicc_ctx **trimmed)
+{
+    unsigned int n = 0;
+
+    if (!lock(ctx->state_lock))
+        return 0;
+    while (ctx->standby_len > keep)
+        trimmed[n++] = ctx->standby[--ctx->standby_len];
+    unlock(ctx->state_lock);
+
+    return n;
+}
+
+/* Accepts a further vicc as standby and fetches its ATR */
+static void standby_fill(struct vicc_ctx *ctx)
+{
+    struct vicc_ctx *standby, *dead[VICC_MAX_STANDBY];
+    unsigned char *atr = NULL;
+    unsigned int i, n = 0;
+    SOCKET sock;
+    int full;
+
+    if (ctx->hostname || ctx->shm || ctx->inproc || ctx->mux || ctx->reactor
+            || ctx->server_sock == INVALID_SOCKET)
+        return;
+
+    /* forget about the standbys which have gone away */
+    lock(ctx->state_lock);
+    for (i = 0; i < ctx->standby_len;) {
+        if (alive(ctx->standby[i]->client_sock)) {
+            i++;
+        } else {
+            dead[n++] = ctx->standby[i];
+            ctx->standby_len--;
+            memmove(ctx->standby + i, ctx->standby + i + 1,
+                    (ctx->standby_len - i) * sizeof *ctx->standby);
+        }
+    }
+    full = ctx->standby_len >= ctx->standby_max;
+    unlock(ctx->state_lock);
+    while (n)
+        vicc_exit(dead[--n]);
+    if (full)
+        return;
+
+    sock = waitforclient(ctx->server_sock, 0, 0);
+    if (sock == INVALID_SOCKET)
+        return;
+
+    standby = ctx_new(ctx->port);
+    if (!standby) {
+        close(sock);
+        return;
+    }
+    sockopts_apply(ctx, sock);
+    standby->client_sock = sock;
+    standby->sockopts = ctx->sockopts;
+    /* what a standby receives in advance would be lost with its promotion */
+    standby->sockopts.uring = 0;
+    standby->requested_features = ctx->requested_features;
+    standby->deflate_threshold = ctx->deflate_threshold;
+    standby->heartbeat_interval = ctx->heartbeat_interval;
+    standby->heartbeat_misses = ctx->heartbeat_misses;
+    standby->resume_window = ctx->resume_window;
+    standby->legacy_peer = ctx->legacy_peer;
+    standby->handshake_pending = 1;
+    standby->timeout = ctx->timeout ? ctx->timeout : VPCD_STANDBY_TIMEOUT_MS;
+    standby->state.connected = 1;
+
+    /* the ATR is fetched now, so that it is known right after the failover */
+    if (vicc_getatr(standby, &atr) > 0) {
+        lock(ctx->state_lock);
+        if (ctx->standby_len < ctx->standby_max) {
+            ctx->standby[ctx->standby_len++] = standby;
+            standby = NULL;
+        }
+        unlock(ctx->state_lock);
+    }
+    free(atr);
+    vicc_exit(standby);
+}
+
+/* Replaces the failed (or missing) connection \a failed to vicc by the oldest
+ * standby which is still alive. The connection is only replaced if it has not
+ * been replaced by another thread already, so that a failure seen by several
+ * threads promotes a single standby. Returns 1 if vicc is connected again. */
+static int failover(struct vicc_ctx *ctx, SOCKET failed)
+{
+    struct vicc_ctx *standby = NULL, *dead[VICC_MAX_STANDBY];
+    struct vicc_state old, state;
+    unsigned int n = 0;
+    int policy, transparent, changed;
+
+    if (!ctx || !lock(ctx->state_lock))
+        return 0;
+    policy = ctx->failover;
+    standby = ctx->standby_len ? ctx->standby[0] : NULL;
+    unlock(ctx->state_lock);
+    if (!standby)
+        return 0;
+
+    if (!lock(ctx->io_lock))
+        return 0;
+    if (ctx->client_sock != INVALID_SOCKET && ctx->client_sock != failed) {
+        /* another thread has already connected vicc again */
         unlock(ctx->io_lock);
+        return 1;
+    }
+    while ((standby = standby_pop(ctx)) && !alive(standby->client_sock))
+        dead[n++] = standby;
+    if (standby) {
+        read_state(ctx, &old, NULL);
+        read_state(standby, &state, NULL);
+        if (ctx->client_sock != INVALID_SOCKET)
+            close(ctx->client_sock);
+        ctx->client_sock = standby->client_sock;
+        standby->client_sock = INVALID_SOCKET;
+        uring_reset(ctx->uring);
+        ctx->features = standby->features;
+        ctx->legacy_peer = standby->legacy_peer;
+        ctx->handshake_pending = standby->handshake_pending;
+        ctx->tag = standby->tag;
+        ctx->heartbeat_sent = 0;
+        ctx->heartbeat_missed = 0;
+        stats_rtt_reset(ctx);
+        memcpy(ctx->session, standby->session, sizeof ctx->session);
+        ctx->session_valid = standby->session_valid;
+        ctx->resume_until = 0;
+    }
+    unlock(ctx->io_lock);
+    while (n)
+        vicc_exit(dead[--n]);
+    if (!standby)
+        return 0;
+    vicc_exit(standby);
+
+    transparent = policy == VICC_FAILOVER_TRANSPARENT && old.connected;
+    if (!transparent) {
+        if (old.connected)
+            event_connection(ctx, 0);
+        event_connection(ctx, 1);
+    }
+
+    state_begin(ctx);
+    changed = old.atr_len && (old.atr_len != state.atr_len
+            || memcmp(old.atr, state.atr, state.atr_len) != 0);
+    memcpy(ctx->state.atr, state.atr, state.atr_len);
+    ctx->state.atr_len = state.atr_len;
+    ctx->atr_epoch++;
+    ctx->state.card_removed = state.card_removed;
+    ctx->state.powered = 0;
+    ctx->state.last_activity = state.last_activity;
+    state_end(ctx);
+
+    if (old.connected)
+        stats_failover(ctx);
+    if (transparent) {
+        if (changed)
+            event_post(ctx, VPCD_EVENT_ATR_CHANGED);
+        /* the application expects the card to be still powered */
+        if (old.powered)
+            vicc_poweron(ctx);
     }
 
+    return 1;
+}
+
+int vicc_present(struct vicc_ctx *ctx) {
+    struct vicc_state state;
+    unsigned char *atr = NULL;
+    int r = 0, polled;
+
+    if (!vicc_connect(ctx, 0, 0))
+        goto err;
+    polled = poll_vicc(ctx);
+    if (!polled)
+        goto err;
+
+    vicc_get_state(ctx, &state);
+    if (state.card_removed)
+        goto err;
+
+    /* get the atr to check if the card is still alive unless it is known or
+     * vicc is busy processing a command */
+    if (state.atr_len || polled < 0 || vicc_getatr(ctx, &atr) > 0)
+        r = 1;
+
+    free(atr);
+
+err:
+    event_dispatch(ctx);
+
     return r;
 }
 
-int vicc_reset(struct vicc_ctx *ctx) {
-    unsigned char i = VPCD_CTRL_RESET;
-    int r = 0;
+void event_post(struct vicc_ctx *ctx, int event)
+{
+#ifndef _WIN32
+    unsigned char c = (unsigned char) event;
 
-    if (ctx && lock(ctx->io_lock)) {
-        r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
-        unlock(ctx->io_lock);
+    if (ctx->event_pipe[1] >= 0 && write(ctx->event_pipe[1], &c, 1) != 1) {
+        /* nobody has fetched the events for a while, drop this one */
+    }
+#endif
+}
+
+/* Returns the next queued event, 0 for an interruption or -1 if there is
+ * none */
+static int event_next(struct vicc_ctx *ctx)
+{
+#ifndef _WIN32
+    unsigned char c;
+
+    if (ctx->event_pipe[0] >= 0 && read(ctx->event_pipe[0], &c, 1) == 1)
+        return c;
+#endif
+
+    return -1;
+}
+
+void event_handle(struct vicc_ctx *ctx, const unsigned char *body,
+        size_t len)
+{
+    switch (body[0]) {
+        case VPCD_EVENT_INSERTED:
+        case VPCD_EVENT_REMOVED:
+        case VPCD_EVENT_ATR_CHANGED:
+            break;
+        default:
+            /* ignore events of future versions */
+            return;
+    }
+
+    state_begin(ctx);
+    if (body[0] != VPCD_EVENT_ATR_CHANGED)
+        ctx->state.card_removed = body[0] == VPCD_EVENT_REMOVED;
+    ctx->state.atr_len = 0;
+    ctx->atr_epoch++;
+    /* vicc may tell us the new ATR right away */
+    if (body[0] != VPCD_EVENT_REMOVED && len > 1
+            && len - 1 <= sizeof ctx->state.atr) {
+        memcpy(ctx->state.atr, body + 1, len - 1);
+        ctx->state.atr_len = len - 1;
+    }
+    ctx->state.last_activity = now_ms();
+    state_end(ctx);
+
+    event_post(ctx, body[0]);
+}
+
+void event_connection(struct vicc_ctx *ctx, int connected)
+{
+    unsigned char event = connected ? VPCD_EVENT_INSERTED : VPCD_EVENT_REMOVED;
+
+    state_begin(ctx);
+    ctx->state.connected = connected;
+    ctx->state.powered = 0;
+    state_end(ctx);
+    if (connected)
+        stats_connect(ctx);
+    else if (ctx->mux)
+        mux_release(ctx);
+
+    event_handle(ctx, &event, sizeof event);
+}
+
+void event_dispatch(struct vicc_ctx *ctx)
+{
+    vicc_event_callback callback;
+    int event;
+
+    if (!ctx || !ctx->event_callback)
+        return;
+
+    while ((event = event_next(ctx)) >= 0) {
+        callback = ctx->event_callback;
+        if (event && event != MUX_EVENT_ROUTED && callback)
+            callback(ctx, event, ctx->event_user_data);
+    }
+}
+
+void vicc_set_event_callback(struct vicc_ctx *ctx,
+        vicc_event_callback callback, void *user_data)
+{
+    if (!ctx)
+        return;
+
+    ctx->event_user_data = user_data;
+    ctx->event_callback = callback;
+}
+
+int vicc_event_fd(struct vicc_ctx *ctx)
+{
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef _WIN32
+    errno = ENOSYS;
+    return -1;
+#else
+    return ctx->event_pipe[0];
+#endif
+}
+
+void vicc_interrupt_wait(struct vicc_ctx *ctx)
+{
+    if (ctx)
+        event_post(ctx, 0);
+}
+
+static long long now_ms(void)
+{
+#ifdef _WIN32
+    return (long long) GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+int vicc_wait_event(struct vicc_ctx *ctx, long secs, long usecs)
+{
+#ifdef _WIN32
+    errno = ENOSYS;
+    return -1;
+#else
+    struct pollfd pfd[2];
+    long long deadline, left;
+    int event, n, busy = 0;
+
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    deadline = now_ms() + secs * 1000 + usecs / 1000;
+    while (1) {
+        event = event_next(ctx);
+        if (event == MUX_EVENT_ROUTED) {
+            /* another slot has accepted vicc for us */
+            vicc_connect(ctx, 0, 0);
+            continue;
+        }
+        if (event >= 0)
+            return event;
+        left = deadline - now_ms();
+        if (left <= 0)
+            return 0;
+
+        pfd[0].fd = ctx->event_pipe[0];
+        pfd[0].events = POLLIN;
+        n = 1;
+        if (!ctx->reactor && !ctx->shm && !ctx->inproc && !busy) {
+            /* wait for vicc to connect or to send something. While a command
+             * is processed, its response is received by the transmitting
+             * thread. */
+            pfd[1].fd = ctx->client_sock != INVALID_SOCKET ?
+                ctx->client_sock : ctx->server_sock;
+            pfd[1].events = POLLIN;
+            if (pfd[1].fd != INVALID_SOCKET)
+                n++;
+        }
+        if (!ctx->reactor && n == 1 && left > VPCD_EVENT_POLL_MS)
+            /* nothing to poll, check for vicc from time to time */
+            left = VPCD_EVENT_POLL_MS;
+        if ((ctx->features & VPCD_FEATURE_HEARTBEAT)
+                && left > ctx->heartbeat_interval)
+            /* wake up for sending the next heartbeat */
+            left = ctx->heartbeat_interval;
+        if (ctx->resume_until && left > ctx->resume_until - now_ms())
+            /* wake up for giving up on resuming the session */
+            left = ctx->resume_until > now_ms() ?
+                ctx->resume_until - now_ms() : 0;
+        if (uring_pending(ctx->uring))
+            /* an event has been received along with a response */
+            left = 0;
+
+        if (poll(pfd, n, (int) left) < 0 && errno != EINTR)
+            return -1;
+
+        busy = 0;
+        if (!ctx->reactor && vicc_connect(ctx, 0, 0))
+            busy = poll_vicc(ctx) < 0;
+    }
+#endif
+}
+
+void vicc_invalidate_atr(struct vicc_ctx *ctx)
+{
+    if (ctx && ctx->state_lock) {
+        state_begin(ctx);
+        ctx->state.atr_len = 0;
+        ctx->atr_epoch++;
+        state_end(ctx);
+    }
+}
+
+ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char **atr) {
+    unsigned char i = VPCD_CTRL_ATR;
+    struct vicc_state state;
+    unsigned char *p;
+    unsigned int epoch;
+    ssize_t r;
+
+    if (!ctx || !atr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    read_state(ctx, &state, &epoch);
+    if (state.atr_len) {
+        p = realloc(*atr, state.atr_len);
+        if (!p)
+            return -1;
+        memcpy(p, state.atr, state.atr_len);
+        *atr = p;
+        return state.atr_len;
+    }
+
+    r = vicc_transmit(ctx, VPCD_CTRL_LEN, &i, atr);
+
+    /* don't cache an ATR which has been invalidated in the meantime */
+    if (r > 0 && (size_t) r <= sizeof ctx->state.atr) {
+        state_begin(ctx);
+        if (epoch == ctx->atr_epoch) {
+            memcpy(ctx->state.atr, *atr, r);
+            ctx->state.atr_len = r;
+        }
+        state_end(ctx);
+    }
+
+    return r;
+}
+
+static int power(struct vicc_ctx *ctx, unsigned char ctrl)
+{
+    int r;
+
+    vicc_invalidate_atr(ctx);
+    r = transmit(ctx, VPCD_CTRL_LEN, &ctrl, NULL, 0, 0, -1);
+    if (r > 0) {
+        state_begin(ctx);
+        ctx->state.powered = ctrl != VPCD_CTRL_OFF;
+        state_end(ctx);
     }
 
     return r;
 }
+
+int vicc_poweron(struct vicc_ctx *ctx) {
+    return power(ctx, VPCD_CTRL_ON);
+}
+
+int vicc_poweroff(struct vicc_ctx *ctx) {
+    return power(ctx, VPCD_CTRL_OFF);
+}
+
+int vicc_reset(struct vicc_ctx *ctx) {
+    return power(ctx, VPCD_CTRL_RESET);
+}
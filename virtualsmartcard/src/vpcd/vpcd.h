@@ -41,13 +41,306 @@ typedef int ssize_t;
 #define VPCD_CTRL_ON    1
 #define VPCD_CTRL_RESET 2
 #define VPCD_CTRL_ATR	4
+#define VPCD_CTRL_HELLO 8
+
+/** Highest version of the protocol supported by libvpcd */
+#define VPCD_PROTOCOL_VERSION 2
+
+/** Frames carry a tag, which allows several requests to be in flight */
+#define VPCD_FEATURE_TAGGED 0x00000001
+/** Frames are preceded by a 32 bit length (since version 2) */
+#define VPCD_FEATURE_LEN32  0x00000002
+/** vicc may send events on its own (requires \c VPCD_FEATURE_TAGGED) */
+#define VPCD_FEATURE_EVENTS 0x00000004
+/** Large frames may be compressed with zlib (requires \c VPCD_FEATURE_TAGGED
+ * and libvpcd built with zlib) */
+#define VPCD_FEATURE_DEFLATE 0x00000008
+/** vpcd checks idle connections with heartbeats, which vicc answers right away
+ * (requires \c VPCD_FEATURE_TAGGED) */
+#define VPCD_FEATURE_HEARTBEAT 0x00000010
+/** A session survives a lost connection: vicc keeps the card's state and
+ * answers a command sent again with the response it already gave (requires
+ * \c VPCD_FEATURE_TAGGED) */
+#define VPCD_FEATURE_RESUME 0x00000020
+
+/** Features requested from a newly initialized context */
+#define VPCD_FEATURES_DEFAULT VPCD_FEATURE_LEN32
+
+/** A card has been inserted or vicc has connected */
+#define VPCD_EVENT_INSERTED    1
+/** The card has been removed or vicc has disconnected */
+#define VPCD_EVENT_REMOVED     2
+/** The card has been replaced by one with a different ATR */
+#define VPCD_EVENT_ATR_CHANGED 3
+
+struct vicc_capture;
+struct vicc_fault;
+struct vicc_inproc;
+struct vicc_mux;
+struct vicc_reactor;
+struct vicc_request;
+struct vicc_shard;
+struct vicc_shm;
+
+/** Options applied to each socket connected to vicc */
+struct vicc_sockopts {
+        /** Disable Nagle's algorithm (\c TCP_NODELAY), enabled by default */
+        int nodelay;
+        /** Acknowledge received data immediately (\c TCP_QUICKACK, Linux) */
+        int quickack;
+        /** Microseconds to busy poll for data (\c SO_BUSY_POLL, Linux) */
+        int busy_poll;
+        /** Size of the send buffer in bytes (\c SO_SNDBUF) */
+        int sndbuf;
+        /** Size of the receive buffer in bytes (\c SO_RCVBUF) */
+        int rcvbuf;
+        /** Seconds of idleness before sending keepalive probes */
+        int keepalive;
+        /** Seconds between unanswered keepalive probes, 0 for the shorter
+         * of 5 seconds and \a keepalive */
+        int keepalive_interval;
+        /** Send commands and receive responses via io_uring if the system
+         * supports it (Linux), falling back to the classic system calls
+         * otherwise */
+        int uring;
+};
+
+/** State of a context, which can be read without waiting for I/O */
+struct vicc_state {
+        /** vicc is connected */
+        int connected;
+        /** vicc has reported the removal of its card */
+        int card_removed;
+        /** The card has been powered on or reset and not powered off since */
+        int powered;
+        /** ATR of the card, valid until the vicc reconnects, is powered or
+         * reset */
+        unsigned char atr[33];
+        /** Length of \a atr, 0 if the ATR is not known */
+        size_t atr_len;
+        /** Monotonic time in milliseconds when vicc has last sent something,
+         * 0 if it has not */
+        long long last_activity;
+};
+
+/** Number of buckets of a histogram, which covers up to 2^32 microseconds */
+#define VICC_HISTOGRAM_BUCKETS 240
+
+/**
+ * Histogram of durations in microseconds.
+ *
+ * Durations below 8 microseconds have a bucket each. Above, every power of two
+ * is divided into 8 buckets, so that a bucket's bounds differ by at most
+ * 12.5%.
+ */
+struct vicc_histogram {
+        /** Number of recorded values */
+        unsigned long long count;
+        /** Sum of all recorded values */
+        unsigned long long sum;
+        /** Smallest recorded value */
+        unsigned long long min;
+        /** Largest recorded value */
+        unsigned long long max;
+        /** Number of recorded values per bucket */
+        unsigned long long buckets[VICC_HISTOGRAM_BUCKETS];
+};
+
+/** Statistics of a context, see vicc_get_stats() */
+struct vicc_stats {
+        /** Commands which have been answered by vicc */
+        unsigned long long commands;
+        /** Commands which failed */
+        unsigned long long failures;
+        /** Commands which failed, because vicc did not answer in time */
+        unsigned long long timeouts;
+        /** Disconnects of vicc because of an error */
+        unsigned long long ejects;
+        /** Connects of vicc, including reconnects */
+        unsigned long long connects;
+        /** Standby connections promoted after the active one failed */
+        unsigned long long failovers;
+        /** Sessions resumed after the connection to vicc was lost */
+        unsigned long long resumes;
+        /** Failed attempts to connect to a remote vicc */
+        unsigned long long connect_failures;
+        /** Attempts to connect which failed in a row, not affected by
+         * resetting the statistics */
+        unsigned int backoff_failures;
+        /** Milliseconds until the next attempt to connect is made, not
+         * affected by resetting the statistics */
+        long backoff_ms;
+        /** Bytes of commands sent to vicc */
+        unsigned long long bytes_sent;
+        /** Bytes of responses received from vicc */
+        unsigned long long bytes_received;
+        /** Commands which have been sent compressed */
+        unsigned long long deflated;
+        /** Bytes of the compressed commands before compression */
+        unsigned long long deflate_bytes_in;
+        /** Bytes of the compressed commands after compression */
+        unsigned long long deflate_bytes_out;
+        /** Commands which have been sent uncompressed, because compression
+         * did not make them smaller */
+        unsigned long long deflate_skipped;
+        /** Microseconds spent compressing commands */
+        unsigned long long deflate_us;
+        /** Compressed responses received from vicc */
+        unsigned long long inflated;
+        /** Bytes of the compressed responses as received */
+        unsigned long long inflate_bytes_in;
+        /** Bytes of the compressed responses after decompression */
+        unsigned long long inflate_bytes_out;
+        /** Microseconds spent decompressing responses */
+        unsigned long long inflate_us;
+        /** Heartbeats sent to vicc */
+        unsigned long long heartbeats;
+        /** Intervals in which vicc has not answered a heartbeat */
+        unsigned long long heartbeats_missed;
+        /** Smoothed round trip time of the heartbeats in microseconds, 0 if
+         * none has been answered on the current connection, not affected by
+         * resetting the statistics */
+        long long srtt_us;
+        /** Variation of the round trip time in microseconds, not affected by
+         * resetting the statistics */
+        long long rttvar_us;
+        /** Time for sending a command, including waiting for the previous
+         * one to be sent */
+        struct vicc_histogram send;
+        /** Time between the command has been sent and the response starts to
+         * arrive, i.e. the time vicc needs to think */
+        struct vicc_histogram think;
+        /** Time for receiving the rest of the response */
+        struct vicc_histogram receive;
+        /** Total time of a command */
+        struct vicc_histogram total;
+};
+
+/** Size of the identity reported in a slot's entry of a shard's map */
+#define VICC_SHARD_IDENTITY_MAX 64
+/** Size of the host name reported in a slot's entry of a shard's map */
+#define VICC_SHARD_HOSTNAME_MAX 256
+
+/** Assignment of a slot of a shard to one of its hosts */
+struct vicc_shard_entry {
+        /** Identity of the slot's card, truncated if necessary */
+        char identity[VICC_SHARD_IDENTITY_MAX];
+        /** Host the slot connects to, truncated if necessary */
+        char hostname[VICC_SHARD_HOSTNAME_MAX];
+        /** Port the slot connects to, including the slot's offset */
+        unsigned short port;
+        /** The host is not skipped after failing */
+        int healthy;
+        /** Connects to the host which have failed in a row */
+        unsigned int failures;
+        /** Number of times the slot has been moved to another host */
+        unsigned long long moves;
+        /** vicc is connected */
+        int connected;
+};
+
+/** Maximum number of standby connections of a context */
+#define VICC_MAX_STANDBY 8
 
 struct vicc_ctx {
         SOCKET server_sock;
         SOCKET client_sock;
         char *hostname;
         unsigned short port;
+        /* Unix domain socket vpcd listens on */
+        char *path;
+        /* shared memory used instead of a socket */
+        struct vicc_shm *shm;
+        /* card loaded into this process, which replaces vicc */
+        struct vicc_inproc *inproc;
+        /* listening socket shared with the other slots of the multiplexer */
+        struct vicc_mux *mux;
+        unsigned short slot;
+        /* hosts this context is one of the slots spread across */
+        struct vicc_shard *shard;
         void *io_lock;
+        struct vicc_reactor *reactor;
+        void *reactor_data;
+        unsigned int requested_features;
+        unsigned int features;
+        int handshake_pending;
+        /* vicc hung up on the hello, it only speaks the plain protocol */
+        int legacy_peer;
+        unsigned short tag;
+        /* serializes changes of the state, never held during I/O */
+        void *state_lock;
+        /* odd while the state is being changed */
+        volatile unsigned int state_seq;
+        struct vicc_state state;
+        /* incremented whenever the ATR is invalidated */
+        unsigned int atr_epoch;
+        /* pending events, one byte each */
+        int event_pipe[2];
+        void (*event_callback)(struct vicc_ctx *ctx, int event,
+                void *user_data);
+        void *event_user_data;
+        struct vicc_sockopts sockopts;
+        /* milliseconds a call may take, 0 waits forever */
+        long timeout;
+        /* monotonic time in milliseconds when the current call expires, 0 if
+         * it does not */
+        long long deadline;
+        /* monotonic time in microseconds when the header of the current
+         * response has been received */
+        long long rx_header_us;
+        void *stats_lock;
+        struct vicc_stats stats;
+        /* addresses of the remote vicc and when they need to be looked up
+         * again */
+        struct addrinfo *addrs;
+        long long addrs_expire;
+        /* backoff between attempts to connect to the remote vicc, guarded by
+         * stats_lock */
+        unsigned int connect_failures;
+        long connect_backoff;
+        long long connect_next;
+        /* round trips via io_uring, set up on first use */
+        struct vicc_uring *uring;
+        int uring_unavailable;
+        /* smallest command which is compressed with VPCD_FEATURE_DEFLATE and
+         * the buffer for compressed frames */
+        size_t deflate_threshold;
+        unsigned char *deflate_buf;
+        size_t deflate_buf_len;
+        /* where frames are captured and the slot they are captured with */
+        struct vicc_capture *capture;
+        unsigned short capture_slot;
+        /* faults injected into the frames, guarded by io_lock */
+        struct fault_stream *fault;
+        /* milliseconds of idleness before a heartbeat is sent and the number
+         * of intervals vicc may leave it unanswered */
+        long heartbeat_interval;
+        unsigned int heartbeat_misses;
+        /* tag and monotonic time in microseconds of the heartbeat awaiting its
+         * answer, 0 if none does, and the intervals counted as missed for it,
+         * guarded by io_lock */
+        unsigned short heartbeat_tag;
+        long long heartbeat_sent;
+        unsigned int heartbeat_missed;
+        /* round trip time of the heartbeats, guarded by stats_lock */
+        long long srtt;
+        long long rttvar;
+        /* session of vicc with VPCD_FEATURE_RESUME, whether it has been
+         * resumed by the last handshake, milliseconds vicc may take to come
+         * back and the monotonic time in milliseconds until which it is
+         * awaited after the connection was lost, 0 if it is not, guarded by
+         * io_lock */
+        unsigned char session[8];
+        int session_valid;
+        int session_resumed;
+        long resume_window;
+        long long resume_until;
+        /* failover policy (VICC_FAILOVER_*) and the connections to promote,
+         * guarded by state_lock, which may be taken while io_lock is held */
+        int failover;
+        unsigned int standby_max;
+        unsigned int standby_len;
+        struct vicc_ctx *standby[VICC_MAX_STANDBY];
 };
 
 #ifdef __cplusplus
@@ -58,13 +351,26 @@ extern "C" {
 /** Standard port of the virtual smart card reader */
 #define VPCDPORT 35963
 
+/** Prefix of a Unix domain socket's path given as hostname */
+#define VPCD_UNIX_PREFIX "unix:"
+/** Prefix of a shared memory object's name given as hostname */
+#define VPCD_SHM_PREFIX "shm:"
+/** Prefix of a card's shared library given as hostname (see vicc-card.h) */
+#define VPCD_INPROC_PREFIX "inproc:"
+
 /**
  * @brief Initialize the module
  *
  * @param[in] hostname Set hostname to something different to NULL if you want
  *                     to connect the vpcd to a socket opened by vicc.
  *                     Otherwise (default behavior) the vpcd will open a port
- *                     for vicc
+ *                     for vicc. With \c "unix:/path" the vpcd listens on a
+ *                     Unix domain socket at \c /path instead. With \c
+ *                     "shm:/name" the vpcd creates a shared memory object
+ *                     for vicc to attach to (Linux only). With \c
+ *                     "inproc:/path/card.so" the card is loaded from the
+ *                     given library and called directly, no vicc is needed
+ *                     (see vicc-card.h).
  * @param[in] port     Port to connect to or to open (see \a hostname)
  *
  * @return On success, the call returns the initialized context
@@ -76,6 +382,16 @@ int vicc_exit(struct vicc_ctx *ctx);
 int vicc_eject(struct vicc_ctx *ctx);
 
 int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs);
+
+/**
+ * @brief Check whether a virtual smart card is connected.
+ *
+ * While the ATR is cached, only the connection is checked, which needs no
+ * round trip to the virtual smart card. While a command is being processed,
+ * the call does not wait for it, but reports the card as present.
+ *
+ * @return 1 if the virtual smart card is present, 0 otherwise.
+ */
 int vicc_present(struct vicc_ctx *ctx);
 int vicc_poweron(struct vicc_ctx *ctx);
 int vicc_poweroff(struct vicc_ctx *ctx);
@@ -84,6 +400,10 @@ int vicc_reset(struct vicc_ctx *ctx);
 /**
  * @brief Receive ATR from the virtual smart card.
  *
+ * The ATR is cached until the virtual smart card reconnects, is powered on or
+ * off or is reset. Until then, the ATR is returned without asking the virtual
+ * smart card again.
+ *
  * @param[in,out] atr ATR received. Memory will be reused (via \a realloc) and
  *                    should be freed by the caller if no longer needed.
  *
@@ -92,6 +412,12 @@ int vicc_reset(struct vicc_ctx *ctx);
  */
 ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char** atr);
 
+/**
+ * @brief Drop the cached ATR, the next call to \a vicc_getatr asks the
+ * virtual smart card again.
+ */
+void vicc_invalidate_atr(struct vicc_ctx *ctx);
+
 /**
  * @brief Send an APDU to the virtual smart card.
  *
@@ -108,6 +434,662 @@ ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu);
 
+/**
+ * @brief Send an APDU to the virtual smart card and receive the response
+ * into a buffer of the caller.
+ *
+ * In contrast to \a vicc_transmit no memory is allocated.
+ *
+ * @param[in]  apdu_len   Number of bytes to send
+ * @param[in]  apdu       Data to be sent
+ * @param[out] rapdu      Buffer for the data received
+ * @param[in]  rapdu_size Capacity of \a rapdu
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately. If the
+ *         response does not fit into \a rapdu, it is dropped and errno is set
+ *         to \c ENOBUFS.
+ */
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size);
+
+/**
+ * @brief Same as \a vicc_transmit_into with a time limit for this call.
+ *
+ * The limit replaces the one of the context (see \a vicc_set_timeout). If
+ * both \a secs and \a usecs are 0, the call waits forever.
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately. If the
+ *         virtual smart card did not respond in time, errno is set to \c
+ *         ETIMEDOUT.
+ */
+ssize_t vicc_transmit_timeout(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size, long secs, long usecs);
+
+/** A command of a batch and its response */
+struct vicc_apdu {
+        /** Data to be sent */
+        const unsigned char *apdu;
+        size_t apdu_len;
+        /** Buffer for the data received and its capacity */
+        unsigned char *rapdu;
+        size_t rapdu_size;
+        /** Number of bytes received or -1 if there is no response */
+        ssize_t rapdu_len;
+        /** Why there is no response: \c ENOBUFS if it did not fit into \a
+         * rapdu, \c ECANCELED if the command has not been answered */
+        int error;
+};
+
+/** Stop a batch after the first response which is not 9000 */
+#define VICC_BATCH_STOP 0x1
+
+/**
+ * @brief Send a sequence of APDUs to the virtual smart card and receive their
+ * responses in order.
+ *
+ * The commands are written without waiting for the responses in between,
+ * so that a batch takes about one round trip instead of one for each command.
+ * With \c VICC_BATCH_STOP no further command is sent once a response other
+ * than 9000 has arrived. Note that the commands which have already been sent
+ * at that time are processed by the virtual smart card nevertheless, their
+ * responses are returned as well. Commands of a batch are never compressed.
+ *
+ * Shared memory, a card in this process and the reactor transmit the commands
+ * one after the other, but the reactor takes all of them at once unless it
+ * needs to stop early.
+ *
+ * @param[in,out] apdus Commands and their responses
+ * @param[in]     count Number of \a apdus
+ * @param[in]     flags 0 or \c VICC_BATCH_STOP
+ *
+ * @return On success, the call returns the number of commands which have been
+ *         answered (the first ones of \a apdus).
+ *         On error, -1 is returned, and errno is set appropriately. The
+ *         responses received until then are kept in \a apdus.
+ */
+ssize_t vicc_transmit_batch(struct vicc_ctx *ctx, struct vicc_apdu *apdus,
+        size_t count, int flags);
+
+/**
+ * @brief Create an event loop which drives the I/O of several contexts
+ *
+ * The reactor runs in a thread of its own. It accepts and (re-)connects the
+ * virtual smart cards of all attached contexts and handles the framing of
+ * their messages. The functions of this module may still be called from any
+ * thread; they submit their request to the reactor and wait for its
+ * completion.
+ *
+ * @note Currently only available on Linux.
+ *
+ * @return On success, the call returns the new reactor.
+ *         On error, NULL is returned, and errno is set appropriately.
+ */
+struct vicc_reactor *vicc_reactor_new(void);
+
+/**
+ * @brief Stop the reactor and detach all of its contexts.
+ *
+ * Detached contexts fall back to blocking I/O in the calling thread.
+ */
+void vicc_reactor_free(struct vicc_reactor *reactor);
+
+/**
+ * @brief Let the reactor drive the I/O of a context.
+ *
+ * The context is detached automatically with \a vicc_exit.
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+int vicc_reactor_attach(struct vicc_reactor *reactor, struct vicc_ctx *ctx);
+
+/** Slot announced by a virtual smart card which takes any free slot */
+#define VPCD_SLOT_ANY 0xffff
+
+/**
+ * @brief Listen for the virtual smart cards of many slots on a single port.
+ *
+ * Right after connecting, a virtual smart card may announce the slot it wants
+ * to be routed to. A virtual smart card which announces \c VPCD_SLOT_ANY or
+ * which does not announce anything is routed to the free slot with the
+ * lowest number. A connection is closed if its slot is taken or unknown.
+ *
+ * @note Currently not available on Windows. The contexts of a multiplexer
+ *       must either all be attached to the same reactor or none of them.
+ *
+ * @param[in] hostname NULL to listen on \a port or \c "unix:/path" to listen
+ *                     on a Unix domain socket
+ * @param[in] port     Port to listen on
+ *
+ * @return On success, the call returns the new multiplexer.
+ *         On error, NULL is returned, and errno is set appropriately.
+ */
+struct vicc_mux *vicc_mux_new(const char *hostname, unsigned short port);
+
+/**
+ * @brief Stop listening.
+ *
+ * All contexts of the multiplexer must have been freed with \a vicc_exit
+ * before.
+ */
+void vicc_mux_free(struct vicc_mux *mux);
+
+/**
+ * @brief Initialize the module for a slot of a multiplexer.
+ *
+ * The returned context is used like one returned by \a vicc_init, but it
+ * only accepts the virtual smart cards which are routed to \a slot.
+ *
+ * @return On success, the call returns the initialized context.
+ *         On error, NULL is returned, and errno is set appropriately. If
+ *         \a slot is in use, errno is set to \c EADDRINUSE.
+ */
+struct vicc_ctx *vicc_mux_add(struct vicc_mux *mux, unsigned short slot);
+
+/**
+ * @brief Spread the slots of a reader group across several hosts of vicc.
+ *
+ * Every slot is identified by the card it serves and connects to the host
+ * which follows the hash of this identity on a ring of consistent hashing.
+ * Adding a host therefore only moves the slots which hash to the new host.
+ * After 3 failed connects in a row, a host is skipped for 5 seconds
+ * and its slots connect to the next host on the ring instead. A slot only
+ * moves while it is not connected, so that a card is never taken away from
+ * an application because a host has come (back).
+ *
+ * @return On success, the call returns the new shard without any hosts.
+ *         On error, NULL is returned, and errno is set appropriately.
+ */
+struct vicc_shard *vicc_shard_new(void);
+
+/**
+ * @brief Stop spreading slots.
+ *
+ * All contexts of the shard must have been freed with \a vicc_exit before.
+ */
+void vicc_shard_free(struct vicc_shard *shard);
+
+/**
+ * @brief Add a host of vicc to the ring.
+ *
+ * A slot added with offset \a n connects to \a port + \a n of the host,
+ * where vicc needs to wait with \c --reversed. Hosts may be added while the
+ * slots are in use.
+ *
+ * @param[in] hostname Name or address of the host, Unix domain sockets,
+ *                     shared memory and libraries are not supported
+ * @param[in] port     Port of the slot with offset 0
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set appropriately. If the
+ *         host has already been added, errno is set to \c EEXIST.
+ */
+int vicc_shard_add_host(struct vicc_shard *shard, const char *hostname,
+        unsigned short port);
+
+/**
+ * @brief Initialize the module for a slot of a shard.
+ *
+ * The returned context is used like one returned by \a vicc_init for a
+ * remote vicc, but it connects to the host its identity is assigned to.
+ *
+ * @param[in] identity Identity of the slot's card, which must be stable
+ *                     across restarts (e.g. the name of the reader group and
+ *                     the slot's number)
+ * @param[in] offset   Added to the port of the host
+ *
+ * @return On success, the call returns the initialized context.
+ *         On error, NULL is returned, and errno is set appropriately. If
+ *         \a identity is in use, errno is set to \c EADDRINUSE, if the shard
+ *         has no hosts to \c EDESTADDRREQ.
+ */
+struct vicc_ctx *vicc_shard_add(struct vicc_shard *shard,
+        const char *identity, unsigned short offset);
+
+/**
+ * @brief Get the host of each slot of a shard.
+ *
+ * @param[out] map Receives the entries of up to \a len slots in the order
+ *                 they have been added
+ *
+ * @return Number of slots of the shard, which may be larger than \a len
+ */
+size_t vicc_shard_get_map(struct vicc_shard *shard,
+        struct vicc_shard_entry *map, size_t len);
+
+/**
+ * @brief Initialize socket options with the defaults of a new context.
+ *
+ * All options are 0 (i.e. the system's default is used) except for \a
+ * nodelay.
+ */
+void vicc_sockopts_default(struct vicc_sockopts *opts);
+
+/**
+ * @brief Parse a single socket option.
+ *
+ * Options are given as \c name=value, where \c name is one of \c nodelay,
+ * \c quickack, \c busypoll, \c sndbuf, \c rcvbuf, \c keepalive, \c keepintvl
+ * and \c uring.
+ * The value may be omitted for \c nodelay, \c quickack and \c uring to
+ * enable them.
+ *
+ * @param[in] option Option to parse, need not be terminated by \c '\0'
+ * @param[in] len    Length of \a option
+ *
+ * @return 1 if the option has been parsed into \a opts, 0 otherwise.
+ */
+int vicc_parse_sockopt(struct vicc_sockopts *opts,
+        const char *option, size_t len);
+
+/**
+ * @brief Parse a comma separated list of socket options.
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set to \c EINVAL.
+ */
+int vicc_parse_sockopts(struct vicc_sockopts *opts, const char *options);
+
+/**
+ * @brief Set the socket options of a context.
+ *
+ * The options are applied to the current and all future connections to the
+ * virtual smart card. Options which are specific to TCP are not applied to
+ * Unix domain sockets.
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set appropriately. The
+ *         options are used for future connections anyway.
+ */
+int vicc_set_sockopts(struct vicc_ctx *ctx, const struct vicc_sockopts *opts);
+
+/**
+ * @brief Limit the time of each call exchanging data with the virtual smart
+ * card.
+ *
+ * When a call does not complete in time, it fails with \c ETIMEDOUT and the
+ * virtual smart card is ejected, since a response arriving later would get
+ * out of sync with the next command. This keeps a stalled virtual smart card
+ * from blocking the caller indefinitely.
+ *
+ * @param[in] secs  Seconds a call may take
+ * @param[in] usecs Microseconds a call may take additionally
+ *
+ * If both \a secs and \a usecs are 0, calls wait forever, which is the
+ * default.
+ */
+void vicc_set_timeout(struct vicc_ctx *ctx, long secs, long usecs);
+
+/** Accept a single vicc per slot (default) */
+#define VICC_FAILOVER_OFF         0
+/** Report the failed card's removal and the insertion of the standby's card */
+#define VICC_FAILOVER_REINSERT    1
+/** Keep the card inserted and powered, only report a change of the ATR */
+#define VICC_FAILOVER_TRANSPARENT 2
+
+/**
+ * @brief Keep further virtual smart cards connected as standby.
+ *
+ * While a virtual smart card is connected, further ones connecting to the
+ * same port are accepted as standby, up to \a standbys of them. Their ATR is
+ * fetched right away. When the active virtual smart card fails, the command
+ * in progress fails as well, but the next command is sent to the first
+ * standby which is still alive. Standbys are accepted whenever the context
+ * checks for a connection (e.g. with \a vicc_present).
+ *
+ * @note Not available with the reactor, with a multiplexer or when vpcd
+ *       connects to vicc.
+ *
+ * @param[in] policy   One of \c VICC_FAILOVER_*
+ * @param[in] standbys Number of standbys, at most \c VICC_MAX_STANDBY
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set to \c EINVAL.
+ */
+int vicc_set_failover(struct vicc_ctx *ctx, int policy, unsigned int standbys);
+
+/**
+ * @brief Get a consistent copy of the context's state.
+ *
+ * The state is read without taking a lock, so this call never waits for a
+ * command which is being processed by the virtual smart card.
+ */
+void vicc_get_state(struct vicc_ctx *ctx, struct vicc_state *state);
+
+/**
+ * @brief Get the statistics of a context.
+ *
+ * @param[out] stats Copy of the statistics
+ * @param[in]  reset Whether to start over with new statistics afterwards
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set to \c EINVAL.
+ */
+int vicc_get_stats(struct vicc_ctx *ctx, struct vicc_stats *stats, int reset);
+
+/**
+ * @brief Get a percentile of a histogram.
+ *
+ * @param[in] percentile Percentile between 0 and 100, e.g. 99.9
+ *
+ * @return The upper bound of the bucket which holds the percentile, 0 if the
+ *         histogram is empty.
+ */
+unsigned long long vicc_histogram_percentile(const struct vicc_histogram *h,
+        double percentile);
+
+/**
+ * @brief Request protocol features from the virtual smart card.
+ *
+ * The features are negotiated with each newly connected virtual smart card
+ * before the next request is sent. A virtual smart card without support for
+ * the negotiation keeps talking the plain protocol. If it closes the
+ * connection instead, the negotiation is skipped for the following
+ * connections. By default, \c VPCD_FEATURES_DEFAULT are requested.
+ *
+ * @param[in] features Bitwise OR of \c VPCD_FEATURE_* or 0 to use the plain
+ *                     protocol without negotiation
+ */
+void vicc_set_features(struct vicc_ctx *ctx, unsigned int features);
+
+/** Commands of at least this many bytes are compressed by default */
+#define VPCD_DEFLATE_THRESHOLD 1024
+
+/**
+ * @brief Set the size from which commands are compressed.
+ *
+ * With \c VPCD_FEATURE_DEFLATE negotiated, a command of at least \a threshold
+ * bytes is sent compressed if that makes it smaller. Short commands are not
+ * worth the time for compressing them. The virtual smart card decides on its
+ * own which responses it compresses.
+ *
+ * @note Not available with the reactor, which neither compresses nor
+ *       negotiates \c VPCD_FEATURE_DEFLATE.
+ *
+ * @param[in] threshold Size of the smallest command to compress in bytes, 0
+ *                      uses \c VPCD_DEFLATE_THRESHOLD
+ */
+void vicc_set_deflate_threshold(struct vicc_ctx *ctx, size_t threshold);
+
+/** Milliseconds vicc may take to resume a session by default */
+#define VPCD_RESUME_WINDOW 10000
+
+/**
+ * @brief Set how long a lost session may take to be resumed.
+ *
+ * With \c VPCD_FEATURE_RESUME negotiated, losing the connection to the
+ * virtual smart card does not eject the card. For \a window milliseconds,
+ * the virtual smart card is awaited (or connected to again) and the session
+ * is resumed with the card's state untouched. A command which was interrupted
+ * is sent again, which the virtual smart card answers with the response it
+ * may have already given. Meanwhile, the card is reported as present and
+ * commands wait for the session to be resumed within their timeout. If the
+ * window passes or the virtual smart card has lost the session, the card is
+ * ejected as usual.
+ *
+ * @note Not available with the reactor, a port shared by several slots,
+ *       shared memory or cards loaded into this process.
+ *
+ * @param[in] window Milliseconds to wait for resuming, 0 uses
+ *                   \c VPCD_RESUME_WINDOW
+ */
+void vicc_set_resume(struct vicc_ctx *ctx, long window);
+
+/** Milliseconds of idleness before a heartbeat is sent by default */
+#define VPCD_HEARTBEAT_INTERVAL 5000
+/** Intervals without an answer to a heartbeat before vicc is ejected by
+ * default */
+#define VPCD_HEARTBEAT_MISSES 3
+
+/**
+ * @brief Configure the heartbeats on idle connections.
+ *
+ * With \c VPCD_FEATURE_HEARTBEAT negotiated, a heartbeat is sent when nothing
+ * has been received from the virtual smart card for \a interval milliseconds.
+ * If it does not answer within \a misses intervals, the card is ejected, even
+ * if the connection was lost without notice. Heartbeats are sent and checked
+ * while calling vicc_present() or vicc_wait_event(), but not while a command
+ * is being processed. The round trip times of the heartbeats are available
+ * with vicc_get_stats(). The answer to a heartbeat is not waited for, but
+ * received with the next check, so with vicc_present() the round trip
+ * includes the time until the next call.
+ *
+ * @note Not available with the reactor, which does not negotiate
+ *       \c VPCD_FEATURE_HEARTBEAT.
+ *
+ * @param[in] interval Milliseconds of idleness, 0 uses
+ *                     \c VPCD_HEARTBEAT_INTERVAL
+ * @param[in] misses   Intervals without an answer, 0 uses
+ *                     \c VPCD_HEARTBEAT_MISSES
+ */
+void vicc_set_heartbeat(struct vicc_ctx *ctx, long interval,
+        unsigned int misses);
+
+/**
+ * @brief Open a file for capturing frames in pcapng format.
+ *
+ * The capture records each frame exchanged with the virtual smart cards of
+ * the contexts attached with vicc_set_capture(), including its direction,
+ * slot and a timestamp in nanoseconds. Frames go to a buffer of the calling
+ * thread, which a background thread writes to the file and frees after the
+ * thread has exited. A frame is dropped instead of waiting if the buffer is
+ * full. Wireshark shows the frames with the dissector vpcd-capture.lua.
+ *
+ * @param[in] path File to be created or truncated
+ *
+ * @return The capture or NULL on error, in which case errno is set. Without
+ *         pthreads, errno is set to \c ENOSYS.
+ */
+struct vicc_capture *vicc_capture_open(const char *path);
+
+/**
+ * @brief Write the remaining frames and close the capture.
+ *
+ * @note Detach all contexts from the capture before closing it.
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set to \c EIO if some frames
+ *         could not be written.
+ */
+int vicc_capture_close(struct vicc_capture *capture);
+
+/**
+ * @brief Number of frames which have been dropped, because the background
+ * thread did not keep up.
+ */
+unsigned long long vicc_capture_dropped(struct vicc_capture *capture);
+
+/**
+ * @brief Capture the frames of a context.
+ *
+ * Several contexts may share a capture, the slot tells them apart.
+ *
+ * @param[in] capture Capture to attach to or NULL to stop capturing
+ * @param[in] slot    Slot number recorded with each frame of the context
+ */
+void vicc_set_capture(struct vicc_ctx *ctx, struct vicc_capture *capture,
+        unsigned short slot);
+
+/**
+ * @brief Parse a scenario of faults to inject between vpcd and vicc.
+ *
+ * A scenario consists of lines, which are separated by newlines or
+ * semicolons. A \c # comments out the rest of its line. Besides the lines
+ * \c "seed N", which seeds the random numbers, and \c "loop SECONDS", after
+ * which the scenario starts over, each line gives the faults from a number
+ * of seconds on, counted from attaching the scenario. It lists any of these
+ * settings separated by blanks:
+ *
+ * - \c delay=fixed:MS, \c delay=uniform:MIN:MAX, \c delay=normal:MEAN:SD,
+ *   \c delay=exp:MEAN or \c delay=pareto:MIN:SHAPE for holding back every
+ *   frame for a number of milliseconds drawn from the distribution
+ * - \c jitter=MS adding up to \a MS milliseconds to the delay
+ * - \c rate=BYTES limiting the bytes per second, with suffix \c k or \c M
+ *   for thousands or millions
+ * - \c drop=P closing the connection instead of passing a frame with
+ *   probability \a P
+ * - \c truncate=P passing only the beginning of a frame before closing the
+ *   connection with probability \a P
+ * - \c dir=to, \c dir=from or \c dir=both (the default) for the frames to
+ *   or from vicc the line applies to
+ *
+ * Settings are not carried over to the next line, a line without settings
+ * stops injecting faults. For example, \c "seed 7; 0 delay=normal:5:2;
+ * 10 delay=pareto:2:1.5 drop=0.01; 20" delays the frames for 10 seconds,
+ * then delays them with a heavy tail and drops some connections, after
+ * which everything is passed again.
+ *
+ * @return On success, the call returns the parsed scenario.
+ *         On error, NULL is returned, and errno is set to \c EINVAL if the
+ *         scenario is malformed.
+ */
+struct vicc_fault *vicc_fault_new(const char *scenario);
+
+/**
+ * @brief Read a scenario of faults from a file (see vicc_fault_new()).
+ */
+struct vicc_fault *vicc_fault_load(const char *path);
+
+/**
+ * @brief Free a scenario, which must have been detached from all contexts.
+ */
+void vicc_fault_free(struct vicc_fault *fault);
+
+/**
+ * @brief Inject faults into the frames of a context.
+ *
+ * The scenario starts when it is attached. Its random numbers are drawn
+ * from a sequence of their own for each \a stream, so that attaching the
+ * same scenario with the same stream again repeats the same faults for the
+ * same frames. Delays count against the timeout of a call like a slow vicc
+ * does. Dropped and truncated frames lose the connection like a broken
+ * network does.
+ *
+ * @note Not available with the reactor or with a card loaded into the
+ *       process, whose frames are not exchanged by the context.
+ *
+ * @param[in] fault  Scenario to attach or NULL to stop injecting faults
+ * @param[in] stream Number of the sequence of random numbers
+ *
+ * @return On success, 0 is returned.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+int vicc_set_fault(struct vicc_ctx *ctx, struct vicc_fault *fault,
+        unsigned short stream);
+
+/**
+ * @brief Called for each event of a context.
+ *
+ * @param[in] event One of \c VPCD_EVENT_*
+ */
+typedef void (*vicc_event_callback)(struct vicc_ctx *ctx, int event,
+        void *user_data);
+
+/**
+ * @brief Deliver the events of a context to a callback.
+ *
+ * Events are reported when a virtual smart card connects or disconnects and,
+ * with \c VPCD_FEATURE_EVENTS, when it reports the insertion, removal or
+ * replacement of its card. The callback is invoked in the reactor's thread if
+ * the context is attached to one. Otherwise, it is invoked when the context is
+ * used, for example by \a vicc_present. Events delivered to the callback are
+ * not returned by \a vicc_wait_event.
+ *
+ * @param[in] callback  Called for each event, NULL to queue the events again
+ * @param[in] user_data Passed to \a callback
+ */
+void vicc_set_event_callback(struct vicc_ctx *ctx,
+        vicc_event_callback callback, void *user_data);
+
+/**
+ * @brief Get a file descriptor which is readable while events are queued.
+ *
+ * Without a reactor, the context is only checked for new events while it is
+ * used. Call \a vicc_wait_event to wait for events in this case.
+ *
+ * @return On success, the call returns the file descriptor.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+int vicc_event_fd(struct vicc_ctx *ctx);
+
+/**
+ * @brief Wait for the next event of a context.
+ *
+ * Without a reactor, the calling thread receives the virtual smart card's
+ * messages and connections while waiting.
+ *
+ * @return On success, the call returns the event (\c VPCD_EVENT_*) or 0 if
+ *         none occurred in the given time or the wait was interrupted by \a
+ *         vicc_interrupt_wait.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+int vicc_wait_event(struct vicc_ctx *ctx, long secs, long usecs);
+
+/**
+ * @brief Let a call to \a vicc_wait_event return early.
+ */
+void vicc_interrupt_wait(struct vicc_ctx *ctx);
+
+/**
+ * @brief Called when an asynchronous request has been completed.
+ *
+ * The callback owns the request and has to free it with \a vicc_request_free.
+ * It is invoked in the reactor's thread and must not block.
+ */
+typedef void (*vicc_callback)(struct vicc_request *request, void *user_data);
+
+/**
+ * @brief Send an APDU to the virtual smart card without waiting for the
+ * response.
+ *
+ * If the context is attached to a reactor, the request is queued and the call
+ * returns immediately. With \c VPCD_FEATURE_TAGGED several requests may be in
+ * flight at the same time, otherwise they are answered one after the other.
+ * Without a reactor, the request is completed before the call returns.
+ *
+ * @param[in]  apdu_len   Number of bytes to send
+ * @param[in]  apdu       Data to be sent, must stay valid until the request
+ *                        has been completed
+ * @param[out] rapdu      Buffer for the data received
+ * @param[in]  rapdu_size Capacity of \a rapdu
+ * @param[in]  callback   Called on completion, may be NULL
+ * @param[in]  user_data  Passed to \a callback
+ *
+ * @return On success, the call returns the new request. If a callback is
+ *         given, the returned pointer must only be checked against NULL.
+ *         On error, NULL is returned, and errno is set appropriately.
+ */
+struct vicc_request *vicc_submit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_size,
+        vicc_callback callback, void *user_data);
+
+/**
+ * @brief Check whether a request has been completed.
+ */
+int vicc_request_done(struct vicc_request *request);
+
+/**
+ * @brief Wait for the completion of a request.
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately (see \a
+ *         vicc_transmit_into).
+ */
+ssize_t vicc_request_wait(struct vicc_request *request);
+
+/**
+ * @brief Free a request.
+ *
+ * A pending request is waited for. All requests need to be freed before
+ * their reactor.
+ */
+void vicc_request_free(struct vicc_request *request);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,226 @@
+#
+# Copyright (C) 2026 Frank Morgner
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Shared memory transport to vpcd. vpcd creates a POSIX shared memory object
+holding one ring buffer for each direction, see ``src/vpcd/shm.h`` for its
+layout. :class:`SharedMemorySocket` attaches to it and behaves like a connected
+socket.
+
+The rings rely on the other side seeing the bytes of a message before the new
+head or tail which publishes them. vpcd orders its accesses with atomics, but
+Python's plain stores through ctypes are only ordered like that on x86, so the
+transport is limited to x86.
+"""
+
+import ctypes
+import errno
+import fcntl
+import mmap
+import os
+import platform
+import socket
+import struct
+import time
+
+SHM_MAGIC = 0x53435056
+SHM_VERSION = 1
+SHM_LISTENING = 0
+SHM_CONNECTED = 1
+
+_HEADER_LEN = 64
+_CONTROL_LEN = 128
+# seconds to sleep before checking whether vpcd is still alive
+_WAIT = 0.1
+
+_FUTEX_WAIT = 0
+_FUTEX_WAKE = 1
+# x86 keeps stores in order with stores and loads with loads, which gives
+# every access the acquire or release semantics vpcd uses for the rings
+_SYS_futex = {
+    'x86_64': 202,
+    'i386': 240, 'i686': 240,
+}.get(platform.machine())
+
+
+class _timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+
+try:
+    _libc = ctypes.CDLL(None, use_errno=True)
+except OSError:
+    _libc = None
+
+
+def _futex_wait(word, value, timeout):
+    if _libc is None or _SYS_futex is None:
+        time.sleep(timeout / 100)
+        return
+    ts = _timespec(int(timeout), int((timeout % 1) * 1000000000))
+    _libc.syscall(_SYS_futex, ctypes.byref(word), _FUTEX_WAIT, value,
+                  ctypes.byref(ts), None, 0)
+
+
+def _futex_wake(word):
+    if _libc is not None and _SYS_futex is not None:
+        _libc.syscall(_SYS_futex, ctypes.byref(word), _FUTEX_WAKE, 0x7fffffff,
+                      None, None, 0)
+
+
+class _Ring(object):
+    def __init__(self, mem, offset, size):
+        self.head = ctypes.c_uint32.from_buffer(mem, offset)
+        self.head_waiting = ctypes.c_uint32.from_buffer(mem, offset + 4)
+        self.tail = ctypes.c_uint32.from_buffer(mem, offset + 64)
+        self.tail_waiting = ctypes.c_uint32.from_buffer(mem, offset + 68)
+        self.data = offset + _CONTROL_LEN
+        self.size = size
+
+
+class SharedMemorySocket(object):
+    """
+    Attaches to the shared memory object created by vpcd. Only one vicc may
+    be attached at a time.
+    """
+
+    def __init__(self, name):
+        self.closed = True
+        if _SYS_futex is None:
+            raise socket.error(errno.EOPNOTSUPP,
+                               "Shared memory is only supported on x86")
+        path = os.path.join("/dev/shm", name.lstrip("/"))
+        fd = os.open(path, os.O_RDWR)
+        try:
+            # vicc processes attaching at the same time check and claim the
+            # state one after the other
+            fcntl.flock(fd, fcntl.LOCK_EX)
+            self.mem = mmap.mmap(fd, 0)
+            try:
+                self.__attach()
+            except Exception:
+                self.mem.close()
+                raise
+        finally:
+            # the mapping holds a duplicate of fd, which would keep the lock
+            fcntl.flock(fd, fcntl.LOCK_UN)
+            os.close(fd)
+
+    def __attach(self):
+        (magic, version, state, generation, self.vpcd_pid, vicc_pid,
+         size) = struct.unpack_from("=7I", self.mem, 0)
+        if magic != SHM_MAGIC or version != SHM_VERSION:
+            raise socket.error(errno.EPROTO, "Not a vpcd shared memory object")
+        if state != SHM_LISTENING:
+            raise socket.error(errno.EBUSY, "An other vicc is attached")
+
+        self.state = ctypes.c_uint32.from_buffer(self.mem, 8)
+        self.rx = _Ring(self.mem, _HEADER_LEN, size)
+        self.tx = _Ring(self.mem, _HEADER_LEN + _CONTROL_LEN + size, size)
+
+        # start with empty rings and let vpcd know we are here
+        for ring in (self.rx, self.tx):
+            ring.head.value = ring.tail.value = 0
+            ring.head_waiting.value = ring.tail_waiting.value = 0
+        self.generation = (generation + 1) & 0xffffffff
+        struct.pack_into("=I", self.mem, 12, self.generation)
+        struct.pack_into("=I", self.mem, 20, os.getpid())
+        self.state.value = SHM_CONNECTED
+        self.closed = False
+        _futex_wake(self.state)
+
+    def __alive(self):
+        if self.closed or self.state.value != SHM_CONNECTED or \
+                struct.unpack_from("=I", self.mem, 12)[0] != self.generation:
+            return False
+        try:
+            os.kill(self.vpcd_pid, 0)
+        except OSError as e:
+            if e.errno == errno.ESRCH:
+                return False
+        return True
+
+    def __wait(self, word, waiting, value):
+        """ Waits until word differs from value """
+        while word.value == value:
+            waiting.value = 1
+            if word.value != value:
+                break
+            _futex_wait(word, value, _WAIT)
+            if not self.__alive():
+                return False
+        return True
+
+    @staticmethod
+    def __wake(word, waiting):
+        if waiting.value:
+            waiting.value = 0
+            _futex_wake(word)
+
+    def settimeout(self, timeout):
+        pass
+
+    def sendall(self, data):
+        ring = self.tx
+        sent = 0
+        while sent < len(data):
+            if not self.__alive():
+                raise socket.error(errno.EPIPE, "vpcd is gone")
+            head = ring.head.value
+            tail = ring.tail.value
+            used = (head - tail) & 0xffffffff
+            if used == ring.size:
+                self.__wait(ring.tail, ring.tail_waiting, tail)
+                continue
+            offset = head & (ring.size - 1)
+            n = min(ring.size - used, ring.size - offset, len(data) - sent)
+            self.mem[ring.data + offset:ring.data + offset + n] = \
+                data[sent:sent + n]
+            ring.head.value = (head + n) & 0xffffffff
+            self.__wake(ring.head, ring.head_waiting)
+            sent += n
+
+    def recv(self, size):
+        ring = self.rx
+        while True:
+            tail = ring.tail.value
+            head = ring.head.value
+            if head != tail:
+                break
+            if not self.__alive() or \
+                    not self.__wait(ring.head, ring.head_waiting, head):
+                return b""
+        offset = tail & (ring.size - 1)
+        n = min((head - tail) & 0xffffffff, ring.size - offset, size)
+        data = self.mem[ring.data + offset:ring.data + offset + n]
+        ring.tail.value = (tail + n) & 0xffffffff
+        self.__wake(ring.tail, ring.tail_waiting)
+        return data
+
+    def close(self):
+        if self.closed:
+            return
+        if self.__alive():
+            self.state.value = SHM_LISTENING
+            _futex_wake(self.state)
+            for ring in (self.rx, self.tx):
+                _futex_wake(ring.head)
+                _futex_wake(ring.tail)
+        # an other thread may still be waiting on the rings, so the memory is
+        # only unmapped with the garbage collection of this object
+        self.closed = True
@@ -20,9 +20,17 @@
 import atexit
 import errno
 import logging
+import os
 import socket
 import struct
 import sys
+import threading
+import time
+import zlib
+try:
+    import queue
+except ImportError:
+    import Queue as queue
 from virtualsmartcard.ConstantDefinitions import MAX_EXTENDED_LE, MAX_SHORT_LE
 from virtualsmartcard.SWutils import SwError, SW
 from virtualsmartcard.SmartcardFilesystem import make_property
@@ -397,6 +405,46 @@ VPCD_CTRL_OFF = 0
 VPCD_CTRL_ON = 1
 VPCD_CTRL_RESET = 2
 VPCD_CTRL_ATR = 4
+VPCD_CTRL_HELLO = 8
+
+# Prefix of a Unix domain socket's path given as host or port
+VPCD_UNIX_PREFIX = "unix:"
+# Prefix of the name of vpcd's shared memory given as host
+VPCD_SHM_PREFIX = "shm:"
+
+# Protocol extensions negotiated with vpcd
+VPCD_PROTOCOL_VERSION = 2
+VPCD_FEATURE_TAGGED = 0x00000001
+VPCD_FEATURE_LEN32 = 0x00000002
+VPCD_FEATURE_EVENTS = 0x00000004
+VPCD_FEATURE_DEFLATE = 0x00000008
+VPCD_FEATURE_HEARTBEAT = 0x00000010
+VPCD_FEATURE_RESUME = 0x00000020
+VPCD_FEATURES = (VPCD_FEATURE_TAGGED | VPCD_FEATURE_LEN32 | VPCD_FEATURE_EVENTS
+                 | VPCD_FEATURE_DEFLATE | VPCD_FEATURE_HEARTBEAT
+                 | VPCD_FEATURE_RESUME)
+# Responses of at least this many bytes are compressed with
+# VPCD_FEATURE_DEFLATE
+VPCD_DEFLATE_THRESHOLD = 1024
+# Events sent to vpcd on our own with VPCD_FEATURE_EVENTS
+VPCD_EVENT_INSERTED = 1
+VPCD_EVENT_REMOVED = 2
+VPCD_EVENT_ATR_CHANGED = 3
+_VPCD_FLAG_EVENT = 0x01
+_VPCD_FLAG_DEFLATE = 0x02
+_VPCD_FLAG_HEARTBEAT = 0x04
+_VPCD_MAX_LEN32 = 0x1000000
+_VPCD_HELLO_MAGIC = b"vpcd"
+_VPCD_HELLO_LEN = 9
+# Session named right after selecting VPCD_FEATURE_RESUME
+_VPCD_SESSION_MAGIC = b"sess"
+_VPCD_SESSION_LEN = 12
+# Seconds to try connecting to vpcd again for resuming a session
+VPCD_RESUME_WINDOW = 10
+_VPCD_RESUME_RETRY = 0.5
+# Slot of a port shared by several slots, announced right after connecting
+VPCD_SLOT_ANY = 0xffff
+_VPCD_ANNOUNCE_MAGIC = b"slot"
 
 
 class VirtualICC(object):
@@ -412,7 +460,7 @@ class VirtualICC(object):
     def __init__(self, datasetfile, card_type, host, port,
                  readernum=None, mitmPath=None, ef_cardsecurity=None, ef_cardaccess=None,
                  ca_key=None, cvca=None, disable_checks=False, esign_key=None,
-                 esign_ca_cert=None, esign_cert=None,
+                 esign_ca_cert=None, esign_cert=None, slot=None,
                  logginglevel=logging.INFO):
         from os.path import exists
 
@@ -462,12 +510,15 @@ class VirtualICC(object):
         # Connect to the VPCD
         self.host = host
         self.port = port
+        self.slot = slot
         if host:
             # use normal connection mode
             try:
                 self.sock = self.connectToPort(host, port)
                 self.sock.settimeout(None)
                 self.server_sock = None
+                if slot is not None:
+                    self.announce(self.sock, slot)
             except socket.error as e:
                 logging.critical("Failed to open socket: %s", str(e))
                 logging.critical("Is pcscd running at %s? Is vpcd loaded? Is a \
@@ -476,88 +527,272 @@ class VirtualICC(object):
         else:
             # use reversed connection mode
             try:
-                local_ip = [(s.connect(('9.9.9.9', 53)), s.getsockname()[0], s.close()) for s in [socket.socket(socket.AF_INET, socket.SOCK_DGRAM)]][0][1]
-                custom_url = 'vicc://%s:%d' % (local_ip, port)
-                print('VICC hostname:  %s' % local_ip)
-                print('VICC port:      %d' % port)
-                print('On your NFC phone with the Android Smart Card Emulator app scan this code:')
-                try:
-                    import qrcode
-                    qr = qrcode.QRCode()
-                    qr.add_data(custom_url)
-                    qr.print_ascii()
-                except ImportError:
-                    print('https://api.qrserver.com/v1/create-qr-code/?data=%s' % custom_url)
+                if not str(port).startswith(VPCD_UNIX_PREFIX):
+                    local_ip = [(s.connect(('9.9.9.9', 53)), s.getsockname()[0], s.close()) for s in [socket.socket(socket.AF_INET, socket.SOCK_DGRAM)]][0][1]
+                    custom_url = 'vicc://%s:%d' % (local_ip, port)
+                    print('VICC hostname:  %s' % local_ip)
+                    print('VICC port:      %d' % port)
+                    print('On your NFC phone with the Android Smart Card Emulator app scan this code:')
+                    try:
+                        import qrcode
+                        qr = qrcode.QRCode()
+                        qr.add_data(custom_url)
+                        qr.print_ascii()
+                    except ImportError:
+                        print('https://api.qrserver.com/v1/create-qr-code/?data=%s' % custom_url)
                 (self.sock, self.server_sock, host) = self.openPort(port)
                 self.sock.settimeout(None)
             except socket.error as e:
                 logging.critical("Failed to open socket: %s", str(e))
                 logging.critical("Is pcscd running? Is vpcd loaded and in \
                               reversed connection mode? Is a firewall \
-                              blocking port %u?", port)
+                              blocking port %s?", port)
                 sys.exit()
 
-        logging.info("Connected to virtual PCD at %s:%u", host, port)
+        if str(host).startswith((VPCD_UNIX_PREFIX, VPCD_SHM_PREFIX)):
+            logging.info("Connected to virtual PCD at %s", host)
+        else:
+            logging.info("Connected to virtual PCD at %s:%s", host, port)
+
+        # Protocol features in use and whether vpcd is about to select them
+        self.features = 0
+        self.selecting = False
+        # Session which vpcd may resume with VPCD_FEATURE_RESUME, whether vpcd
+        # is about to name it and the last response, which is given again if
+        # vpcd sends its command again right after resuming the session. The
+        # tags wrap around, so the same tag later on is a different command.
+        self.session = os.urandom(_VPCD_SESSION_LEN - len(_VPCD_SESSION_MAGIC))
+        self.naming = False
+        self.resumed = False
+        self.last_tag = None
+        self.last_response = None
+        self.deflate_threshold = VPCD_DEFLATE_THRESHOLD
+        self.sendLock = threading.Lock()
+        self.requests = queue.Queue()
 
         atexit.register(self.stop)
 
     @staticmethod
     def connectToPort(host, port):
         """
-        Open a connection to a given host on a given port.
+        Open a connection to a given host on a given port. A host of the form
+        ``unix:/path`` denotes a Unix domain socket, ``shm:/name`` the shared
+        memory created by vpcd. The port is ignored then.
         """
-        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        sock.connect((host, port))
+        if host.startswith(VPCD_SHM_PREFIX):
+            from virtualsmartcard.SharedMemory import SharedMemorySocket
+            sock = SharedMemorySocket(host[len(VPCD_SHM_PREFIX):])
+        elif host.startswith(VPCD_UNIX_PREFIX):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(host[len(VPCD_UNIX_PREFIX):])
+        else:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.connect((host, port))
         return sock
 
+    @staticmethod
+    def announce(sock, slot):
+        """
+        Tell vpcd which of the slots sharing its port we want to use, or
+        ``VPCD_SLOT_ANY`` for any free slot.
+        """
+        msg = _VPCD_ANNOUNCE_MAGIC + struct.pack('!H', slot)
+        sock.sendall(struct.pack('!H', len(msg)) + msg)
+
     @staticmethod
     def openPort(port):
-        server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        server_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-        server_socket.bind(('', port))
+        """
+        Wait for a connection on a given port, which may also be a Unix domain
+        socket of the form ``unix:/path``.
+        """
+        if str(port).startswith(VPCD_UNIX_PREFIX):
+            path = port[len(VPCD_UNIX_PREFIX):]
+            if os.path.exists(path):
+                os.unlink(path)
+            server_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            server_socket.bind(path)
+        else:
+            server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            server_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            server_socket.bind(('', port))
         server_socket.listen(0)
         logging.info("Waiting for vpcd on port " + str(port))
         (client_socket, address) = server_socket.accept()
+        if server_socket.family != socket.AF_INET:
+            address = (port,)
         return (client_socket, server_socket, address[0])
 
-    def __sendToVPICC(self, msg):
+    def __sendToVPICC(self, msg, tag=0, flags=0):
         """ Send a message to the vpcd """
         if isinstance(msg, str):
-            self.sock.sendall(struct.pack('!H', len(msg)) + bytes(map(ord,msg)))
+            msg = bytes(map(ord, msg))
+        if (self.features & VPCD_FEATURE_DEFLATE and not flags
+                and len(msg) >= self.deflate_threshold):
+            # favor latency over the last few bytes
+            deflated = struct.pack('!I', len(msg)) + zlib.compress(msg, 1)
+            if len(deflated) < len(msg):
+                msg = deflated
+                flags |= _VPCD_FLAG_DEFLATE
+        if self.features & VPCD_FEATURE_LEN32:
+            header = struct.pack('!I', len(msg))
         else:
-            self.sock.sendall(struct.pack('!H', len(msg)) + msg)
-
-    def __recvFromVPICC(self):
-        """ Receive a message from the vpcd """
-        # receive message size
-        while True:
+            header = struct.pack('!H', len(msg))
+        if self.features & VPCD_FEATURE_TAGGED:
+            header += struct.pack('!BH', flags, tag)
+        with self.sendLock:
+            self.sock.sendall(header + msg)
+
+    def __recvAll(self, size):
+        """ Receive exactly size bytes from the vpcd """
+        data = b""
+        while len(data) < size:
             try:
-                sizestr = self.sock.recv(_Csizeof_short)
+                chunk = self.sock.recv(size - len(data))
             except socket.error as e:
                 if e.errno == errno.EINTR:
                     continue
-            break
-        if len(sizestr) == 0:
-            logging.info("Virtual PCD shut down")
-            raise socket.error
-        size = struct.unpack('!H', sizestr)[0]
+                raise
+            if len(chunk) == 0:
+                logging.info("Virtual PCD shut down")
+                raise socket.error
+            data += chunk
+        return data
+
+    def __recvFromVPICC(self):
+        """ Receive a message, its tag and its flags from the vpcd """
+        if self.features & VPCD_FEATURE_LEN32:
+            size = struct.unpack('!I', self.__recvAll(4))[0]
+        else:
+            size = struct.unpack('!H', self.__recvAll(_Csizeof_short))[0]
+        tag = 0
+        flags = 0
+        if self.features & VPCD_FEATURE_TAGGED:
+            (flags, tag) = struct.unpack('!BH', self.__recvAll(3))
 
         # receive and return message
         if size:
-            while True:
-                try:
-                    msg = self.sock.recv(size)
-                except socket.error as e:
-                    if e.errno == errno.EINTR:
-                        continue
-                break
-            if len(msg) == 0:
-                logging.info("Virtual PCD shut down")
-                raise socket.error
+            msg = self.__recvAll(size)
         else:
             msg = None
 
-        return size, msg
+        if (flags & _VPCD_FLAG_DEFLATE and self.features & VPCD_FEATURE_DEFLATE
+                and msg):
+            msg = self.__inflate(msg)
+            size = len(msg)
+
+        return size, msg, tag, flags
+
+    @staticmethod
+    def __inflate(msg):
+        """ Decompress the data of a message flagged as compressed """
+        if len(msg) <= 4:
+            raise socket.error("Compressed message too short")
+        size = struct.unpack('!I', msg[:4])[0]
+        if not size or size > _VPCD_MAX_LEN32:
+            raise socket.error("Invalid length of compressed message")
+        try:
+            decompressor = zlib.decompressobj()
+            data = decompressor.decompress(msg[4:], size)
+        except zlib.error as e:
+            raise socket.error("Corrupt compressed message: %s" % str(e))
+        if len(data) != size or decompressor.unconsumed_tail:
+            raise socket.error("Invalid length of compressed message")
+        return data
+
+    def __hello(self, version=VPCD_PROTOCOL_VERSION, features=VPCD_FEATURES):
+        return _VPCD_HELLO_MAGIC + struct.pack('!BI', version, features)
+
+    def __execute(self, msg, tag):
+        """ Dispatches a command APDU to the emulated smartcard """
+        logging.info("Command APDU (%d bytes):\n  %s", len(msg),
+                hexdump(msg, indent=2))
+        proprietary = False
+        try:
+            parsed = C_APDU(msg)
+            logging.debug(str(parsed))
+            if parsed.CLA & 0b10000000 == 0b10000000:
+                proprietary = True
+        except:
+            proprietary = True
+
+        answer = self.os.execute(msg)
+        self.last_tag = tag
+        self.last_response = answer
+
+        try:
+            if not proprietary:
+                logging.debug(str(R_APDU(answer)))
+        except:
+            pass
+        logging.info("Response APDU (%d bytes):\n  %s", len(answer),
+                hexdump(answer, indent=2))
+
+        self.__sendToVPICC(answer, tag)
+
+    def __work(self):
+        """
+        Processes the requests which change the state of the emulated smart
+        card one after the other, while the main loop keeps receiving.
+        """
+        while True:
+            (msg, tag) = self.requests.get()
+            try:
+                if msg == inttostring(VPCD_CTRL_OFF):
+                    logging.info("Power Down")
+                    self.os.powerDown()
+                elif msg == inttostring(VPCD_CTRL_ON):
+                    logging.info("Power Up")
+                    self.os.powerUp()
+                elif msg == inttostring(VPCD_CTRL_RESET):
+                    logging.info("Reset")
+                    self.os.reset()
+                elif msg == inttostring(VPCD_CTRL_ATR):
+                    self.__sendToVPICC(self.os.getATR(), tag)
+                elif (self.features & VPCD_FEATURE_RESUME and self.resumed
+                        and tag == self.last_tag):
+                    # vpcd has lost the response and sent the command again
+                    logging.info("Response APDU given again")
+                    self.resumed = False
+                    self.__sendToVPICC(self.last_response, tag)
+                else:
+                    self.resumed = False
+                    self.__execute(msg, tag)
+            except socket.error as e:
+                logging.warning("Could not send response: %s", str(e))
+            finally:
+                self.requests.task_done()
+
+    def __reconnect(self):
+        """
+        Connect to vpcd again after losing the connection during a session,
+        which vpcd may resume. Returns False if vpcd could not be reached for
+        VPCD_RESUME_WINDOW seconds.
+        """
+        self.sock.close()
+        deadline = time.time() + VPCD_RESUME_WINDOW
+        while time.time() < deadline:
+            try:
+                self.sock = self.connectToPort(self.host, self.port)
+                if self.slot is not None:
+                    self.announce(self.sock, self.slot)
+                return True
+            except socket.error:
+                time.sleep(_VPCD_RESUME_RETRY)
+        return False
+
+    def __name_session(self, msg, tag):
+        """
+        Answer vpcd naming the session it had with the one we have. A
+        different session is a different vpcd, which must not get the
+        responses of the old one.
+        """
+        if msg[len(_VPCD_SESSION_MAGIC):] == self.session:
+            logging.info("Session resumed")
+            self.resumed = True
+        else:
+            self.last_tag = None
+            self.last_response = None
+        self.__sendToVPICC(_VPCD_SESSION_MAGIC + self.session, tag)
 
     def run(self):
         """
@@ -565,62 +800,111 @@ class VirtualICC(object):
         vpcd, dispatches them to the emulated smartcard and sends the resulting
         respsonse APDU back to the vpcd.
         """
+        worker = threading.Thread(target=self.__work)
+        worker.daemon = True
+        worker.start()
+
         while True:
             try:
-                (size, msg) = self.__recvFromVPICC()
+                (size, msg, tag, flags) = self.__recvFromVPICC()
             except socket.error as e:
+                # let the worker finish before talking to the next vpcd
+                self.requests.join()
+                resumable = self.features & VPCD_FEATURE_RESUME
+                self.features = 0
+                self.selecting = False
+                self.naming = False
                 if not self.host:
                     logging.info("Waiting for vpcd on port " + str(self.port))
                     (self.sock, address) = self.server_sock.accept()
                     continue
+                elif resumable and self.__reconnect():
+                    logging.info("Reconnected to vpcd for resuming the "
+                                 "session")
+                    continue
                 else:
                     logging.critical(str(e))
                     sys.exit()
 
-            if not size:
+            if (flags & _VPCD_FLAG_HEARTBEAT
+                    and self.features & VPCD_FEATURE_HEARTBEAT):
+                # vpcd checks whether we are still there, which is answered
+                # right away, even while the worker processes a command
+                self.__sendToVPICC(b"", tag, _VPCD_FLAG_HEARTBEAT)
+            elif not size:
                 logging.warning("Error in communication protocol (missing \
                                 size parameter)")
             elif size == VPCD_CTRL_LEN:
-                if msg == inttostring(VPCD_CTRL_OFF):
-                    logging.info("Power Down")
-                    self.os.powerDown()
-                elif msg == inttostring(VPCD_CTRL_ON):
-                    logging.info("Power Up")
-                    self.os.powerUp()
-                elif msg == inttostring(VPCD_CTRL_RESET):
-                    logging.info("Reset")
-                    self.os.reset()
-                elif msg == inttostring(VPCD_CTRL_ATR):
-                    self.__sendToVPICC(self.os.getATR())
+                if (msg == inttostring(VPCD_CTRL_ATR)
+                        and self.features & VPCD_FEATURE_TAGGED):
+                    # the response can be matched by its tag, so there is no
+                    # need to wait for pending commands
+                    self.__sendToVPICC(self.os.getATR(), tag)
+                elif msg == inttostring(VPCD_CTRL_HELLO):
+                    self.__sendToVPICC(self.__hello(), tag)
+                    self.selecting = True
+                elif msg in (inttostring(VPCD_CTRL_OFF),
+                             inttostring(VPCD_CTRL_ON),
+                             inttostring(VPCD_CTRL_RESET),
+                             inttostring(VPCD_CTRL_ATR)):
+                    self.requests.put((msg, tag))
                 else:
                     logging.warning("unknown control command")
+            elif (self.naming and size == _VPCD_SESSION_LEN
+                    and msg.startswith(_VPCD_SESSION_MAGIC)):
+                self.naming = False
+                self.__name_session(msg, tag)
+            elif (self.selecting and size == _VPCD_HELLO_LEN
+                    and msg.startswith(_VPCD_HELLO_MAGIC)):
+                (version, features) = struct.unpack('!BI', msg[4:])
+                if version < 2:
+                    features &= ~VPCD_FEATURE_LEN32
+                # responses which are still due use the old framing
+                self.requests.join()
+                self.features = features & VPCD_FEATURES
+                self.selecting = False
+                self.naming = bool(self.features & VPCD_FEATURE_RESUME)
+                logging.info("Using protocol version %u with features 0x%08X",
+                             version, self.features)
             else:
-                if size != len(msg):
-                    logging.warning("Expected %u bytes, but received only %u",
-                                    size, len(msg))
-
-                logging.info("Command APDU (%d bytes):\n  %s", len(msg),
-                        hexdump(msg, indent=2))
-                proprietary = False
-                try:
-                    parsed = C_APDU(msg)
-                    logging.debug(str(parsed))
-                    if parsed.CLA & 0b10000000 == 0b10000000:
-                        proprietary = True
-                except:
-                    proprietary = True
-
-                answer = self.os.execute(msg)
-
-                try:
-                    if not proprietary:
-                        logging.debug(str(R_APDU(answer)))
-                except:
-                    pass
-                logging.info("Response APDU (%d bytes):\n  %s", len(answer),
-                        hexdump(answer, indent=2))
-
-                self.__sendToVPICC(answer)
+                self.selecting = False
+                self.naming = False
+                self.requests.put((msg, tag))
+
+    def sendEvent(self, event, atr=None):
+        """
+        Tell vpcd about a change of the emulated card (one of
+        ``VPCD_EVENT_*``), optionally along with the card's new ATR. Returns
+        False if vpcd does not accept events.
+        """
+        if not self.features & VPCD_FEATURE_EVENTS:
+            return False
+        msg = inttostring(event)
+        if atr:
+            msg += atr
+        self.__sendToVPICC(msg, 0, _VPCD_FLAG_EVENT)
+        return True
+
+    def removeCard(self):
+        """ Emulate the removal of the card from the reader """
+        return self.sendEvent(VPCD_EVENT_REMOVED)
+
+    def insertCard(self, os=None):
+        """
+        Emulate the insertion of a card into the reader. If os is given, it
+        replaces the emulated card.
+        """
+        if os is not None:
+            self.os = os
+        return self.sendEvent(VPCD_EVENT_INSERTED, self.os.getATR())
+
+    def replaceCard(self, os):
+        """
+        Swap the emulated card for os without removing it from the reader
+        first
+        """
+        self.os = os
+        return self.sendEvent(VPCD_EVENT_ATR_CHANGED, self.os.getATR())
 
     def stop(self):
         self.sock.close()
@@ -0,0 +1,318 @@
+#
+# Copyright (C) 2026 Frank Morgner
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import errno
+import logging
+import mmap
+import os
+import socket
+import struct
+import tempfile
+import threading
+import unittest
+import zlib
+
+from virtualsmartcard import SharedMemory
+from virtualsmartcard.VirtualSmartcard import VirtualICC, \
+    VPCD_CTRL_ATR, VPCD_CTRL_HELLO, VPCD_FEATURE_TAGGED, VPCD_FEATURE_LEN32, \
+    VPCD_FEATURE_EVENTS, VPCD_FEATURE_DEFLATE, VPCD_FEATURE_HEARTBEAT, \
+    VPCD_FEATURE_RESUME, VPCD_EVENT_INSERTED, VPCD_EVENT_REMOVED, VPCD_SLOT_ANY
+
+
+class VirtualICCProtocolTest(unittest.TestCase):
+    """Talks to VirtualICC the way vpcd does"""
+
+    def listen(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.bind(('localhost', 0))
+        server.listen(1)
+        return server, 'localhost', server.getsockname()[1]
+
+    def setUp(self):
+        (server, host, port) = self.listen()
+        self.vicc = VirtualICC(None, 'handler_test', host, port,
+                               logginglevel=logging.CRITICAL)
+        (self.sock, address) = server.accept()
+        server.close()
+        self.sock.settimeout(5)
+        thread = threading.Thread(target=self.vicc.run)
+        thread.daemon = True
+        thread.start()
+        self.tagged = False
+        self.len32 = False
+
+    def tearDown(self):
+        self.sock.close()
+        self.vicc.stop()
+
+    def recvall(self, size):
+        data = b""
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            self.assertTrue(chunk)
+            data += chunk
+        return data
+
+    def send(self, msg, tag=0, flags=0):
+        if self.len32:
+            header = struct.pack('!I', len(msg))
+        else:
+            header = struct.pack('!H', len(msg))
+        if self.tagged:
+            header += struct.pack('!BH', flags, tag)
+        self.sock.sendall(header + msg)
+
+    def recv(self):
+        if self.len32:
+            (size,) = struct.unpack('!I', self.recvall(4))
+        else:
+            (size,) = struct.unpack('!H', self.recvall(2))
+        tag = 0
+        self.flags = 0
+        if self.tagged:
+            (self.flags, tag) = struct.unpack('!BH', self.recvall(3))
+        return self.recvall(size), tag
+
+    def handshake(self, version, features):
+        self.send(bytes([VPCD_CTRL_HELLO]))
+        self.send(bytes([VPCD_CTRL_ATR]))
+        (hello, tag) = self.recv()
+        self.assertEqual(hello[:4], b"vpcd")
+        (atr, tag) = self.recv()
+        self.assertEqual(atr, self.vicc.os.getATR())
+        self.send(b"vpcd" + struct.pack('!BI', version, features))
+        self.tagged = bool(features & VPCD_FEATURE_TAGGED)
+        self.len32 = bool(features & VPCD_FEATURE_LEN32)
+        return struct.unpack('!BI', hello[4:])
+
+    def test_plain(self):
+        self.send(bytes([VPCD_CTRL_ATR]))
+        (atr, tag) = self.recv()
+        self.assertEqual(atr, self.vicc.os.getATR())
+
+    def test_tagged(self):
+        (version, features) = self.handshake(1, VPCD_FEATURE_TAGGED)
+        self.assertTrue(features & VPCD_FEATURE_TAGGED)
+        self.send(b"\x00\xa4\x04\x00\x02\x3f\x00", 0x1234)
+        self.send(bytes([VPCD_CTRL_ATR]), 0x4321)
+        responses = dict((tag, msg) for (msg, tag) in
+                         (self.recv(), self.recv()))
+        self.assertEqual(responses[0x4321], self.vicc.os.getATR())
+        self.assertEqual(responses[0x1234][-2:], b"\x6d\x00")
+
+    def test_len32(self):
+        (version, features) = self.handshake(2, VPCD_FEATURE_LEN32)
+        self.assertGreaterEqual(version, 2)
+        self.assertTrue(features & VPCD_FEATURE_LEN32)
+        # an extended APDU which does not fit into a 16 bit frame
+        apdu = b"\x00\xd6\x00\x00\x00\xff\xff" + b"\x00" * 0xFFFF
+        self.send(apdu)
+        (rapdu, tag) = self.recv()
+        self.assertEqual(len(rapdu), 2)
+
+    def test_events(self):
+        (version, features) = self.handshake(
+            2, VPCD_FEATURE_TAGGED | VPCD_FEATURE_EVENTS)
+        self.assertTrue(features & VPCD_FEATURE_EVENTS)
+        # wait for the features to be in use
+        self.send(bytes([VPCD_CTRL_ATR]), 1)
+        self.recv()
+        self.assertTrue(self.vicc.removeCard())
+        (event, tag) = self.recv()
+        self.assertEqual((self.flags, tag, event),
+                         (1, 0, bytes([VPCD_EVENT_REMOVED])))
+        self.assertTrue(self.vicc.insertCard())
+        (event, tag) = self.recv()
+        self.assertEqual(self.flags, 1)
+        self.assertEqual(event,
+                         bytes([VPCD_EVENT_INSERTED]) + self.vicc.os.getATR())
+
+    def test_deflate(self):
+        (version, features) = self.handshake(
+            2, VPCD_FEATURE_TAGGED | VPCD_FEATURE_LEN32 | VPCD_FEATURE_DEFLATE)
+        self.assertTrue(features & VPCD_FEATURE_DEFLATE)
+        # a card which echoes the command
+        self.vicc.os.execute = lambda msg: msg + b"\x90\x00"
+        apdu = b"\x00\xd6\x00\x00\x00\x10\x00" + b"\x00" * 0x1000
+        self.send(struct.pack('!I', len(apdu)) + zlib.compress(apdu), 1, 2)
+        (rapdu, tag) = self.recv()
+        self.assertEqual((self.flags, tag), (2, 1))
+        self.assertLess(len(rapdu), len(apdu))
+        self.assertEqual(struct.unpack('!I', rapdu[:4])[0], len(apdu) + 2)
+        self.assertEqual(zlib.decompress(rapdu[4:]), apdu + b"\x90\x00")
+        # short responses are not worth compressing
+        self.send(b"\x00\xa4\x04\x00\x02\x3f\x00", 2)
+        (rapdu, tag) = self.recv()
+        self.assertEqual((self.flags, tag), (0, 2))
+        self.assertEqual(rapdu[-2:], b"\x90\x00")
+
+    def test_heartbeat(self):
+        (version, features) = self.handshake(
+            2, VPCD_FEATURE_TAGGED | VPCD_FEATURE_HEARTBEAT)
+        self.assertTrue(features & VPCD_FEATURE_HEARTBEAT)
+        # a card which takes its time
+        event = threading.Event()
+        self.vicc.os.execute = lambda msg: event.wait(5) and b"\x90\x00"
+        self.send(b"\x00\xa4\x04\x00\x02\x3f\x00", 1)
+        # the heartbeat is answered while the command is still processed
+        self.send(b"", 2, 4)
+        (msg, tag) = self.recv()
+        self.assertEqual((self.flags, tag, msg), (4, 2, b""))
+        event.set()
+        (rapdu, tag) = self.recv()
+        self.assertEqual((self.flags, tag, rapdu), (0, 1, b"\x90\x00"))
+
+    def test_resume(self):
+        (version, features) = self.handshake(
+            2, VPCD_FEATURE_TAGGED | VPCD_FEATURE_RESUME)
+        self.assertTrue(features & VPCD_FEATURE_RESUME)
+        self.send(b"sess" + bytes(8), 1)
+        (session, tag) = self.recv()
+        self.assertEqual((session[:4], tag), (b"sess", 1))
+        # a card which counts the commands
+        calls = []
+        self.vicc.os.execute = \
+            lambda msg: calls.append(msg) or bytes([len(calls), 0x90, 0x00])
+        apdu = b"\x00\xa4\x04\x00\x02\x3f\x00"
+        self.send(apdu, 2)
+        self.assertEqual(self.recv(), (b"\x01\x90\x00", 2))
+        # the tags wrap around, so the same tag is a new command
+        self.send(apdu, 2)
+        (rapdu, tag) = self.recv()
+        self.assertEqual(rapdu, b"\x02\x90\x00")
+        # the connection is lost and VirtualICC connects again
+        (theirs, ours) = socket.socketpair()
+        self.vicc.connectToPort = lambda host, port: theirs
+        self.sock.close()
+        self.sock = ours
+        self.sock.settimeout(5)
+        self.tagged = self.len32 = False
+        self.handshake(2, VPCD_FEATURE_TAGGED | VPCD_FEATURE_RESUME)
+        self.send(session, 3)
+        self.assertEqual(self.recv(), (session, 3))
+        # the command sent again is answered without executing it again
+        self.send(apdu, 2)
+        self.assertEqual(self.recv(), (rapdu, 2))
+        self.send(apdu, 4)
+        self.assertEqual(self.recv(), (b"\x03\x90\x00", 4))
+        self.assertEqual(len(calls), 3)
+
+    def test_no_events(self):
+        self.handshake(2, VPCD_FEATURE_TAGGED)
+        self.send(bytes([VPCD_CTRL_ATR]), 1)
+        self.recv()
+        self.assertFalse(self.vicc.removeCard())
+
+
+class VirtualICCAnnounceTest(unittest.TestCase):
+    """VirtualICC names its slot before vpcd speaks"""
+
+    def connect(self, slot):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.bind(('localhost', 0))
+        server.listen(1)
+        vicc = VirtualICC(None, 'handler_test', 'localhost',
+                          server.getsockname()[1], slot=slot,
+                          logginglevel=logging.CRITICAL)
+        (sock, address) = server.accept()
+        server.close()
+        sock.settimeout(5)
+        self.addCleanup(sock.close)
+        self.addCleanup(vicc.stop)
+        return sock
+
+    def test_slot(self):
+        sock = self.connect(3)
+        self.assertEqual(sock.recv(8), b"\x00\x06slot\x00\x03")
+
+    def test_any_slot(self):
+        sock = self.connect(VPCD_SLOT_ANY)
+        self.assertEqual(sock.recv(8), b"\x00\x06slot\xff\xff")
+
+
+@unittest.skipUnless(hasattr(socket, 'AF_UNIX'), "requires Unix domain sockets")
+class VirtualICCUnixTest(VirtualICCProtocolTest):
+    """Same as above, but via a Unix domain socket"""
+
+    def listen(self):
+        self.path = os.path.join(tempfile.mkdtemp(), 'vpcd.sock')
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        server.bind(self.path)
+        server.listen(1)
+        return server, 'unix:' + self.path, 0
+
+    def tearDown(self):
+        VirtualICCProtocolTest.tearDown(self)
+        os.unlink(self.path)
+        os.rmdir(os.path.dirname(self.path))
+
+
+@unittest.skipUnless(SharedMemory._SYS_futex is not None
+                     and os.path.isdir('/dev/shm'), "requires shared memory")
+class VirtualICCSharedMemoryTest(VirtualICCProtocolTest):
+    """Same as above, but via the shared memory created the way vpcd does"""
+
+    size = 1 << 16
+
+    def setUp(self):
+        self.name = 'vpcd-test-%d' % os.getpid()
+        self.path = os.path.join('/dev/shm', self.name)
+        header_len = SharedMemory._HEADER_LEN
+        control_len = SharedMemory._CONTROL_LEN
+        with open(self.path, 'wb+') as f:
+            f.truncate(header_len + 2 * (control_len + self.size))
+            self.mem = mmap.mmap(f.fileno(), 0)
+        struct.pack_into('=7I', self.mem, 0, SharedMemory.SHM_MAGIC,
+                         SharedMemory.SHM_VERSION, SharedMemory.SHM_LISTENING,
+                         0, os.getpid(), 0, self.size)
+        self.vicc = VirtualICC(None, 'handler_test', 'shm:/' + self.name, 0,
+                               logginglevel=logging.CRITICAL)
+
+        # vpcd's end uses the rings the other way round
+        self.sock = SharedMemory.SharedMemorySocket.__new__(
+            SharedMemory.SharedMemorySocket)
+        self.sock.mem = self.mem
+        self.sock.state = SharedMemory.ctypes.c_uint32.from_buffer(self.mem, 8)
+        self.sock.tx = SharedMemory._Ring(self.mem, header_len, self.size)
+        self.sock.rx = SharedMemory._Ring(
+            self.mem, header_len + control_len + self.size, self.size)
+        self.sock.generation = struct.unpack_from('=I', self.mem, 12)[0]
+        self.sock.vpcd_pid = os.getpid()
+        self.sock.closed = False
+
+        thread = threading.Thread(target=self.vicc.run)
+        thread.daemon = True
+        thread.start()
+        self.tagged = False
+        self.len32 = False
+
+    def tearDown(self):
+        VirtualICCProtocolTest.tearDown(self)
+        os.unlink(self.path)
+
+    def test_attached(self):
+        self.assertEqual(self.sock.state.value, SharedMemory.SHM_CONNECTED)
+        # only one vicc may be attached at a time
+        with self.assertRaises(socket.error) as cm:
+            SharedMemory.SharedMemorySocket(self.name)
+        self.assertEqual(cm.exception.errno, errno.EBUSY)
+
+
+if __name__ == "__main__":
+    unittest.main()